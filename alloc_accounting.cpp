@@ -0,0 +1,141 @@
+#include "alloc_accounting.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::atomic<size_t> allocations;
+
+void* countedAlloc(size_t size, std::align_val_t align)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    size = size == 0 ? 1 : size;
+    void* ptr = nullptr;
+    if (align <= std::align_val_t{__STDCPP_DEFAULT_NEW_ALIGNMENT__})
+    {
+        ptr = std::malloc(size);
+    }
+    else
+    {
+        const auto alignment = static_cast<size_t>(align);
+        const size_t paddedSize =
+            (size + alignment - 1) / alignment * alignment;
+        ptr = std::aligned_alloc(alignment, paddedSize);
+    }
+    return ptr;
+}
+} // namespace
+
+size_t allocationCount()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+AllocationCheck::~AllocationCheck()
+{
+    const size_t count = allocationCount() - startCount;
+    if (count != 0)
+    {
+        std::fprintf(stderr, "%zu heap allocation(s) while handling %s\n",
+                     count, name);
+        std::abort();
+    }
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = countedAlloc(size, std::align_val_t{0});
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    void* ptr = countedAlloc(size, align);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size, std::align_val_t{0});
+}
+
+void* operator new(size_t size, std::align_val_t align,
+                   const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size, align);
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void* operator new[](size_t size, std::align_val_t align,
+                     const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, align, tag);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t /* align */) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t /* size */,
+                     std::align_val_t /* align */) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t /* size */) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t /* align */) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, size_t /* size */,
+                       std::align_val_t /* align */) noexcept
+{
+    std::free(ptr);
+}
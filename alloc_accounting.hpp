@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+// Heap allocation accounting, enabled with -Dalloc_accounting=true. That build
+// replaces the global allocator with a counting one, and AllocationCheck
+// aborts if anything in its scope allocated. The steady-state event path is
+// expected to make no allocations at all, so this turns a regression into an
+// immediate failure.
+
+#ifdef BATTERY_STATS_ALLOC_ACCOUNTING
+
+size_t allocationCount();
+
+class AllocationCheck
+{
+  public:
+    explicit AllocationCheck(const char* name) :
+        name(name), startCount(allocationCount())
+    {}
+    AllocationCheck(const AllocationCheck&) = delete;
+    AllocationCheck& operator=(const AllocationCheck&) = delete;
+    ~AllocationCheck();
+
+  private:
+    const char* name;
+    size_t startCount;
+};
+
+#else
+
+class AllocationCheck
+{
+  public:
+    explicit AllocationCheck(const char* /* name */) {}
+};
+
+#endif
@@ -0,0 +1,574 @@
+#include "arrow_writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+
+namespace arrow
+{
+
+namespace
+{
+
+// Just enough of a FlatBuffers encoder for Arrow's metadata. Objects are laid
+// out front to back, each child after its parent, so every uoffset points
+// forward as the format requires.
+namespace fb
+{
+
+struct Node;
+
+struct Slot
+{
+    uint16_t id;
+    std::array<uint8_t, 8> bytes{};
+    uint8_t size = 0;
+    std::shared_ptr<Node> child{};
+};
+
+struct Node
+{
+    enum class Kind
+    {
+        String,
+        Table,
+        TableVector,
+        StructVector,
+    };
+
+    Kind kind;
+    std::string string{};
+    std::vector<Slot> slots{};
+    std::vector<Node> tables{};
+    // Structs in Arrow's metadata are all 8-byte aligned
+    std::vector<uint8_t> structData{};
+    uint32_t structCount = 0;
+};
+
+template <typename T>
+Slot scalar(uint16_t id, T value)
+{
+    Slot slot{.id = id};
+    std::memcpy(slot.bytes.data(), &value, sizeof(value));
+    slot.size = sizeof(value);
+    return slot;
+}
+
+Slot offset(uint16_t id, Node child)
+{
+    return {.id = id, .child = std::make_shared<Node>(std::move(child))};
+}
+
+Node table(std::vector<Slot> slots)
+{
+    return {.kind = Node::Kind::Table, .slots = std::move(slots)};
+}
+
+Node string(std::string_view str)
+{
+    return {.kind = Node::Kind::String, .string = std::string(str)};
+}
+
+Node tableVector(std::vector<Node> tables)
+{
+    return {.kind = Node::Kind::TableVector, .tables = std::move(tables)};
+}
+
+template <typename T>
+Node structVector(const std::vector<T>& structs)
+{
+    static_assert(alignof(T) == 8);
+    Node node{.kind = Node::Kind::StructVector,
+              .structCount = static_cast<uint32_t>(structs.size())};
+    node.structData.resize(structs.size() * sizeof(T));
+    std::memcpy(node.structData.data(), structs.data(),
+                node.structData.size());
+    return node;
+}
+
+class Serializer
+{
+  public:
+    std::vector<uint8_t> finish(const Node& root)
+    {
+        buf.assign(sizeof(uint32_t), 0);
+        const size_t rootPos = write(root);
+        put<uint32_t>(0, static_cast<uint32_t>(rootPos));
+        align(8);
+        return std::move(buf);
+    }
+
+  private:
+    void align(size_t alignment)
+    {
+        buf.resize((buf.size() + alignment - 1) / alignment * alignment, 0);
+    }
+
+    template <typename T>
+    void put(size_t pos, T value)
+    {
+        std::memcpy(buf.data() + pos, &value, sizeof(value));
+    }
+
+    template <typename T>
+    void append(T value)
+    {
+        const size_t pos = buf.size();
+        buf.resize(pos + sizeof(value));
+        put(pos, value);
+    }
+
+    void link(size_t from, size_t to)
+    {
+        put<uint32_t>(from, static_cast<uint32_t>(to - from));
+    }
+
+    size_t write(const Node& node)
+    {
+        switch (node.kind)
+        {
+            case Node::Kind::String:
+            {
+                align(4);
+                const size_t pos = buf.size();
+                append(static_cast<uint32_t>(node.string.size()));
+                buf.insert(buf.end(), node.string.begin(), node.string.end());
+                buf.push_back(0);
+                return pos;
+            }
+            case Node::Kind::Table:
+                return writeTable(node);
+            case Node::Kind::TableVector:
+            {
+                align(4);
+                const size_t pos = buf.size();
+                append(static_cast<uint32_t>(node.tables.size()));
+                const size_t slotsPos = buf.size();
+                buf.resize(slotsPos + node.tables.size() * sizeof(uint32_t));
+                for (size_t i = 0; i < node.tables.size(); ++i)
+                {
+                    const size_t tablePos = write(node.tables[i]);
+                    link(slotsPos + i * sizeof(uint32_t), tablePos);
+                }
+                return pos;
+            }
+            case Node::Kind::StructVector:
+            {
+                // The length prefix goes just before 8-byte aligned data
+                align(4);
+                if ((buf.size() + sizeof(uint32_t)) % 8 != 0)
+                {
+                    append<uint32_t>(0);
+                }
+                const size_t pos = buf.size();
+                append(node.structCount);
+                buf.insert(buf.end(), node.structData.begin(),
+                           node.structData.end());
+                return pos;
+            }
+        }
+        return 0;
+    }
+
+    size_t writeTable(const Node& node)
+    {
+        // Place fields largest first, each aligned to its size, after the
+        // vtable offset. The table itself starts 8-byte aligned.
+        std::vector<const Slot*> order;
+        uint16_t slotCount = 0;
+        for (const Slot& slot : node.slots)
+        {
+            order.push_back(&slot);
+            slotCount = std::max<uint16_t>(slotCount, slot.id + 1);
+        }
+        const auto fieldSize = [](const Slot* slot) -> size_t {
+            return slot->child ? sizeof(uint32_t) : slot->size;
+        };
+        std::stable_sort(order.begin(), order.end(),
+                         [&](const Slot* a, const Slot* b) {
+            return fieldSize(a) > fieldSize(b);
+        });
+
+        std::vector<uint16_t> fieldOffsets(slotCount, 0);
+        size_t tableSize = sizeof(int32_t);
+        for (const Slot* slot : order)
+        {
+            const size_t size = fieldSize(slot);
+            tableSize = (tableSize + size - 1) / size * size;
+            fieldOffsets[slot->id] = static_cast<uint16_t>(tableSize);
+            tableSize += size;
+        }
+
+        align(2);
+        const size_t vtablePos = buf.size();
+        append(static_cast<uint16_t>(sizeof(uint16_t) * (2 + slotCount)));
+        append(static_cast<uint16_t>(tableSize));
+        for (uint16_t fieldOffset : fieldOffsets)
+        {
+            append(fieldOffset);
+        }
+
+        align(8);
+        const size_t tablePos = buf.size();
+        buf.resize(tablePos + tableSize, 0);
+        put<int32_t>(tablePos, static_cast<int32_t>(tablePos - vtablePos));
+
+        for (const Slot& slot : node.slots)
+        {
+            if (!slot.child)
+            {
+                std::memcpy(buf.data() + tablePos + fieldOffsets[slot.id],
+                            slot.bytes.data(), slot.size);
+            }
+        }
+        for (const Slot& slot : node.slots)
+        {
+            if (slot.child)
+            {
+                const size_t childPos = write(*slot.child);
+                link(tablePos + fieldOffsets[slot.id], childPos);
+            }
+        }
+        return tablePos;
+    }
+
+    std::vector<uint8_t> buf;
+};
+
+} // namespace fb
+
+// Values from Arrow's Schema.fbs and Message.fbs
+constexpr int16_t metadataV5 = 4;
+constexpr uint8_t headerSchema = 1;
+constexpr uint8_t headerRecordBatch = 3;
+constexpr uint8_t typeInt = 2;
+constexpr uint8_t typeFloatingPoint = 3;
+constexpr uint8_t typeUtf8 = 5;
+constexpr uint8_t typeTimestamp = 10;
+constexpr uint8_t typeDuration = 18;
+constexpr int16_t precisionDouble = 2;
+constexpr int16_t unitMillisecond = 1;
+
+constexpr std::array<char, 8> fileMagic = {'A', 'R', 'R', 'O',
+                                           'W', '1', 0,   0};
+
+struct FieldNode
+{
+    int64_t length;
+    int64_t nullCount;
+};
+
+struct Buffer
+{
+    int64_t offset;
+    int64_t length;
+};
+
+struct FooterBlock
+{
+    int64_t offset;
+    int32_t metadataLength;
+    int32_t padding{};
+    int64_t bodyLength;
+};
+
+fb::Node typeTable(ColumnType type)
+{
+    switch (type)
+    {
+        case ColumnType::Int64:
+            return fb::table(
+                {fb::scalar<int32_t>(0, 64), fb::scalar<uint8_t>(1, true)});
+        case ColumnType::UInt32:
+            return fb::table(
+                {fb::scalar<int32_t>(0, 32), fb::scalar<uint8_t>(1, false)});
+        case ColumnType::Float64:
+            return fb::table({fb::scalar<int16_t>(0, precisionDouble)});
+        case ColumnType::TimestampMs:
+            return fb::table({fb::scalar<int16_t>(0, unitMillisecond),
+                              fb::offset(1, fb::string("UTC"))});
+        case ColumnType::DurationMs:
+            return fb::table({fb::scalar<int16_t>(0, unitMillisecond)});
+        case ColumnType::Utf8:
+            return fb::table({});
+    }
+    return fb::table({});
+}
+
+uint8_t typeId(ColumnType type)
+{
+    switch (type)
+    {
+        case ColumnType::Int64:
+        case ColumnType::UInt32:
+            return typeInt;
+        case ColumnType::Float64:
+            return typeFloatingPoint;
+        case ColumnType::TimestampMs:
+            return typeTimestamp;
+        case ColumnType::DurationMs:
+            return typeDuration;
+        case ColumnType::Utf8:
+            return typeUtf8;
+    }
+    return 0;
+}
+
+fb::Node schemaTable(const std::vector<Field>& schema)
+{
+    std::vector<fb::Node> fields;
+    for (const Field& field : schema)
+    {
+        fields.push_back(fb::table({
+            fb::offset(0, fb::string(field.name)),
+            fb::scalar<uint8_t>(1, field.nullable),
+            fb::scalar<uint8_t>(2, typeId(field.type)),
+            fb::offset(3, typeTable(field.type)),
+            fb::offset(5, fb::tableVector({})), // children
+        }));
+    }
+    return fb::table({fb::scalar<int16_t>(0, 0), // little endian
+                      fb::offset(1, fb::tableVector(std::move(fields)))});
+}
+
+std::vector<uint8_t> message(uint8_t headerType, fb::Node header,
+                             int64_t bodyLength)
+{
+    return fb::Serializer().finish(fb::table({
+        fb::scalar<int16_t>(0, metadataV5),
+        fb::scalar<uint8_t>(1, headerType),
+        fb::offset(2, std::move(header)),
+        fb::scalar<int64_t>(3, bodyLength),
+    }));
+}
+
+size_t padded(size_t len)
+{
+    return (len + 7) / 8 * 8;
+}
+
+} // namespace
+
+FileWriter::FileWriter(std::ostream& out, std::vector<Field> schema,
+                       size_t batchRows) :
+    out(out), schema(std::move(schema)), batchRows(batchRows),
+    columns(this->schema.size())
+{
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        if (this->schema[i].type == ColumnType::Utf8)
+        {
+            columns[i].offsets.push_back(0);
+        }
+    }
+
+    write(fileMagic.data(), fileMagic.size());
+    writeMessage(message(headerSchema, schemaTable(this->schema), 0));
+}
+
+void FileWriter::append(size_t column, int64_t value)
+{
+    setValid(columns[column], true);
+    auto& data = columns[column].data;
+    if (schema[column].type == ColumnType::UInt32)
+    {
+        const auto narrow = static_cast<uint32_t>(value);
+        const auto* bytes = reinterpret_cast<const std::byte*>(&narrow);
+        data.insert(data.end(), bytes, bytes + sizeof(narrow));
+    }
+    else
+    {
+        const auto* bytes = reinterpret_cast<const std::byte*>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(value));
+    }
+}
+
+void FileWriter::append(size_t column, double value)
+{
+    setValid(columns[column], true);
+    auto& data = columns[column].data;
+    const auto* bytes = reinterpret_cast<const std::byte*>(&value);
+    data.insert(data.end(), bytes, bytes + sizeof(value));
+}
+
+void FileWriter::append(size_t column, std::string_view value)
+{
+    Column& col = columns[column];
+    setValid(col, true);
+    const auto* bytes = reinterpret_cast<const std::byte*>(value.data());
+    col.data.insert(col.data.end(), bytes, bytes + value.size());
+    col.offsets.push_back(static_cast<int32_t>(col.data.size()));
+}
+
+void FileWriter::appendNull(size_t column)
+{
+    // Null slots still take up space in the data buffer
+    Column& col = columns[column];
+    switch (schema[column].type)
+    {
+        case ColumnType::Utf8:
+            col.offsets.push_back(static_cast<int32_t>(col.data.size()));
+            break;
+        case ColumnType::UInt32:
+            col.data.resize(col.data.size() + sizeof(uint32_t));
+            break;
+        default:
+            col.data.resize(col.data.size() + sizeof(int64_t));
+            break;
+    }
+    setValid(col, false);
+}
+
+void FileWriter::setValid(Column& col, bool valid)
+{
+    if (rows % 8 == 0)
+    {
+        col.validity.push_back(0);
+    }
+    if (valid)
+    {
+        col.validity.back() |= static_cast<uint8_t>(1 << (rows % 8));
+    }
+    else
+    {
+        ++col.nullCount;
+    }
+}
+
+void FileWriter::endRow()
+{
+    if (++rows == batchRows)
+    {
+        writeBatch();
+    }
+}
+
+void FileWriter::finish()
+{
+    if (finished)
+    {
+        return;
+    }
+    finished = true;
+
+    if (rows > 0)
+    {
+        writeBatch();
+    }
+
+    // End-of-stream marker, then the footer pointing back at each batch
+    const std::array<uint32_t, 2> eos = {0xffffffff, 0};
+    write(eos.data(), sizeof(eos));
+
+    std::vector<FooterBlock> blocks;
+    for (const Block& block : batches)
+    {
+        blocks.push_back({.offset = block.offset,
+                          .metadataLength = block.metadataLength,
+                          .bodyLength = block.bodyLength});
+    }
+    const std::vector<uint8_t> footer = fb::Serializer().finish(fb::table({
+        fb::scalar<int16_t>(0, metadataV5),
+        fb::offset(1, schemaTable(schema)),
+        fb::offset(3, fb::structVector(blocks)),
+    }));
+    write(footer.data(), footer.size());
+    const auto footerSize = static_cast<int32_t>(footer.size());
+    write(&footerSize, sizeof(footerSize));
+    write(fileMagic.data(), 6);
+    out.flush();
+}
+
+void FileWriter::writeBatch()
+{
+    std::vector<FieldNode> nodes;
+    std::vector<Buffer> buffers;
+    int64_t bodyLength = 0;
+    const auto addBuffer = [&](size_t len) {
+        buffers.push_back({.offset = bodyLength,
+                           .length = static_cast<int64_t>(len)});
+        bodyLength += static_cast<int64_t>(padded(len));
+    };
+
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        const Column& col = columns[i];
+        nodes.push_back({.length = static_cast<int64_t>(rows),
+                         .nullCount = static_cast<int64_t>(col.nullCount)});
+        // The validity bitmap may be left out when nothing is null
+        addBuffer(col.nullCount > 0 ? col.validity.size() : 0);
+        if (schema[i].type == ColumnType::Utf8)
+        {
+            addBuffer(col.offsets.size() * sizeof(int32_t));
+        }
+        addBuffer(col.data.size());
+    }
+
+    const int64_t offset = position;
+    const int32_t metadataLength = writeMessage(message(
+        headerRecordBatch,
+        fb::table({
+            fb::scalar<int64_t>(0, static_cast<int64_t>(rows)),
+            fb::offset(1, fb::structVector(nodes)),
+            fb::offset(2, fb::structVector(buffers)),
+        }),
+        bodyLength));
+
+    for (size_t i = 0; i < columns.size(); ++i)
+    {
+        Column& col = columns[i];
+        if (col.nullCount > 0)
+        {
+            write(col.validity.data(), col.validity.size());
+            pad(8);
+        }
+        col.validity.clear();
+        col.nullCount = 0;
+        if (schema[i].type == ColumnType::Utf8)
+        {
+            write(col.offsets.data(), col.offsets.size() * sizeof(int32_t));
+            pad(8);
+            col.offsets.resize(1);
+        }
+        write(col.data.data(), col.data.size());
+        pad(8);
+        col.data.clear();
+    }
+
+    batches.push_back({.offset = offset,
+                       .metadataLength = metadataLength,
+                       .bodyLength = bodyLength});
+    rows = 0;
+}
+
+int32_t FileWriter::writeMessage(const std::vector<uint8_t>& metadata)
+{
+    // Continuation marker and length, then the flatbuffer padded so the body
+    // starts 8-byte aligned
+    const auto length = static_cast<int32_t>(padded(metadata.size()));
+    const std::array<int32_t, 2> prefix = {-1, length};
+    write(prefix.data(), sizeof(prefix));
+    write(metadata.data(), metadata.size());
+    pad(8);
+    return static_cast<int32_t>(sizeof(prefix)) + length;
+}
+
+void FileWriter::write(const void* data, size_t len)
+{
+    out.write(static_cast<const char*>(data),
+              static_cast<std::streamsize>(len));
+    position += static_cast<int64_t>(len);
+}
+
+void FileWriter::pad(size_t alignment)
+{
+    static constexpr std::array<char, 8> zeros{};
+    const size_t remainder = static_cast<size_t>(position) % alignment;
+    if (remainder != 0)
+    {
+        write(zeros.data(), alignment - remainder);
+    }
+}
+
+} // namespace arrow
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Minimal writer for the Arrow IPC file format (Feather v2), enough for flat
+// tables of integer, timestamp, duration and string columns.
+// Rows are buffered into record batches of a fixed size and written out as each
+// batch fills, so memory use doesn't depend on the table size.
+namespace arrow
+{
+
+enum class ColumnType
+{
+    Int64,
+    UInt32,
+    Float64,
+    TimestampMs, // int64 ms since the epoch, UTC
+    DurationMs,  // int64 ms
+    Utf8,
+};
+
+struct Field
+{
+    std::string name;
+    ColumnType type;
+    bool nullable = false;
+};
+
+class FileWriter
+{
+  public:
+    static constexpr size_t defaultBatchRows = 64 * 1024;
+
+    // Writes the header and schema. Throws std::ios_base::failure on write
+    // errors if out has exceptions enabled.
+    FileWriter(std::ostream& out, std::vector<Field> schema,
+               size_t batchRows = defaultBatchRows);
+
+    // Appends one value to the given column of the current row. Every column
+    // must be given a value before endRow().
+    void append(size_t column, int64_t value);
+    void append(size_t column, double value);
+    void append(size_t column, std::string_view value);
+    void appendNull(size_t column);
+    void endRow();
+
+    // Writes any partial batch and the footer
+    void finish();
+
+  private:
+    struct Column
+    {
+        std::vector<std::byte> data;
+        std::vector<int32_t> offsets; // Utf8 only
+        std::vector<uint8_t> validity;
+        size_t nullCount = 0;
+    };
+
+    struct Block
+    {
+        int64_t offset;
+        int32_t metadataLength;
+        int64_t bodyLength;
+    };
+
+    void setValid(Column& col, bool valid);
+    void writeBatch();
+    // Writes a message prefix and flatbuffer, returning the metadata length
+    // including prefix and padding
+    int32_t writeMessage(const std::vector<uint8_t>& metadata);
+    void write(const void* data, size_t len);
+    void pad(size_t alignment);
+
+    std::ostream& out;
+    std::vector<Field> schema;
+    size_t batchRows;
+    std::vector<Column> columns;
+    size_t rows = 0;
+    int64_t position = 0;
+    std::vector<Block> batches;
+    bool finished = false;
+};
+
+} // namespace arrow
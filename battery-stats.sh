@@ -1,4 +1,48 @@
 #!/bin/sh
 # Install to /usr/lib/systemd/system-sleep/
+#
+# Sends a fresh battery reading (uWh) along with the event, read straight from
+# sysfs just before suspend and just after resume, so the daemon doesn't have
+# to rely on whatever UPower last sent, and the time it was read (microseconds
+# since the epoch) where date can tell. Each read has a one second timeout so a
+# slow fuel gauge can't hold up suspend; without a reading the event is sent
+# on its own.
+#
+# Batteries that only report charge_now are converted to energy as UPower
+# does, at the design voltage (voltage_min_design, else voltage_max_design)
+# rather than the live one, so the reading is on the same scale as UPower's.
+# Without a design voltage no reading is sent.
 
-busctl emit /BatteryStats BatteryStats.Sleep SystemdSleepEvent sss "$1" "$2" "$SYSTEMD_SLEEP_ACTION"
+energy=
+read_time=
+for supply in /sys/class/power_supply/*; do
+    [ "$(cat "$supply/type" 2>/dev/null)" = Battery ] || continue
+    # Skip peripherals such as mice
+    [ "$(cat "$supply/scope" 2>/dev/null)" = Device ] && continue
+    if now=$(timeout 1 cat "$supply/energy_now" 2>/dev/null); then
+        energy=$now
+    elif charge=$(timeout 1 cat "$supply/charge_now" 2>/dev/null); then
+        for design in voltage_min_design voltage_max_design; do
+            voltage=$(cat "$supply/$design" 2>/dev/null)
+            if [ "${voltage:-0}" -gt 0 ] 2>/dev/null; then
+                # uAh * mV / 1000 = uWh
+                energy=$((charge * (voltage / 1000) / 1000))
+                break
+            fi
+        done
+    fi
+    # GNU date has %N; others print it as is
+    read_time=$(date +%s%6N)
+    case $read_time in
+        *[!0-9]*) read_time= ;;
+    esac
+    break
+done
+
+if [ -n "$energy" ] && [ -n "$read_time" ]; then
+    busctl emit /BatteryStats BatteryStats.Sleep SystemdSleepEvent ssstt "$1" "$2" "$SYSTEMD_SLEEP_ACTION" "$energy" "$read_time"
+elif [ -n "$energy" ]; then
+    busctl emit /BatteryStats BatteryStats.Sleep SystemdSleepEvent ssst "$1" "$2" "$SYSTEMD_SLEEP_ACTION" "$energy"
+else
+    busctl emit /BatteryStats BatteryStats.Sleep SystemdSleepEvent sss "$1" "$2" "$SYSTEMD_SLEEP_ACTION"
+fi
@@ -0,0 +1,997 @@
+#pragma once
+
+#include "circuit_model.hpp"
+#include "energy_ledger.hpp"
+#include "energy_quantum.hpp"
+#include "history.hpp"
+#include "latency.hpp"
+#include "network_activity.hpp"
+#include "probes.hpp"
+#include "reading.hpp"
+#include "system_power.hpp"
+#include "wear.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+enum class Stat : uint32_t
+{
+    energy = 1,
+    rate = 2,
+    averageRate = 4,
+    relEnergy = 8,
+};
+
+// Usable as a template argument, so output can be specialized per stat set
+struct StatFlags
+{
+    constexpr StatFlags(Stat s) : value(std::to_underlying(s)) {}
+    constexpr StatFlags(uint32_t v = 0) : value(v) {}
+    uint32_t value;
+};
+
+constexpr StatFlags operator|(Stat a, Stat b)
+{
+    return StatFlags{std::to_underlying(a) | std::to_underlying(b)};
+}
+
+constexpr bool operator&(StatFlags flags, Stat a)
+{
+    return (flags.value & std::to_underlying(a)) != 0;
+}
+
+constexpr StatFlags operator|(StatFlags f, Stat s)
+{
+    f.value |= std::to_underlying(s);
+    return f;
+}
+
+// Writes e.g. "1h5m20s" to out. Writes nothing for durations under a second.
+template <typename Out, typename T>
+Out formatRelTime(Out out, T duration)
+{
+    const auto relTime =
+        std::chrono::duration_cast<std::chrono::seconds>(duration);
+
+    const auto hours = std::chrono::duration_cast<std::chrono::hours>(relTime);
+    if (hours.count() > 0)
+    {
+        out = std::format_to(out, "{}h", hours.count());
+    }
+    const auto mins =
+        std::chrono::duration_cast<std::chrono::minutes>(relTime) - hours;
+    if (mins.count() > 0)
+    {
+        out = std::format_to(out, "{}m", mins.count());
+    }
+    const auto secs = relTime - hours - mins;
+    if (secs.count() > 0)
+    {
+        out = std::format_to(out, "{}s", secs.count());
+    }
+    return out;
+}
+
+// Writes the local time as "YYYY-MM-DD HH:MM:SS TZ" to out. Goes through
+// strftime() rather than std::chrono::zoned_time so it never allocates.
+template <typename Out>
+Out formatLocalTime(Out out, std::chrono::system_clock::time_point time)
+{
+    const time_t t = std::chrono::system_clock::to_time_t(time);
+    tm local{};
+    localtime_r(&t, &local);
+
+    std::array<char, 64> buf;
+    const size_t len = strftime(buf.data(), buf.size(), "%F %T %Z", &local);
+    return std::copy_n(buf.data(), len, out);
+}
+
+class BatteryMonitor
+{
+  public:
+    explicit BatteryMonitor(HistoryWriter* history = nullptr) : history(history)
+    {
+        // Sized for the longest line print() produces, so appending to it
+        // never reallocates.
+        outputBuffer.reserve(256);
+    }
+
+    // Percentages are of the usable window, from EnergyEmpty up to
+    // EnergyFull or the charge threshold if there is one
+    struct EnergyStat
+    {
+        MicrowattHours energy;
+        std::optional<double> percent; // Only when the limits are known
+    };
+
+    struct RateStat
+    {
+        double watts;
+        std::optional<double> percentPerHour; // Only when the limits are known
+    };
+
+    // Stats are computed on first request after an input they depend on
+    // changes, then memoized, so sinks can poll them as often as they like.
+    // statsGeneration() changes whenever anything might have, letting a sink
+    // skip even the lookups when nothing happened.
+    const std::optional<EnergyStat>& energyStat()
+    {
+        return memoized<Stat::energy>(energyCache, [this] {
+            std::optional<EnergyStat> stat;
+            if (!readings.empty())
+            {
+                const MicrowattHours energy = readings.back().energy;
+                stat = EnergyStat{.energy = energy,
+                                  .percent = energyEmpty
+                                                 ? percentOf(energy -
+                                                             *energyEmpty)
+                                                 : std::nullopt};
+            }
+            return stat;
+        });
+    }
+
+    // Change over the last two readings
+    const std::optional<EnergyStat>& relEnergyStat()
+    {
+        return memoized<Stat::relEnergy>(relEnergyCache, [this] {
+            std::optional<EnergyStat> stat;
+            if (readings.size() > 1)
+            {
+                const MicrowattHours diff =
+                    readings.back().energy -
+                    readings[readings.size() - 2].energy;
+                stat = EnergyStat{.energy = diff, .percent = percentOf(diff)};
+            }
+            return stat;
+        });
+    }
+
+    // Rate since the latest reading at least rateQuanta fuel gauge steps
+    // away, so the error from the gauge's step size is about the same on any
+    // machine. Goes back no further than maxRateSpan or the last resume, and
+    // uses just the last two readings until the step size has been learned or
+    // when reporting a sleep.
+    const std::optional<RateStat>& rateStat()
+    {
+        return memoized<Stat::rate>(rateCache, [this] {
+            std::optional<RateStat> stat;
+            if (readings.size() > 1)
+            {
+                const Reading cur = readings.back();
+                Reading prev = readings[readings.size() - 2];
+                const auto step = quantum.quantum();
+                for (size_t i = readings.size() - 2;
+                     step && !printSuspendStats && i-- > 0;)
+                {
+                    if (std::abs(cur.energy - prev.energy) >=
+                        rateQuanta * *step)
+                    {
+                        break;
+                    }
+                    const Reading older = readings[i];
+                    if (older.relTime < rateWindowStart ||
+                        cur.relTime - older.relTime > maxRateSpan)
+                    {
+                        break;
+                    }
+                    prev = older;
+                }
+                stat = computeRate(cur.energy - prev.energy,
+                                   cur.time - prev.time);
+            }
+            return stat;
+        });
+    }
+
+    // Rate over the awake time since the cycle began
+    const std::optional<RateStat>& averageRateStat()
+    {
+        return memoized<Stat::averageRate>(averageRateCache, [this] {
+            std::optional<RateStat> stat;
+            if (readings.size() > 1 && firstReading)
+            {
+                const Reading cur = readings.back();
+                stat = computeRate(cur.energy - firstReading->energy -
+                                       ledger.totals().asleep,
+                                   cur.relTime - firstReading->relTime);
+            }
+            return stat;
+        });
+    }
+
+    uint64_t statsGeneration() const
+    {
+        return generation;
+    }
+
+    std::optional<BatteryState> batteryState() const
+    {
+        return currentBatteryState;
+    }
+
+    // Latest reading of the current cycle
+    std::optional<Reading> lastReading() const
+    {
+        return readings.empty() ? std::nullopt
+                                : std::optional<Reading>(readings.back());
+    }
+
+    // The fuel gauge's step size, once enough readings have been seen
+    std::optional<MicrowattHours> energyQuantum() const
+    {
+        return quantum.quantum();
+    }
+
+    std::optional<MicrowattHours> emptyEnergy() const
+    {
+        return energyEmpty;
+    }
+
+    std::optional<MicrowattHours> fullEnergy() const
+    {
+        return energyFull;
+    }
+
+    // Where charging stops: EnergyFull, or the charge threshold's share of it
+    std::optional<MicrowattHours> usableFullEnergy() const
+    {
+        if (!energyEmpty || !energyFull)
+        {
+            return std::nullopt;
+        }
+        if (!chargeThreshold)
+        {
+            return energyFull;
+        }
+        return *energyEmpty +
+               (*energyFull - *energyEmpty) * *chargeThreshold / 100;
+    }
+
+    std::optional<uint32_t> chargeEndThreshold() const
+    {
+        return chargeThreshold;
+    }
+
+    // Wear since the daemon started. Cycles need the battery limits to be
+    // known, for the state of charge.
+    const WearMetrics& wearMetrics() const
+    {
+        return wear.metrics();
+    }
+
+    // Time taken to process each batch of battery properties from UPower
+    const LatencyHistogram& processingLatency() const
+    {
+        return processingTimes;
+    }
+
+    void recordProcessingTime(std::chrono::nanoseconds duration)
+    {
+        processingTimes.record(duration);
+    }
+
+    // Power going into the battery, negative when discharging. UPower's
+    // EnergyRate is a magnitude, so the sign comes from the state.
+    double batteryPower()
+    {
+        if (lastWatts)
+        {
+            switch (currentBatteryState.value_or(BatteryState::Idle))
+            {
+                case BatteryState::Charging:
+                    return *lastWatts;
+                case BatteryState::Discharging:
+                    return -*lastWatts;
+                default:
+                    return 0;
+            }
+        }
+        const auto& rate = rateStat();
+        return rate ? rate->watts : 0;
+    }
+
+    // Whether the system runs off the adapter rather than the battery
+    bool onExternalPower() const
+    {
+        return currentBatteryState &&
+               *currentBatteryState != BatteryState::Discharging;
+    }
+
+    void setSystemPower(std::optional<SystemPower> power)
+    {
+        systemPowerEstimate = power;
+        if (power)
+        {
+            record(RecordKind::SystemPower, std::llround(power->watts * 1000));
+        }
+    }
+
+    // What the whole system draws while on AC, if it could be estimated
+    std::optional<SystemPower> systemPower() const
+    {
+        return systemPowerEstimate;
+    }
+
+    // Counts are recorded only when non-zero, and the radio state only when
+    // it changes, so an idle network costs no history space
+    void setNetworkActivity(const NetworkActivity::Interval& interval)
+    {
+        const std::array<std::pair<RecordKind, uint64_t>, 5> counts = {{
+            {RecordKind::NetworkReceived, interval.receivedKiB},
+            {RecordKind::NetworkSent, interval.sentKiB},
+            {RecordKind::NetworkReceivedPackets, interval.receivedPackets},
+            {RecordKind::NetworkSentPackets, interval.sentPackets},
+            {RecordKind::NetworkWakeups, interval.wakeups},
+        }};
+        for (const auto& [kind, count] : counts)
+        {
+            if (count != 0)
+            {
+                record(kind, static_cast<int64_t>(
+                                 std::min<uint64_t>(count, UINT32_MAX)));
+            }
+        }
+        if (interval.radios != radioState)
+        {
+            radioState = interval.radios;
+            record(RecordKind::RadioState, interval.radios);
+        }
+    }
+
+    // The latest fit of the equivalent circuit, once it has settled
+    std::optional<CircuitModel::Estimate> circuitEstimate() const
+    {
+        return model.estimate();
+    }
+
+    // Where the current cycle's energy went
+    EnergyLedger::Totals energyLedger() const
+    {
+        return ledger.totals();
+    }
+
+    // Whether each change is printed as a line on stdout (the default)
+    void setPrinting(bool enabled)
+    {
+        printing = enabled;
+    }
+
+    // Called after every change to the monitor's state, once it has been
+    // printed. Listeners must stay valid while the monitor is in use.
+    void addListener(std::function<void()> listener)
+    {
+        listeners.push_back(std::move(listener));
+    }
+
+    // `age` is how long ago the change happened, if it wasn't just now
+    void setPowerState(PowerState powerState,
+                       Clock::duration age = Clock::duration::zero())
+    {
+        invalidate(Stat::averageRate);
+
+        const auto [time, relTime] = timesAgo(age);
+        switch (powerState)
+        {
+            case PowerState::Suspended:
+                enterSuspendTime = time;
+                ledger.suspend(time);
+                model.restart();
+                record(RecordKind::Suspend, time, relTime, 0);
+                PROBE(power_state, std::to_underlying(powerState), 0);
+                print("Going to sleep");
+                break;
+            case PowerState::Awake:
+            {
+                if (!enterSuspendTime)
+                {
+                    break;
+                }
+                const auto suspendTime =
+                    std::chrono::duration_cast<std::chrono::milliseconds>(
+                        time - *enterSuspendTime);
+                ledger.resume(time);
+
+                enterSuspendTime.reset();
+                printSuspendStats = true;
+                record(RecordKind::Resume, time, relTime, 0);
+                PROBE(power_state, std::to_underlying(powerState),
+                      suspendTime.count());
+
+                std::array<char, 32> duration;
+                const auto durationEnd =
+                    formatRelTime(duration.data(), suspendTime);
+                const std::string_view durationStr(duration.data(),
+                                                   durationEnd);
+                std::array<char, 64> msg;
+                const auto result =
+                    std::format_to_n(msg.data(), msg.size(),
+                                     "Resumed from {} sleep", durationStr);
+                print(std::string_view(msg.data(), result.out));
+                break;
+            }
+            default:
+                break;
+        }
+        notify();
+    }
+
+    bool isSuspended() const
+    {
+        return enterSuspendTime.has_value();
+    }
+
+    // `energy` is the battery's energy as of the state change, if it's newer
+    // than the last reading
+    void setBatteryState(BatteryState batteryState,
+                         std::optional<MicrowattHours> energy = std::nullopt)
+    {
+        if (energy)
+        {
+            latestEnergy = energy;
+        }
+        if (batteryState == BatteryState::Idle && nearThreshold())
+        {
+            batteryState = BatteryState::AtThreshold;
+        }
+        // UPower repeats the state with other changes
+        if (batteryState == currentBatteryState)
+        {
+            return;
+        }
+
+        PROBE(battery_state, std::to_underlying(batteryState));
+        record(RecordKind::BatteryState, std::to_underlying(batteryState));
+        currentBatteryState = batteryState;
+
+        if (batteryState == BatteryState::Idle)
+        {
+            print("Battery idle");
+            notify();
+            // Don't clear stats when going idle
+            return;
+        }
+
+        firstReading.reset();
+        readings.clear();
+        ledger.reset();
+        if (batteryState == BatteryState::Discharging)
+        {
+            systemPowerEstimate.reset();
+        }
+        invalidate(allStats);
+
+        switch (batteryState)
+        {
+            case BatteryState::Charging:
+                print("Battery charging");
+                break;
+            case BatteryState::Discharging:
+                print("Battery discharging");
+                break;
+            case BatteryState::AtThreshold:
+                print("Battery held at charge threshold");
+                break;
+            default:
+                break;
+        }
+        notify();
+    }
+
+    void setBatteryLimits(MicrowattHours empty, MicrowattHours full)
+    {
+        if (energyEmpty != empty)
+        {
+            record(RecordKind::EnergyEmpty, empty);
+        }
+        if (energyFull != full)
+        {
+            record(RecordKind::EnergyFull, full);
+        }
+        const bool changed = energyEmpty != empty || energyFull != full;
+        energyEmpty = empty;
+        energyFull = full;
+        if (changed)
+        {
+            invalidate(allStats);
+            notify();
+        }
+    }
+
+    // Sets the level charging stops at, in percent of EnergyFull. Either
+    // argument may be missing when only the other changed. A threshold of 0
+    // or 100, or a disabled one, means charging isn't limited.
+    void setChargeThreshold(std::optional<uint32_t> endPercent,
+                            std::optional<bool> enabled)
+    {
+        if (endPercent)
+        {
+            thresholdSetting = *endPercent;
+        }
+        if (enabled)
+        {
+            thresholdEnabled = *enabled;
+        }
+        std::optional<uint32_t> threshold;
+        if (thresholdEnabled && thresholdSetting > 0 && thresholdSetting < 100)
+        {
+            threshold = thresholdSetting;
+        }
+        if (threshold == chargeThreshold)
+        {
+            return;
+        }
+        chargeThreshold = threshold;
+        record(RecordKind::ChargeThreshold, threshold.value_or(0));
+        invalidate(allStats);
+
+        // Idling turns into being held at the threshold, or back
+        const bool idle = currentBatteryState == BatteryState::Idle ||
+                          currentBatteryState == BatteryState::AtThreshold;
+        if (idle && (currentBatteryState == BatteryState::AtThreshold) !=
+                        nearThreshold())
+        {
+            setBatteryState(BatteryState::Idle);
+            return;
+        }
+        notify();
+    }
+
+    void setTemperature(double celsius)
+    {
+        const Time now = Clock::now();
+        wear.temperature(now, celsius);
+        record(RecordKind::Temperature, now, RelClock::now(),
+               toDeciKelvin(celsius));
+    }
+
+    // Feeds the circuit model. UPower reports both as magnitudes; the
+    // current's sign comes from the battery state. Either may be missing
+    // when only the other changed.
+    void updateElectrical(std::optional<double> volts,
+                          std::optional<double> watts)
+    {
+        if (volts)
+        {
+            lastVolts = *volts;
+        }
+        if (watts)
+        {
+            lastWatts = *watts;
+        }
+        if (isSuspended() || !lastVolts || !lastWatts || *lastVolts <= 0)
+        {
+            return;
+        }
+
+        double amps = *lastWatts / *lastVolts;
+        if (currentBatteryState == BatteryState::Charging)
+        {
+            amps = -amps;
+        }
+        model.add(Clock::now(), *lastVolts, amps);
+
+        if (const auto estimate = model.estimate())
+        {
+            const int64_t microOhms =
+                std::llround(estimate->ohmicResistance * 1e6);
+            if (!recordedResistance ||
+                std::abs(microOhms - *recordedResistance) >=
+                    resistanceResolution)
+            {
+                record(RecordKind::Resistance, microOhms);
+                recordedResistance = microOhms;
+            }
+        }
+    }
+
+    // `age` is how long ago the reading was taken, if it wasn't just now
+    void updateEnergy(MicrowattHours energy,
+                      Clock::duration age = Clock::duration::zero())
+    {
+        if (isSuspended())
+        {
+            // Drop any readings that come in between enter/exit suspend events.
+            // It seems tricky to tell whether a reading in this period happens
+            // before or after the actual hardware suspend. The former case
+            // would be fine to process, but in the latter interval (between HW
+            // waking and resume D-Bus event) processing the reading would mess
+            // up our stats (more significantly with longer sleep time).
+            return;
+        }
+
+        const auto [time, relTime] = timesAgo(age);
+        Reading r{.time = time, .relTime = relTime, .energy = energy};
+        latestEnergy = energy;
+
+        if (!firstReading)
+        {
+            firstReading = r;
+        }
+
+        if (printSuspendStats)
+        {
+            rateWindowStart = r.relTime;
+        }
+        else if (!readings.empty())
+        {
+            quantum.add(energy - readings.back().energy);
+        }
+        readings.push_back(r);
+        ledger.reading(r.time, energy);
+        if (energyEmpty)
+        {
+            if (const auto percent = capacityPercentOf(energy - *energyEmpty))
+            {
+                wear.stateOfCharge(r.time, *percent);
+            }
+        }
+        record(RecordKind::Energy, r.time, r.relTime, r.energy);
+        invalidate(allStats);
+
+        if (PROBE_ENABLED(update_energy))
+        {
+            // Probe arguments are integers (uWh, mW) since tracers handle
+            // floating point poorly.
+            int64_t rateMilliwatts = 0;
+            if (readings.size() > 1)
+            {
+                const Reading prev = readings[readings.size() - 2];
+                const std::chrono::nanoseconds timeDiff = r.time - prev.time;
+                if (timeDiff.count() > 0)
+                {
+                    // uWh / ns * (3.6e12 ns/h) / (1000 uW/mW)
+                    rateMilliwatts = (energy - prev.energy) * 3'600'000'000 /
+                                     timeDiff.count();
+                }
+            }
+            PROBE(update_energy, energy, rateMilliwatts, printSuspendStats);
+        }
+
+        if (printSuspendStats)
+        {
+            if (readings.size() > 1)
+            {
+                // relEnergy and rate only print something when we have multiple
+                // readings.
+                print<Stat::relEnergy | Stat::rate>("Sleep energy use");
+            }
+            printSuspendStats = false;
+        }
+        else
+        {
+            print<Stat::energy | Stat::rate | Stat::averageRate>("");
+        }
+        notify();
+    }
+
+  private:
+    // Builds the whole line in outputBuffer and writes it out at once. The
+    // buffer keeps its capacity between calls, so this doesn't allocate.
+    //
+    // The stat selection is a template parameter, so each call site gets its
+    // own instantiation with the unused stats compiled out, and the
+    // battery-limits check is hoisted into a single dispatch.
+    template <StatFlags Flags = StatFlags()>
+    void print(std::string_view msg)
+    {
+        if (!printing)
+        {
+            return;
+        }
+
+        outputBuffer.clear();
+        auto out = std::back_inserter(outputBuffer);
+        out = formatLocalTime(out, Clock::now());
+
+        if (firstReading)
+        {
+            const auto runTime = RelClock::now() - firstReading->relTime;
+            if (runTime >= std::chrono::seconds(1))
+            {
+                out = std::format_to(out, " (+");
+                out = formatRelTime(out, runTime);
+                out = std::format_to(out, ")");
+            }
+        }
+
+        if (!msg.empty())
+        {
+            out = std::format_to(out, " - {}", msg);
+        }
+
+        if constexpr (Flags.value != 0)
+        {
+            if (!readings.empty())
+            {
+                if (energyEmpty && energyFull)
+                {
+                    printStats<Flags, true>();
+                }
+                else
+                {
+                    printStats<Flags, false>();
+                }
+            }
+        }
+        writeLine();
+
+        // Latency from the reading being taken to its line being written out
+        PROBE(output, Flags.value,
+              PROBE_ENABLED(output) && !readings.empty()
+                  ? std::chrono::nanoseconds(RelClock::now() -
+                                             readings.back().relTime)
+                        .count()
+                  : 0);
+    }
+
+    template <StatFlags Flags, bool HaveLimits>
+    void printStats()
+    {
+        auto out = std::back_inserter(outputBuffer);
+
+        if constexpr (Flags & Stat::energy)
+        {
+            if (const auto& stat = energyStat())
+            {
+                out = std::format_to(out, " - {:.2f} Wh",
+                                     toWattHours(stat->energy));
+                if constexpr (HaveLimits)
+                {
+                    out = std::format_to(out, " ({:.2f}%)", *stat->percent);
+                }
+            }
+        }
+
+        if constexpr (Flags & Stat::relEnergy)
+        {
+            if (const auto& stat = relEnergyStat())
+            {
+                out = std::format_to(out, " - {:+.2f} Wh",
+                                     toWattHours(stat->energy));
+                if constexpr (HaveLimits)
+                {
+                    out = std::format_to(out, " ({:.2f}%)", *stat->percent);
+                }
+            }
+        }
+
+        if constexpr (Flags & Stat::rate)
+        {
+            if (const auto& stat = rateStat())
+            {
+                out = std::format_to(out, " / Rate ");
+                printRate<HaveLimits>(*stat);
+            }
+        }
+
+        if constexpr (Flags & Stat::averageRate)
+        {
+            if (const auto& stat = averageRateStat())
+            {
+                out = std::format_to(out, " / Avg ");
+                printRate<HaveLimits>(*stat);
+            }
+        }
+    }
+
+    template <bool HaveLimits>
+    void printRate(const RateStat& rate)
+    {
+        auto out = std::back_inserter(outputBuffer);
+        out = std::format_to(out, "{:.2f} W", rate.watts);
+
+        if constexpr (HaveLimits)
+        {
+            if (std::abs(*rate.percentPerHour) >= 1.0)
+            {
+                out = std::format_to(out, " ({:.1f}%/hr)",
+                                     *rate.percentPerHour);
+            }
+            else
+            {
+                const double percentPerDay = *rate.percentPerHour * 24;
+                out = std::format_to(out, " ({:.1f}%/day)", percentPerDay);
+            }
+        }
+    }
+
+    RateStat computeRate(MicrowattHours energyDiff,
+                         std::chrono::nanoseconds timeDiff) const
+    {
+        // Everything up to here is exact; convert to floating point only for
+        // display.
+        const double hours =
+            std::chrono::duration<double, std::ratio<3600>>(timeDiff).count();
+        const std::optional<double> percent = percentOf(energyDiff);
+        return {.watts = toWattHours(energyDiff) / hours,
+                .percentPerHour = percent
+                                      ? std::optional(*percent / hours)
+                                      : std::nullopt};
+    }
+
+    // Whether the battery is at the charge threshold, give or take what a
+    // charge controller lets it drift, so that idling means being held there
+    // rather than e.g. being full with the threshold only just set
+    bool nearThreshold() const
+    {
+        const auto usableFull = usableFullEnergy();
+        if (!chargeThreshold || !usableFull || !latestEnergy)
+        {
+            return false;
+        }
+        const MicrowattHours tolerance = (*energyFull - *energyEmpty) *
+                                         thresholdTolerancePercent / 100;
+        return std::abs(*latestEnergy - *usableFull) <= tolerance;
+    }
+
+    // Percentage of the battery's usable window, if known
+    std::optional<double> percentOf(MicrowattHours energy) const
+    {
+        const auto usableFull = usableFullEnergy();
+        if (!usableFull)
+        {
+            return std::nullopt;
+        }
+        return 100.0 * static_cast<double>(energy) /
+               static_cast<double>(*usableFull - *energyEmpty);
+    }
+
+    // Percentage of the whole capacity, regardless of the charge threshold,
+    // for wear
+    std::optional<double> capacityPercentOf(MicrowattHours energy) const
+    {
+        if (!energyEmpty || !energyFull)
+        {
+            return std::nullopt;
+        }
+        return 100.0 * static_cast<double>(energy) /
+               static_cast<double>(*energyFull - *energyEmpty);
+    }
+
+    static constexpr StatFlags allStats = Stat::energy | Stat::rate |
+                                          Stat::averageRate | Stat::relEnergy;
+
+    void notify()
+    {
+        for (const auto& listener : listeners)
+        {
+            listener();
+        }
+    }
+
+    void invalidate(StatFlags stats)
+    {
+        dirty.value |= stats.value;
+        ++generation;
+    }
+
+    template <Stat S, typename T, typename F>
+    const std::optional<T>& memoized(std::optional<T>& cache, F&& compute)
+    {
+        if (dirty & S)
+        {
+            cache = compute();
+            dirty.value &= ~std::to_underlying(S);
+        }
+        return cache;
+    }
+
+    // Wall and monotonic times of something that happened `age` ago, but no
+    // earlier than the latest record so records stay in order
+    std::pair<Time, RelTime> timesAgo(Clock::duration age) const
+    {
+        const RelTime relNow = RelClock::now();
+        const auto sinceLastRecord =
+            std::chrono::duration_cast<Clock::duration>(relNow -
+                                                        lastRecordRelTime);
+        age = std::clamp(age, Clock::duration::zero(),
+                         std::max(sinceLastRecord, Clock::duration::zero()));
+        return {Clock::now() - age, relNow - age};
+    }
+
+    void record(RecordKind kind, int64_t value = 0)
+    {
+        record(kind, Clock::now(), RelClock::now(), value);
+    }
+
+    // Records hold values from 0 to UINT32_MAX. Anything else comes from a
+    // bogus input (e.g. a negative energy) and is left out, saying so once per
+    // record kind rather than on every reading.
+    void record(RecordKind kind, Time time, RelTime relTime, int64_t value)
+    {
+        lastRecordRelTime = relTime;
+        if (history == nullptr)
+        {
+            return;
+        }
+        static_assert(std::to_underlying(RecordKind::RadioState) < 32);
+        if (value < 0 || value > UINT32_MAX)
+        {
+            const uint32_t bit = 1u << std::to_underlying(kind);
+            if ((unrecordableKinds & bit) == 0)
+            {
+                std::cout << "Not recording " << recordKindName(kind)
+                          << " value " << value << ", out of range\n";
+                unrecordableKinds |= bit;
+            }
+            return;
+        }
+        history->append(kind, time, relTime, value);
+    }
+
+    void writeLine()
+    {
+        outputBuffer.push_back('\n');
+        std::cout.write(outputBuffer.data(),
+                        static_cast<std::streamsize>(outputBuffer.size()));
+        std::cout.flush();
+    }
+
+  private:
+    std::optional<MicrowattHours> energyEmpty;
+    std::optional<MicrowattHours> energyFull;
+    // As set, and in effect
+    uint32_t thresholdSetting = 100;
+    bool thresholdEnabled = true;
+    std::optional<uint32_t> chargeThreshold;
+    // Idle within this many percent of the capacity of the threshold counts
+    // as being held at it
+    static constexpr int64_t thresholdTolerancePercent = 3;
+    // Kept across state changes, unlike readings
+    std::optional<MicrowattHours> latestEnergy;
+    std::optional<Reading> firstReading;
+    static constexpr int64_t rateQuanta = 10;
+    static constexpr std::chrono::minutes maxRateSpan{10};
+
+    // Enough for rateQuanta steps at the usual few readings a minute
+    ReadingWindow<64> readings;
+    QuantumEstimator quantum;
+    RelTime rateWindowStart{};
+
+    bool printSuspendStats = false;
+    std::optional<Time> enterSuspendTime;
+    EnergyLedger ledger;
+    WearTracker wear;
+
+    CircuitModel model;
+    std::optional<double> lastVolts;
+    std::optional<double> lastWatts;
+    // Resistance changes smaller than this (uOhm) aren't recorded
+    static constexpr int64_t resistanceResolution = 1000;
+    std::optional<int64_t> recordedResistance;
+
+    std::optional<SystemPower> systemPowerEstimate;
+    std::optional<uint32_t> radioState;
+    // Record kinds that had a value out of range, one bit each
+    uint32_t unrecordableKinds = 0;
+    // Monotonic time of the latest record, recorded or not
+    RelTime lastRecordRelTime{};
+
+    StatFlags dirty = allStats;
+    uint64_t generation = 0;
+    std::optional<EnergyStat> energyCache;
+    std::optional<EnergyStat> relEnergyCache;
+    std::optional<RateStat> rateCache;
+    std::optional<RateStat> averageRateCache;
+
+    LatencyHistogram processingTimes;
+    std::string outputBuffer;
+    bool printing = true;
+    HistoryWriter* history;
+    std::optional<BatteryState> currentBatteryState;
+    std::vector<std::function<void()>> listeners;
+};
@@ -0,0 +1,93 @@
+#include "battery_properties.hpp"
+
+#include "probes.hpp"
+
+#include <chrono>
+
+BATTERY_STATS_PROBES(PROBE_DEFINE_SEMAPHORE)
+
+void processBatteryProperties(BatteryMonitor& batmon,
+                              const BatteryProperties& properties,
+                              const Samplers& samplers)
+{
+    const auto startTime = std::chrono::steady_clock::now();
+
+    // Before the state, so idling at the threshold is recognized as such
+    if (properties.chargeThresholdEnabled || properties.chargeEndThreshold)
+    {
+        batmon.setChargeThreshold(properties.chargeEndThreshold,
+                                  properties.chargeThresholdEnabled);
+    }
+    if (properties.energyEmpty && properties.energyFull)
+    {
+        batmon.setBatteryLimits(toMicrowattHours(*properties.energyEmpty),
+                                toMicrowattHours(*properties.energyFull));
+    }
+
+    if (properties.state)
+    {
+        // The reading comes after a state change, which starts a new cycle
+        // with it, but whether idling is at the threshold depends on it
+        std::optional<MicrowattHours> energy;
+        if (properties.energy)
+        {
+            energy = toMicrowattHours(*properties.energy);
+        }
+        switch (*properties.state)
+        {
+            case 1:
+                batmon.setBatteryState(BatteryState::Charging, energy);
+                break;
+            case 2:
+                batmon.setBatteryState(BatteryState::Discharging, energy);
+                break;
+            case 4:
+            case 5:
+                batmon.setBatteryState(BatteryState::Idle, energy);
+                break;
+        }
+    }
+
+    // UPower reports 0 when the battery has no temperature sensor
+    if (properties.temperature && *properties.temperature != 0)
+    {
+        batmon.setTemperature(*properties.temperature);
+    }
+
+    if (properties.voltage || properties.energyRate)
+    {
+        batmon.updateElectrical(properties.voltage, properties.energyRate);
+    }
+
+    if (properties.energy)
+    {
+        batmon.updateEnergy(toMicrowattHours(*properties.energy));
+    }
+
+    // On battery its rate is what the system draws; on AC it isn't
+    if (samplers.powerMeter != nullptr && batmon.onExternalPower() &&
+        !batmon.isSuspended())
+    {
+        batmon.setSystemPower(
+            samplers.powerMeter->sample(batmon.batteryPower()));
+    }
+
+    // Each reading ends a runtime PM audit and network activity interval.
+    // Traffic while asleep is counted in the first interval after resuming.
+    if (properties.energy && !batmon.isSuspended())
+    {
+        if (samplers.runtimePm != nullptr)
+        {
+            samplers.runtimePm->sample();
+        }
+        if (samplers.network != nullptr)
+        {
+            batmon.setNetworkActivity(samplers.network->sample());
+        }
+    }
+
+    const std::chrono::nanoseconds elapsed =
+        std::chrono::steady_clock::now() - startTime;
+    batmon.recordProcessingTime(elapsed);
+    PROBE(battery_properties, properties.count, elapsed.count());
+}
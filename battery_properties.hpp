@@ -0,0 +1,45 @@
+#pragma once
+
+#include "battery_monitor.hpp"
+#include "network_activity.hpp"
+#include "runtime_pm.hpp"
+#include "system_power.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// The org.freedesktop.UPower.Device properties that we act on. Unlike the
+// map sdbusplus decodes GetAll into, this has fixed storage, so a
+// PropertiesChanged signal can be decoded into it without allocating.
+struct BatteryProperties
+{
+    std::optional<uint32_t> state;
+    std::optional<double> energyEmpty;
+    std::optional<double> energyFull;
+    std::optional<double> energy;
+    std::optional<double> temperature;
+    std::optional<double> voltage;
+    std::optional<double> energyRate;
+    // Only reported by UPower 1.90.5 and later, see ChargeThresholdFile
+    std::optional<uint32_t> chargeEndThreshold;
+    std::optional<bool> chargeThresholdEnabled;
+
+    // Total number of properties in the update, including ignored ones
+    size_t count = 0;
+};
+
+// Sysfs samplers run alongside battery updates, each null if unavailable
+struct Samplers
+{
+    SystemPowerMeter* powerMeter = nullptr;
+    RuntimePmAudit* runtimePm = nullptr;
+    NetworkActivity* network = nullptr;
+};
+
+// Applies one (possibly merged) property update to the monitor and ends the
+// samplers' intervals. This is the steady-state event path: it must not
+// allocate.
+void processBatteryProperties(BatteryMonitor& batmon,
+                              const BatteryProperties& properties,
+                              const Samplers& samplers);
@@ -1,408 +1,475 @@
+#include "alloc_accounting.hpp"
+#include "battery_monitor.hpp"
+#include "battery_properties.hpp"
+#include "commands.hpp"
+#include "dashboard.hpp"
+#include "history.hpp"
+#include "network_activity.hpp"
+#include "query_server.hpp"
+#include "reading.hpp"
+#include "runtime_pm.hpp"
 #include "sdbusplus/bus.hpp"
 #include "sdbusplus/bus/match.hpp"
 #include "sdbusplus/message/native_types.hpp"
+#include "system_power.hpp"
+
+#include <fcntl.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
 
 #include <sdbusplus/async.hpp>
 
+#include <array>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <format>
 #include <iostream>
-#include <list>
-#include <utility>
+#include <optional>
+#include <string>
+#include <string_view>
 
 namespace rules = sdbusplus::bus::match::rules;
 
-enum class PowerState
-{
-    Awake,
-    Suspended,
-    Hibernating
-};
-
-enum class BatteryState
-{
-    Charging,
-    Discharging,
-    Idle,
-};
-
-enum class Stat : uint32_t
+auto sleepEventMonitor(sdbusplus::async::context& ctx, BatteryMonitor& batmon)
+    -> sdbusplus::async::task<>
 {
-    energy = 1,
-    rate = 2,
-    averageRate = 4,
-    relEnergy = 8,
-};
+    auto match = sdbusplus::async::match(
+        ctx, rules::type::signal() + rules::path("/BatteryStats") +
+                 rules::interface("BatteryStats.Sleep") +
+                 rules::member("SystemdSleepEvent"));
 
-struct StatFlags
-{
-    StatFlags(Stat s) : value(std::to_underlying(s)) {}
-    StatFlags(uint32_t v = 0) : value(v) {}
-    uint32_t value;
-};
+    while (true)
+    {
+        auto msg = co_await match.next();
+        AllocationCheck allocCheck("SystemdSleepEvent");
+
+        // Read the arguments as pointers into the message instead of copying
+        // them into strings.
+        const char* stageArg = nullptr;
+        const char* operationArg = nullptr;
+        const char* extraActionArg = nullptr;
+        if (sd_bus_message_read(msg.get(), "sss", &stageArg, &operationArg,
+                                &extraActionArg) < 0)
+        {
+            continue;
+        }
+        const std::string_view stage(stageArg);
+        const std::string_view operation(operationArg);
+
+        // Newer hooks add a battery reading taken right at the boundary, and
+        // newer still the wall clock time it was taken in microseconds
+        std::optional<MicrowattHours> boundaryEnergy;
+        if (uint64_t energy = 0;
+            sd_bus_message_at_end(msg.get(), false) == 0 &&
+            sd_bus_message_read(msg.get(), "t", &energy) > 0)
+        {
+            boundaryEnergy = static_cast<MicrowattHours>(energy);
+        }
+        Clock::duration age = Clock::duration::zero();
+        if (uint64_t readTime = 0;
+            boundaryEnergy && sd_bus_message_at_end(msg.get(), false) == 0 &&
+            sd_bus_message_read(msg.get(), "t", &readTime) > 0)
+        {
+            // Compared in microseconds so a bogus time can't overflow
+            const auto now = std::chrono::duration_cast<
+                std::chrono::microseconds>(Clock::now().time_since_epoch());
+            if (readTime <= static_cast<uint64_t>(now.count()))
+            {
+                age = now - std::chrono::microseconds(readTime);
+            }
+        }
 
-StatFlags operator|(Stat a, Stat b)
-{
-    return StatFlags{std::to_underlying(a) | std::to_underlying(b)};
+        if (operation == "suspend")
+        {
+            if (stage == "pre")
+            {
+                if (boundaryEnergy)
+                {
+                    batmon.updateEnergy(*boundaryEnergy, age);
+                }
+                batmon.setPowerState(PowerState::Suspended);
+            }
+            else if (stage == "post")
+            {
+                // We were awake by the time of the reading
+                batmon.setPowerState(PowerState::Awake, age);
+                // The first reading after resume is the one sleep energy use
+                // is measured against
+                if (boundaryEnergy)
+                {
+                    batmon.updateEnergy(*boundaryEnergy, age);
+                }
+            }
+        }
+    }
 }
 
-bool operator&(StatFlags flags, Stat a)
-{
-    return (flags.value & std::to_underlying(a)) != 0;
-}
+using UPowerDeviceProperty = std::variant<std::string, uint64_t, uint32_t, bool,
+                                          double, int32_t, int64_t>;
+using UPowerDeviceProperties =
+    std::unordered_map<std::string, UPowerDeviceProperty>;
 
-StatFlags operator|(StatFlags f, Stat s)
+BatteryProperties toBatteryProperties(const UPowerDeviceProperties& properties)
 {
-    f.value |= std::to_underlying(s);
-    return f;
-}
+    BatteryProperties result;
+    result.count = properties.size();
 
-template <typename T>
-std::string formatRelTime(T duration)
-{
-    const auto relTime =
-        std::chrono::duration_cast<std::chrono::seconds>(duration);
-    if (relTime.count() == 0)
+    auto propIt = properties.find("State");
+    if (propIt != properties.end())
     {
-        return {};
+        result.state = std::get<uint32_t>(propIt->second);
     }
-
-    std::string output;
-    const auto hours = std::chrono::duration_cast<std::chrono::hours>(relTime);
-    if (hours.count() > 0)
+    propIt = properties.find("EnergyEmpty");
+    if (propIt != properties.end())
+    {
+        result.energyEmpty = std::get<double>(propIt->second);
+    }
+    propIt = properties.find("EnergyFull");
+    if (propIt != properties.end())
+    {
+        result.energyFull = std::get<double>(propIt->second);
+    }
+    propIt = properties.find("Energy");
+    if (propIt != properties.end())
+    {
+        result.energy = std::get<double>(propIt->second);
+    }
+    propIt = properties.find("Temperature");
+    if (propIt != properties.end())
+    {
+        result.temperature = std::get<double>(propIt->second);
+    }
+    propIt = properties.find("Voltage");
+    if (propIt != properties.end())
+    {
+        result.voltage = std::get<double>(propIt->second);
+    }
+    propIt = properties.find("EnergyRate");
+    if (propIt != properties.end())
     {
-        output += std::format("{}h", hours.count());
+        result.energyRate = std::get<double>(propIt->second);
     }
-    const auto mins =
-        std::chrono::duration_cast<std::chrono::minutes>(relTime) - hours;
-    if (mins.count() > 0)
+    propIt = properties.find("ChargeEndThreshold");
+    if (propIt != properties.end())
     {
-        output += std::format("{}m", mins.count());
+        result.chargeEndThreshold = std::get<uint32_t>(propIt->second);
     }
-    const auto secs = relTime - hours - mins;
-    if (secs.count() > 0)
+    propIt = properties.find("ChargeThresholdEnabled");
+    if (propIt != properties.end())
     {
-        output += std::format("{}s", secs.count());
+        result.chargeThresholdEnabled = std::get<bool>(propIt->second);
     }
-    return output;
+    return result;
 }
 
-class BatteryMonitor
+// Reads a variant holding a basic type into value. Fails with -ENXIO if the
+// variant holds some other type.
+template <typename T>
+int readVariant(sd_bus_message* msg, char type, std::optional<T>& value)
 {
-    using Clock = std::chrono::system_clock;
-    using Time = Clock::time_point;
-    using RelClock = std::chrono::steady_clock;
-    using RelTime = RelClock::time_point;
-    struct Reading
+    const char contents[] = {type, '\0'};
+    int r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_VARIANT, contents);
+    if (r <= 0)
     {
-        Time time;
-        RelTime relTime;
-        double energy;
-    };
-
-  public:
-    BatteryMonitor() = default;
-
-    void setPowerState(PowerState powerState)
-    {
-        switch (powerState)
-        {
-            case PowerState::Suspended:
-                enterSuspendTime = Clock::now();
-                print("Going to sleep");
-                break;
-            case PowerState::Awake:
-            {
-                if (!enterSuspendTime)
-                {
-                    break;
-                }
-                const auto suspendTime =
-                    std::chrono::duration_cast<std::chrono::milliseconds>(
-                        Clock::now() - *enterSuspendTime);
-
-                enterSuspendTime.reset();
-                printSuspendStats = true;
-                print(std::format("Resumed from {} sleep",
-                                  formatRelTime(suspendTime)));
-                break;
-            }
-            default:
-                break;
-        }
+        return r < 0 ? r : -ENXIO;
     }
 
-    bool isSuspended() const
+    T v{};
+    r = sd_bus_message_read_basic(msg, type, &v);
+    if (r < 0)
     {
-        return enterSuspendTime.has_value();
+        return r;
     }
+    value = v;
+    return sd_bus_message_exit_container(msg);
+}
 
-    void setBatteryState(BatteryState batteryState)
+// Decodes a PropertiesChanged signal body (sa{sv}as) in place. Property names
+// are compared as pointers into the message and unused values are skipped, so
+// nothing is copied.
+int readBatteryProperties(sd_bus_message* msg, BatteryProperties& properties)
+{
+    const char* interfaceName = nullptr;
+    int r = sd_bus_message_read(msg, "s", &interfaceName);
+    if (r < 0)
     {
-        if (batteryState == BatteryState::Idle)
-        {
-            print("Battery idle");
-            // Don't clear stats when going idle
-            return;
-        }
-
-        firstReading.reset();
-        readings.clear();
-        totalSuspendEnergy = 0;
-
-        switch (batteryState)
-        {
-            case BatteryState::Charging:
-                print("Battery charging");
-                break;
-            case BatteryState::Discharging:
-                print("Battery discharging");
-                break;
-            default:
-                break;
-        }
+        return r;
     }
 
-    void setBatteryLimits(double empty, double full)
+    r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY, "{sv}");
+    if (r < 0)
     {
-        energyEmpty = empty;
-        energyFull = full;
+        return r;
     }
 
-    void updateEnergy(double energy)
+    while ((r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_DICT_ENTRY,
+                                               "sv")) > 0)
     {
-        if (isSuspended())
+        const char* nameArg = nullptr;
+        r = sd_bus_message_read(msg, "s", &nameArg);
+        if (r < 0)
         {
-            // Drop any readings that come in between enter/exit suspend events.
-            // It seems tricky to tell whether a reading in this period happens
-            // before or after the actual hardware suspend. The former case
-            // would be fine to process, but in the latter interval (between HW
-            // waking and resume D-Bus event) processing the reading would mess
-            // up our stats (more significantly with longer sleep time).
-            return;
+            return r;
         }
 
-        Reading r{
-            .time = Clock::now(), .relTime = RelClock::now(), .energy = energy};
-
-        if (!firstReading)
+        const std::string_view name(nameArg);
+        ++properties.count;
+        if (name == "State")
         {
-            firstReading = r;
+            r = readVariant(msg, SD_BUS_TYPE_UINT32, properties.state);
         }
-
-        readings.push_back(r);
-        if (readings.size() > 2)
+        else if (name == "EnergyEmpty")
         {
-            readings.pop_front();
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.energyEmpty);
         }
-
-        if (printSuspendStats)
+        else if (name == "EnergyFull")
         {
-            if (readings.size() > 1)
-            {
-                totalSuspendEnergy +=
-                    (energy - std::prev(readings.end(), 2)->energy);
-
-                // relEnergy and rate only print something when we have multiple
-                // readings.
-                print("Sleep energy use", Stat::relEnergy | Stat::rate);
-            }
-            printSuspendStats = false;
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.energyFull);
         }
-        else
+        else if (name == "Energy")
         {
-            print("", Stat::energy | Stat::rate | Stat::averageRate);
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.energy);
         }
-    }
-
-  private:
-    void print(std::string_view msg, StatFlags flags = StatFlags())
-    {
-        const std::chrono::zoned_time curTime{
-            std::chrono::current_zone(),
-            std::chrono::time_point_cast<std::chrono::seconds>(
-                std::chrono::system_clock::now())};
-        std::cout << curTime;
-
-        if (firstReading)
+        else if (name == "Temperature")
         {
-            const std::string runTimeStr =
-                formatRelTime(RelClock::now() - firstReading->relTime);
-            if (!runTimeStr.empty())
-            {
-                std::cout << std::format(" (+{})", runTimeStr);
-            }
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.temperature);
         }
-
-        if (!msg.empty())
+        else if (name == "Voltage")
         {
-            std::cout << " - " << msg;
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.voltage);
         }
-
-        if (readings.empty())
+        else if (name == "EnergyRate")
         {
-            std::cout << std::endl;
-            return;
+            r = readVariant(msg, SD_BUS_TYPE_DOUBLE, properties.energyRate);
         }
-
-        const Reading* const curReading = &readings.back();
-        const Reading* const prevReading =
-            readings.size() > 1 ? &*std::prev(readings.end(), 2) : nullptr;
-
-        if (flags & Stat::energy)
+        else if (name == "ChargeEndThreshold")
         {
-            std::cout << std::format(" - {:.2f} Wh", curReading->energy);
-            if (energyEmpty && energyFull)
-            {
-                double percent = 100 * (curReading->energy - *energyEmpty) /
-                                 (*energyFull - *energyEmpty);
-                std::cout << std::format(" ({:.2f}%)", percent);
-            }
+            r = readVariant(msg, SD_BUS_TYPE_UINT32,
+                            properties.chargeEndThreshold);
         }
-
-        if ((flags & Stat::relEnergy) && prevReading != nullptr)
+        else if (name == "ChargeThresholdEnabled")
         {
-            double energyDiff = curReading->energy - prevReading->energy;
-            std::cout << std::format(" - {:+.2f} Wh", energyDiff);
-            if (energyEmpty && energyFull)
+            // D-Bus booleans are read as int
+            std::optional<int> enabled;
+            r = readVariant(msg, SD_BUS_TYPE_BOOLEAN, enabled);
+            if (enabled)
             {
-                double percent = 100 * energyDiff /
-                                 (*energyFull - *energyEmpty);
-                std::cout << std::format(" ({:.2f}%)", percent);
+                properties.chargeThresholdEnabled = *enabled != 0;
             }
         }
-
-        if ((flags & Stat::rate) && prevReading != nullptr)
+        else
         {
-            std::cout << " / Rate ";
-            printRate(curReading->energy - prevReading->energy,
-                      std::chrono::duration_cast<std::chrono::milliseconds>(
-                          curReading->time - prevReading->time));
+            r = sd_bus_message_skip(msg, "v");
+        }
+        if (r < 0)
+        {
+            return r;
         }
 
-        if ((flags & Stat::averageRate) && firstReading && readings.size() > 1)
+        r = sd_bus_message_exit_container(msg);
+        if (r < 0)
         {
-            std::cout << " / Avg ";
-            double awakeEnergy = curReading->energy - firstReading->energy -
-                                 totalSuspendEnergy;
-            auto awakeTime = curReading->relTime - firstReading->relTime;
-            printRate(awakeEnergy,
-                      std::chrono::duration_cast<std::chrono::milliseconds>(
-                          awakeTime));
+            return r;
         }
-        std::cout << std::endl;
     }
-
-    void printRate(double energyDiff, std::chrono::milliseconds timeDiff)
+    if (r < 0)
     {
-        const double msPerHour = 1000 * 60 * 60;
-        const double hours = timeDiff.count() / msPerHour;
-        const double watts = energyDiff / hours;
+        return r;
+    }
+
+    // Invalidated properties (as) are ignored
+    return sd_bus_message_exit_container(msg);
+}
+
+// The kernel's charge_control_end_threshold for the battery, for UPower
+// versions that don't report it. Sysfs attributes can't be watched, so it's
+// re-read whenever the battery state changes, which changing the threshold
+// usually causes. Reading doesn't allocate.
+class ChargeThresholdFile
+{
+  public:
+    explicit ChargeThresholdFile(std::string_view nativePath) :
+        path(std::format("/sys/class/power_supply/{}/"
+                         "charge_control_end_threshold",
+                         nativePath))
+    {}
 
-        std::cout << std::format("{:.2f} W", watts);
+    std::optional<uint32_t> read() const
+    {
+        const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return std::nullopt;
+        }
+        std::array<char, 16> buf;
+        const ssize_t len = ::read(fd, buf.data(), buf.size());
+        close(fd);
+        uint32_t value = 0;
+        if (len <= 0 ||
+            std::from_chars(buf.data(), buf.data() + len, value).ec !=
+                std::errc())
+        {
+            return std::nullopt;
+        }
+        return value;
+    }
 
-        if (energyEmpty && energyFull)
+    // Adds the threshold to properties that change the battery state
+    void update(BatteryProperties& properties) const
+    {
+        if (!properties.state)
         {
-            const double percentPerHour =
-                (100 * energyDiff / (*energyFull - *energyEmpty)) / hours;
-            if (std::abs(percentPerHour) >= 1.0)
-            {
-                std::cout << std::format(" ({:.1f}%/hr)", percentPerHour);
-            }
-            else
-            {
-                const double percentPerDay = percentPerHour * 24;
-                std::cout << std::format(" ({:.1f}%/day)", percentPerDay);
-            }
+            return;
+        }
+        if (const auto threshold = read())
+        {
+            properties.chargeEndThreshold = threshold;
+            properties.chargeThresholdEnabled = true;
         }
     }
 
   private:
-    std::optional<double> energyEmpty;
-    std::optional<double> energyFull;
-    std::optional<Reading> firstReading;
-    std::list<Reading> readings;
-
-    bool printSuspendStats = false;
-    std::optional<Time> enterSuspendTime;
-    double totalSuspendEnergy = 0;
+    std::string path;
 };
 
-auto sleepEventMonitor(sdbusplus::async::context& ctx, BatteryMonitor& batmon)
-    -> sdbusplus::async::task<>
+// Merges the burst of PropertiesChanged signals UPower sends for one hardware
+// refresh (Energy, then Percentage, then TimeToEmpty, ...) so each refresh is
+// processed once. The first signal of a burst arms a one-shot timer and
+// everything arriving before it fires is merged in. With a zero window, the
+// merged set is processed as soon as no more messages are queued on the bus.
+//
+// The timer source is created once up front and re-armed per burst, so this
+// doesn't allocate in steady state.
+class PropertyCoalescer
 {
-    auto match = sdbusplus::async::match(
-        ctx, rules::type::signal() + rules::path("/BatteryStats") +
-                 rules::interface("BatteryStats.Sleep") +
-                 rules::member("SystemdSleepEvent"));
+  public:
+    PropertyCoalescer(sdbusplus::async::context& ctx, BatteryMonitor& batmon,
+                      std::chrono::microseconds window,
+                      const ChargeThresholdFile* thresholdFile,
+                      Samplers samplers) :
+        bus(ctx.get_bus().get()), event(ctx.get_event_loop().get()),
+        batmon(batmon), window(window), thresholdFile(thresholdFile),
+        samplers(samplers)
+    {
+        if (window.count() > 0)
+        {
+            sd_event_add_time(event, &timer, CLOCK_MONOTONIC, UINT64_MAX,
+                              timerAccuracy.count(), onTimer, this);
+            sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+        }
+    }
 
-    while (true)
+    PropertyCoalescer(const PropertyCoalescer&) = delete;
+    PropertyCoalescer& operator=(const PropertyCoalescer&) = delete;
+
+    ~PropertyCoalescer()
     {
-        auto [stage, operation, extraAction] =
-            co_await match.next<std::string, std::string, std::string>();
+        sd_event_source_unref(timer);
+    }
 
-        if (operation == "suspend")
+    void add(const BatteryProperties& properties)
+    {
+        const bool firstInBurst = pending.count == 0;
+        merge(properties);
+
+        if (timer == nullptr)
         {
-            if (stage == "pre")
-            {
-                batmon.setPowerState(PowerState::Suspended);
-            }
-            else if (stage == "post")
+            uint64_t queued = 0;
+            if (sd_bus_get_n_queued_read(bus, &queued) < 0 || queued == 0)
             {
-                batmon.setPowerState(PowerState::Awake);
+                flush();
             }
+            return;
         }
-    }
-}
-
-using UPowerDeviceProperty = std::variant<std::string, uint64_t, uint32_t, bool,
-                                          double, int32_t, int64_t>;
-using UPowerDeviceProperties =
-    std::unordered_map<std::string, UPowerDeviceProperty>;
 
-void processBatteryProperties(BatteryMonitor& batmon,
-                              const UPowerDeviceProperties& properties)
-{
-    auto propIt = properties.find("State");
-    if (propIt != properties.end())
-    {
-        auto state = std::get<uint32_t>(propIt->second);
-        switch (state)
+        if (firstInBurst)
         {
-            case 1:
-                batmon.setBatteryState(BatteryState::Charging);
-                break;
-            case 2:
-                batmon.setBatteryState(BatteryState::Discharging);
-                break;
-            case 4:
-            case 5:
-                batmon.setBatteryState(BatteryState::Idle);
-                break;
+            uint64_t now = 0;
+            sd_event_now(event, CLOCK_MONOTONIC, &now);
+            sd_event_source_set_time(timer, now + window.count());
+            sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
         }
     }
 
-    propIt = properties.find("EnergyEmpty");
-    if (propIt != properties.end())
+  private:
+    static constexpr std::chrono::microseconds timerAccuracy{1000};
+
+    static int onTimer(sd_event_source* /* source */, uint64_t /* usec */,
+                       void* userdata)
     {
-        double energyEmpty = std::get<double>(propIt->second);
+        AllocationCheck allocCheck("coalesced battery properties");
+        static_cast<PropertyCoalescer*>(userdata)->flush();
+        return 0;
+    }
 
-        propIt = properties.find("EnergyFull");
-        if (propIt != properties.end())
+    // Later values win. The property count is the sum over the burst.
+    void merge(const BatteryProperties& properties)
+    {
+        if (properties.state)
+        {
+            pending.state = properties.state;
+        }
+        if (properties.energyEmpty)
+        {
+            pending.energyEmpty = properties.energyEmpty;
+        }
+        if (properties.energyFull)
+        {
+            pending.energyFull = properties.energyFull;
+        }
+        if (properties.energy)
+        {
+            pending.energy = properties.energy;
+        }
+        if (properties.temperature)
+        {
+            pending.temperature = properties.temperature;
+        }
+        if (properties.voltage)
+        {
+            pending.voltage = properties.voltage;
+        }
+        if (properties.energyRate)
+        {
+            pending.energyRate = properties.energyRate;
+        }
+        if (properties.chargeEndThreshold)
+        {
+            pending.chargeEndThreshold = properties.chargeEndThreshold;
+        }
+        if (properties.chargeThresholdEnabled)
         {
-            double energyFull = std::get<double>(propIt->second);
-            batmon.setBatteryLimits(energyEmpty, energyFull);
+            pending.chargeThresholdEnabled = properties.chargeThresholdEnabled;
         }
+        pending.count += properties.count;
     }
 
-    propIt = properties.find("Energy");
-    if (propIt != properties.end())
+    void flush()
     {
-        batmon.updateEnergy(std::get<double>(propIt->second));
+        if (thresholdFile != nullptr)
+        {
+            thresholdFile->update(pending);
+        }
+        processBatteryProperties(batmon, pending, samplers);
+        pending = BatteryProperties();
     }
-}
 
-auto powerEventMonitor(sdbusplus::async::context& ctx, BatteryMonitor& batmon)
-    -> sdbusplus::async::task<>
+    sd_bus* bus;
+    sd_event* event;
+    sd_event_source* timer = nullptr;
+    BatteryMonitor& batmon;
+    std::chrono::microseconds window;
+    const ChargeThresholdFile* thresholdFile;
+    Samplers samplers;
+    BatteryProperties pending;
+};
+
+auto powerEventMonitor(sdbusplus::async::context& ctx, BatteryMonitor& batmon,
+                       std::chrono::milliseconds coalesceWindow,
+                       Samplers samplers) -> sdbusplus::async::task<>
 {
     // Find the battery object
     constexpr auto upower =
@@ -442,32 +509,258 @@ auto powerEventMonitor(sdbusplus::async::context& ctx, BatteryMonitor& batmon)
 
     // Get all current properties
     const auto batteryObject = upowerDevice.path(batteryPath->str);
+    const auto allProperties =
+        co_await batteryObject.get_all_properties<UPowerDeviceProperty>(ctx);
+
+    // Older UPower doesn't know about charge thresholds, so go to sysfs
+    std::optional<ChargeThresholdFile> thresholdFile;
+    if (const auto nativePath = allProperties.find("NativePath");
+        !allProperties.contains("ChargeThresholdSupported") &&
+        nativePath != allProperties.end())
+    {
+        thresholdFile.emplace(std::get<std::string>(nativePath->second));
+        if (!thresholdFile->read())
+        {
+            thresholdFile.reset();
+        }
+    }
 
-    processBatteryProperties(
-        batmon,
-        co_await batteryObject.get_all_properties<UPowerDeviceProperty>(ctx));
+    BatteryProperties initial = toBatteryProperties(allProperties);
+    if (thresholdFile)
+    {
+        thresholdFile->update(initial);
+    }
+    processBatteryProperties(batmon, initial, samplers);
 
     // Watch for future property updates
+    PropertyCoalescer coalescer(ctx, batmon, coalesceWindow,
+                                thresholdFile ? &*thresholdFile : nullptr,
+                                samplers);
     auto batteryChangeMatch = sdbusplus::async::match(
         ctx, rules::propertiesChanged(batteryPath->str,
                                       "org.freedesktop.UPower.Device"));
     while (true)
     {
-        auto [interfaceName, changedProps,
-              invalProps] = co_await batteryChangeMatch
-                                .next<std::string, UPowerDeviceProperties,
-                                      std::vector<std::string>>();
+        auto msg = co_await batteryChangeMatch.next();
+        AllocationCheck allocCheck("PropertiesChanged");
 
-        processBatteryProperties(batmon, changedProps);
+        BatteryProperties changedProps;
+        const int r = readBatteryProperties(msg.get(), changedProps);
+        if (r < 0)
+        {
+            std::cout << "Failed to decode battery properties: "
+                      << std::strerror(-r) << '\n';
+            continue;
+        }
+
+        coalescer.add(changedProps);
     }
 }
 
-int main(int /* argc */, char** /* argv */)
+void printUsage(const char* argv0)
+{
+    std::cerr << "Usage: " << argv0
+              << " [--coalesce-ms=N] [--history=PATH | --no-history]\n"
+              << "       [--history-days=N] [--socket=PATH | --no-socket]"
+                 " [--tui]\n"
+              << "  --coalesce-ms=N  Merge battery updates arriving within N ms"
+                 " (default 50).\n"
+              << "                   0 merges only what is already queued.\n"
+              << "  --history=PATH   Record readings to PATH (default "
+              << history::defaultPath().string() << ").\n"
+              << "  --no-history     Don't record readings.\n"
+              << "  --history-days=N Free history older than N days"
+                 " (default 365, 0 keeps all).\n"
+              << "  --socket=PATH    Serve queries on PATH (default "
+              << QueryServer::defaultSocketPath()
+                     .value_or("none, no XDG_RUNTIME_DIR")
+                     .string()
+              << ").\n"
+              << "  --no-socket      Don't serve queries.\n"
+              << "  --tui            Show a live dashboard instead of printing"
+                 " lines.\n"
+              << "Commands:\n"
+              << "  export           Write history as an Arrow file or a Chrome"
+                 " trace.\n"
+              << "  report           Write an HTML report with charts of recent"
+                 " history.\n"
+              << "  bundle           Package recent history and state for a"
+                 " bug report.\n"
+              << "  forecast         Estimate the runtime left from past"
+                 " usage.\n";
+}
+
+int main(int argc, char** argv)
 {
-    BatteryMonitor batmon;
+    if (argc > 1 && std::string_view(argv[1]) == "export")
+    {
+        return exportCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string_view(argv[1]) == "report")
+    {
+        return reportCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string_view(argv[1]) == "bundle")
+    {
+        return bundleCommand(argc - 1, argv + 1);
+    }
+    if (argc > 1 && std::string_view(argv[1]) == "forecast")
+    {
+        return forecastCommand(argc - 1, argv + 1);
+    }
+
+    std::chrono::milliseconds coalesceWindow{50};
+    std::optional<std::filesystem::path> historyPath = history::defaultPath();
+    std::optional<std::chrono::days> historyRetention = std::chrono::days(365);
+    std::optional<std::filesystem::path> socketPath =
+        QueryServer::defaultSocketPath();
+    bool tui = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg(argv[i]);
+        constexpr std::string_view coalesceArg = "--coalesce-ms=";
+        if (arg.starts_with(coalesceArg))
+        {
+            const std::string_view value = arg.substr(coalesceArg.size());
+            unsigned ms = 0;
+            const auto [end, ec] =
+                std::from_chars(value.data(), value.data() + value.size(), ms);
+            if (ec != std::errc() || end != value.data() + value.size())
+            {
+                std::cerr << "Invalid value for --coalesce-ms: " << value
+                          << '\n';
+                return 1;
+            }
+            coalesceWindow = std::chrono::milliseconds(ms);
+        }
+        else if (constexpr std::string_view historyArg = "--history=";
+                 arg.starts_with(historyArg))
+        {
+            historyPath = arg.substr(historyArg.size());
+        }
+        else if (arg == "--no-history")
+        {
+            historyPath.reset();
+        }
+        else if (constexpr std::string_view daysArg = "--history-days=";
+                 arg.starts_with(daysArg))
+        {
+            const std::string_view value = arg.substr(daysArg.size());
+            unsigned days = 0;
+            const auto [end, ec] = std::from_chars(
+                value.data(), value.data() + value.size(), days);
+            if (ec != std::errc() || end != value.data() + value.size())
+            {
+                std::cerr << "Invalid value for --history-days: " << value
+                          << '\n';
+                return 1;
+            }
+            historyRetention.reset();
+            if (days != 0)
+            {
+                historyRetention = std::chrono::days(days);
+            }
+        }
+        else if (constexpr std::string_view socketArg = "--socket=";
+                 arg.starts_with(socketArg))
+        {
+            socketPath = arg.substr(socketArg.size());
+        }
+        else if (arg == "--no-socket")
+        {
+            socketPath.reset();
+        }
+        else if (arg == "--tui")
+        {
+            tui = true;
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    std::optional<HistoryWriter> historyWriter;
+    if (historyPath)
+    {
+        try
+        {
+            std::filesystem::create_directories(historyPath->parent_path());
+            historyWriter.emplace(*historyPath, historyRetention);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "Not recording history: " << e.what() << '\n';
+        }
+    }
+
+    BatteryMonitor batmon(historyWriter ? &*historyWriter : nullptr);
     sdbusplus::async::context ctx(sdbusplus::bus::new_default_system());
+
+    std::optional<RuntimePmAudit> runtimePm;
+    try
+    {
+        runtimePm.emplace(ctx.get_event_loop().get());
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Not auditing runtime PM: " << e.what() << '\n';
+    }
+
+    std::optional<NetworkActivity> network;
+    try
+    {
+        network.emplace(ctx.get_event_loop().get());
+    }
+    catch (const std::exception& e)
+    {
+        std::cout << "Not recording network activity: " << e.what() << '\n';
+    }
+
+    std::optional<QueryServer> queryServer;
+    if (socketPath)
+    {
+        try
+        {
+            queryServer.emplace(ctx.get_event_loop().get(), batmon,
+                                historyWriter ? historyPath : std::nullopt,
+                                *socketPath,
+                                runtimePm ? &*runtimePm : nullptr);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "Not serving queries: " << e.what() << '\n';
+        }
+    }
+
+    std::optional<Dashboard> dashboard;
+    if (tui)
+    {
+        try
+        {
+            dashboard.emplace(ctx.get_event_loop().get(), batmon,
+                              [&ctx] { ctx.request_stop(); });
+            batmon.setPrinting(false);
+        }
+        catch (const std::exception& e)
+        {
+            std::cout << "Not showing dashboard: " << e.what() << '\n';
+        }
+    }
+
+    // Sensors for what the system draws on AC. Without any, only the
+    // battery's rate is known.
+    SystemPowerMeter powerMeter;
+
+    const Samplers samplers{
+        .powerMeter = powerMeter.empty() ? nullptr : &powerMeter,
+        .runtimePm = runtimePm ? &*runtimePm : nullptr,
+        .network = network ? &*network : nullptr};
+
     ctx.spawn(sleepEventMonitor(ctx, batmon));
-    ctx.spawn(powerEventMonitor(ctx, batmon));
+    ctx.spawn(powerEventMonitor(ctx, batmon, coalesceWindow, samplers));
     ctx.run();
 
     return 0;
@@ -0,0 +1,517 @@
+#include "battery_monitor.hpp"
+#include "commands.hpp"
+#include "cycles.hpp"
+#include "history.hpp"
+#include "query_server.hpp"
+#include "reading.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace
+{
+
+constexpr std::string_view topDir = "battery-stats-bundle/";
+// Cap on what's read from any one sysfs file or from the daemon
+constexpr size_t maxSmallFile = 64 * 1024;
+constexpr std::chrono::seconds daemonTimeout{2};
+
+// Writes a gzip-compressed tar archive as it goes. Tar puts each member's size
+// before its data, so that has to be known up front; the data then passes
+// through a fixed buffer, so memory use doesn't grow with the archive.
+class TarGzWriter
+{
+  public:
+    TarGzWriter(std::ostream& out, Time mtime) :
+        out(out), mtime(toEpochMilliseconds(mtime) / 1000),
+        buffer(bufferSize)
+    {
+        // 16 selects the gzip wrapper
+        if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            throw std::runtime_error("Can't initialize zlib");
+        }
+    }
+
+    TarGzWriter(const TarGzWriter&) = delete;
+    TarGzWriter& operator=(const TarGzWriter&) = delete;
+
+    ~TarGzWriter()
+    {
+        deflateEnd(&stream);
+    }
+
+    // Starts a member of the given size, which must then be written in full
+    void beginFile(std::string_view name, uint64_t size)
+    {
+        std::array<char, tarBlock> header{};
+        const std::string path = std::format("{}{}", topDir, name);
+        if (path.size() >= 100)
+        {
+            throw std::runtime_error("Archive member name too long: " + path);
+        }
+        std::ranges::copy(path, header.data());
+        octal(header, 100, 8, 0644);   // mode
+        octal(header, 108, 8, 0);      // uid
+        octal(header, 116, 8, 0);      // gid
+        octal(header, 124, 12, size);  // size
+        octal(header, 136, 12, mtime); // mtime
+        header[156] = '0';             // regular file
+        std::ranges::copy(std::string_view("ustar\0" "00", 8),
+                          header.data() + 257);
+
+        // The checksum is computed with its own field as spaces
+        std::fill_n(header.data() + 148, 8, ' ');
+        unsigned sum = 0;
+        for (const char c : header)
+        {
+            sum += static_cast<unsigned char>(c);
+        }
+        octal(header, 148, 7, sum);
+
+        compress(std::as_bytes(std::span(header)), Z_NO_FLUSH);
+        remaining = size;
+    }
+
+    void write(std::span<const std::byte> data)
+    {
+        if (data.size() > remaining)
+        {
+            throw std::logic_error("Archive member longer than declared");
+        }
+        remaining -= data.size();
+        fileBytes += data.size();
+        compress(data, Z_NO_FLUSH);
+    }
+
+    void write(std::string_view data)
+    {
+        write(std::as_bytes(std::span(data)));
+    }
+
+    // Pads the member out to a whole tar block
+    void endFile()
+    {
+        if (remaining != 0)
+        {
+            throw std::logic_error("Archive member shorter than declared");
+        }
+        static constexpr std::array<std::byte, tarBlock> zeros{};
+        compress(std::span(zeros).first((tarBlock - fileBytes % tarBlock) %
+                                        tarBlock),
+                 Z_NO_FLUSH);
+        fileBytes = 0;
+    }
+
+    void addFile(std::string_view name, std::string_view contents)
+    {
+        beginFile(name, contents.size());
+        write(contents);
+        endFile();
+    }
+
+    // Writes the end-of-archive marker and flushes the compressor
+    void finish()
+    {
+        static constexpr std::array<std::byte, 2 * tarBlock> zeros{};
+        compress(zeros, Z_FINISH);
+    }
+
+  private:
+    static constexpr size_t tarBlock = 512;
+    static constexpr size_t bufferSize = 64 * 1024;
+
+    // Zero-padded octal, NUL terminated
+    static void octal(std::array<char, tarBlock>& header, size_t offset,
+                      size_t length, uint64_t value)
+    {
+        std::format_to_n(header.data() + offset, length - 1, "{:0{}o}", value,
+                         length - 1);
+    }
+
+    void compress(std::span<const std::byte> data, int flush)
+    {
+        // avail_in is 32 bits, so feed large inputs in pieces
+        constexpr size_t maxInput = 1 << 20;
+        do
+        {
+            const auto piece = data.first(std::min(data.size(), maxInput));
+            data = data.subspan(piece.size());
+            const int pieceFlush = data.empty() ? flush : Z_NO_FLUSH;
+
+            stream.next_in = reinterpret_cast<Bytef*>(
+                const_cast<std::byte*>(piece.data()));
+            stream.avail_in = static_cast<uInt>(piece.size());
+            do
+            {
+                stream.next_out = reinterpret_cast<Bytef*>(buffer.data());
+                stream.avail_out = static_cast<uInt>(buffer.size());
+                if (deflate(&stream, pieceFlush) == Z_STREAM_ERROR)
+                {
+                    throw std::runtime_error("Compression failed");
+                }
+                out.write(buffer.data(), static_cast<std::streamsize>(
+                                             buffer.size() - stream.avail_out));
+            } while (stream.avail_out == 0);
+        } while (!data.empty());
+    }
+
+    std::ostream& out;
+    int64_t mtime;
+    std::vector<char> buffer;
+    z_stream stream{};
+    uint64_t remaining = 0;
+    uint64_t fileBytes = 0;
+};
+
+// Adds a member whose contents are produced by generate(write), where write
+// takes string_views. It runs twice, first only to add up the size, so the
+// member never has to be held in memory.
+template <typename Generate>
+void addGenerated(TarGzWriter& archive, std::string_view name,
+                  Generate&& generate)
+{
+    uint64_t size = 0;
+    generate([&](std::string_view str) { size += str.size(); });
+    archive.beginFile(name, size);
+    generate([&](std::string_view str) { archive.write(str); });
+    archive.endFile();
+}
+
+// Formats one line into a fixed buffer and passes it to write
+template <typename Write, typename... Args>
+void writeLine(Write& write, std::format_string<Args...> fmt, Args&&... args)
+{
+    std::array<char, 256> line;
+    const auto result = std::format_to_n(line.data(), line.size() - 1, fmt,
+                                         std::forward<Args>(args)...);
+    *result.out = '\n';
+    write(std::string_view(line.data(), result.out + 1));
+}
+
+std::string optionalEnergy(const std::optional<MicrowattHours>& energy)
+{
+    return energy ? std::to_string(*energy) : std::string();
+}
+
+template <typename Write>
+void writeCycles(const HistoryReader& reader, Time from, Time to, Write write)
+{
+    writeLine(write, "state,start,end,start_energy_uwh,end_energy_uwh,awake_ms,"
+                     "asleep_ms,sleep_energy_uwh,suspends,open,"
+                     "awake_energy_uwh,asleep_energy_uwh,resume_energy_uwh,"
+                     "unaccounted_uwh,closure_error_uwh,equivalent_cycles,"
+                     "depth_half_cycles,high_charge_ms,high_temperature_ms");
+    CycleTracker tracker([&](const Cycle& cycle) {
+        std::array<char, 128> halfCycles;
+        const std::string_view halfCyclesStr(
+            halfCycles.data(), cycle.wear.formatHalfCycles(halfCycles.data()));
+        writeLine(write,
+                  "{},{},{},{},{},{},{},{},{},{},{},{},{},{},{},{:.4f},\"{}\","
+                  "{},{}",
+                  batteryStateName(cycle.state),
+                  toEpochMilliseconds(cycle.start),
+                  toEpochMilliseconds(cycle.end),
+                  optionalEnergy(cycle.startEnergy),
+                  optionalEnergy(cycle.endEnergy), cycle.awakeTime().count(),
+                  cycle.asleepTime.count(), cycle.sleepEnergy,
+                  cycle.suspendCount, cycle.open, cycle.ledger.awake,
+                  cycle.ledger.asleep, cycle.ledger.resumeTransient,
+                  cycle.ledger.unaccounted, cycle.ledger.closureError,
+                  cycle.wear.equivalentCycles, halfCyclesStr,
+                  cycle.wear.highChargeTime.count(),
+                  cycle.wear.highTemperatureTime.count());
+    });
+    // Include the cycle in progress when the range starts
+    for (const history::Record& record : reader.stateBefore(from))
+    {
+        tracker.add(record);
+    }
+    reader.forEach(from, to,
+                   [&](const history::Record& record) { tracker.add(record); });
+    tracker.finish();
+}
+
+template <typename Write>
+void writeSleeps(const HistoryReader& reader, Time from, Time to, Write write)
+{
+    writeLine(write, "start,end,energy_before_uwh,energy_after_uwh");
+    CycleTracker tracker([](const Cycle&) {}, [&](const SleepPeriod& sleep) {
+        writeLine(write, "{},{},{},{}", toEpochMilliseconds(sleep.start),
+                  toEpochMilliseconds(sleep.end),
+                  optionalEnergy(sleep.energyBefore),
+                  optionalEnergy(sleep.energyAfter));
+    });
+    reader.forEach(from, to,
+                   [&](const history::Record& record) { tracker.add(record); });
+    tracker.finish();
+}
+
+// Reads a small file such as a sysfs attribute, whose size stat() can't tell
+std::optional<std::string> readSmallFile(const std::filesystem::path& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return std::nullopt;
+    }
+    std::string contents(maxSmallFile, '\0');
+    file.read(contents.data(), static_cast<std::streamsize>(contents.size()));
+    contents.resize(static_cast<size_t>(file.gcount()));
+    return contents;
+}
+
+// Asks a running daemon for its current stats, wear, latency histogram and
+// runtime PM audit.
+// Returns the reply, or a line saying why there isn't one.
+std::string queryDaemon(const std::optional<std::filesystem::path>& socketPath)
+{
+    if (!socketPath)
+    {
+        return "No socket path, XDG_RUNTIME_DIR isn't set\n";
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socketPath->native().size() >= sizeof(addr.sun_path))
+    {
+        return "Socket path too long: " + socketPath->string() + '\n';
+    }
+    std::ranges::copy(socketPath->native(), addr.sun_path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return std::format("socket() failed: {}\n", std::strerror(errno));
+    }
+
+    std::string reply;
+    const timeval timeout{.tv_sec = daemonTimeout.count(), .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    constexpr std::string_view request = "stats\nwear\nlatency\nruntime-pm\n";
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) <
+            0 ||
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL) < 0)
+    {
+        reply = std::format("Daemon not reachable at {}: {}\n",
+                            socketPath->string(), std::strerror(errno));
+        close(fd);
+        return reply;
+    }
+
+    // The latency and runtime PM replies each end with an "end" line. A
+    // daemon without the audit answers the latter with an error instead.
+    const auto finished = [&reply] {
+        size_t ends = 0;
+        for (std::string_view rest = reply; !rest.empty();)
+        {
+            if (rest.starts_with("end ") || rest.starts_with("error "))
+            {
+                ++ends;
+            }
+            const size_t newline = rest.find('\n');
+            rest.remove_prefix(newline == std::string_view::npos
+                                   ? rest.size()
+                                   : newline + 1);
+        }
+        return ends >= 2;
+    };
+    std::array<char, 4096> buf;
+    while (reply.size() < maxSmallFile && !finished())
+    {
+        const ssize_t n = recv(fd, buf.data(), buf.size(), 0);
+        if (n <= 0)
+        {
+            reply += std::format("Reply cut short: {}\n",
+                                 n < 0 ? std::strerror(errno) : "closed");
+            break;
+        }
+        reply.append(buf.data(), static_cast<size_t>(n));
+    }
+    close(fd);
+    return reply;
+}
+
+std::string systemInfo(const HistoryReader& reader, Time from, Time to,
+                       unsigned days)
+{
+    std::string info = std::format(
+        "battery-stats bundle\ncreated: {}\ndays: {}\nfrom: {}\n"
+        "history blocks: {}\n",
+        toEpochMilliseconds(to), days, toEpochMilliseconds(from),
+        reader.blockCount() - std::min(reader.findBlock(from),
+                                       reader.blockCount()));
+
+    utsname uts{};
+    if (uname(&uts) == 0)
+    {
+        info += std::format("kernel: {} {} {}\n", uts.sysname, uts.release,
+                            uts.machine);
+    }
+    for (const char* attr : {"sys_vendor", "product_name", "product_version",
+                             "bios_version"})
+    {
+        if (auto value = readSmallFile(
+                std::filesystem::path("/sys/class/dmi/id") / attr))
+        {
+            if (!value->ends_with('\n'))
+            {
+                *value += '\n';
+            }
+            info += std::format("{}: {}", attr, *value);
+        }
+    }
+    return info;
+}
+
+void printBundleUsage()
+{
+    std::cerr << "Usage: battery-stats bundle [--days=N] [--history=PATH]"
+                 " [--socket=PATH]\n"
+                 "                            [--output=FILE]\n"
+              << "  --days=N         Include the last N days of history"
+                 " (default 7).\n"
+              << "  --history=PATH   History file to read (default "
+              << history::defaultPath().string() << ").\n"
+              << "  --socket=PATH    Ask the daemon on PATH for its state"
+                 " (default "
+              << QueryServer::defaultSocketPath()
+                     .value_or("none, no XDG_RUNTIME_DIR")
+                     .string()
+              << ").\n"
+              << "  --output=FILE    Write the .tar.gz to FILE instead of"
+                 " stdout.\n";
+}
+
+} // namespace
+
+int bundleCommand(int argc, char** argv)
+{
+    unsigned days = 7;
+    std::filesystem::path historyPath = history::defaultPath();
+    std::optional<std::filesystem::path> socketPath =
+        QueryServer::defaultSocketPath();
+    std::optional<std::filesystem::path> outputPath;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg(argv[i]);
+        if (constexpr std::string_view daysArg = "--days=";
+            arg.starts_with(daysArg))
+        {
+            const std::string_view value = arg.substr(daysArg.size());
+            const auto [end, ec] =
+                std::from_chars(value.data(), value.data() + value.size(), days);
+            if (ec != std::errc() || end != value.data() + value.size() ||
+                days == 0)
+            {
+                std::cerr << "Invalid value for --days: " << value << '\n';
+                return 1;
+            }
+        }
+        else if (constexpr std::string_view historyArg = "--history=";
+                 arg.starts_with(historyArg))
+        {
+            historyPath = arg.substr(historyArg.size());
+        }
+        else if (constexpr std::string_view socketArg = "--socket=";
+                 arg.starts_with(socketArg))
+        {
+            socketPath = arg.substr(socketArg.size());
+        }
+        else if (constexpr std::string_view outputArg = "--output=";
+                 arg.starts_with(outputArg))
+        {
+            outputPath = arg.substr(outputArg.size());
+        }
+        else
+        {
+            printBundleUsage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (!outputPath && isatty(STDOUT_FILENO))
+    {
+        std::cerr << "Not writing a compressed archive to a terminal; use"
+                     " --output=FILE\n";
+        return 1;
+    }
+
+    try
+    {
+        const HistoryReader reader(historyPath);
+        const Time to = Clock::now();
+        const Time from = to - std::chrono::days(days);
+
+        std::ofstream file;
+        if (outputPath)
+        {
+            file.open(*outputPath, std::ios::binary | std::ios::trunc);
+        }
+        std::ostream& out = outputPath ? file : std::cout;
+        out.exceptions(std::ios::badbit | std::ios::failbit);
+
+        TarGzWriter archive(out, to);
+        archive.addFile("system.txt", systemInfo(reader, from, to, days));
+        archive.addFile("daemon.txt", queryDaemon(socketPath));
+
+        // Whole blocks straight from the mapping, which is itself a history
+        // file the other commands can read
+        const auto blocks = reader.blockData(reader.findBlock(from));
+        archive.beginFile("history", blocks.size());
+        archive.write(blocks);
+        archive.endFile();
+
+        addGenerated(archive, "cycles.csv", [&](auto write) {
+            writeCycles(reader, from, to, write);
+        });
+        addGenerated(archive, "sleep.csv", [&](auto write) {
+            writeSleeps(reader, from, to, write);
+        });
+
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(
+                 "/sys/class/power_supply", ec))
+        {
+            if (const auto uevent = readSmallFile(entry.path() / "uevent"))
+            {
+                archive.addFile(std::format("power_supply/{}",
+                                            entry.path().filename().string()),
+                                *uevent);
+            }
+        }
+
+        archive.finish();
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Bundle failed: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "chrome_trace.hpp"
+
+#include <format>
+
+namespace
+{
+
+// Names here are our own fixed strings, but escape anyway so the output is
+// always valid JSON
+class Escaped
+{
+  public:
+    explicit Escaped(std::string_view str) : str(str) {}
+
+    std::string_view str;
+};
+
+} // namespace
+
+template <>
+struct std::formatter<Escaped> : std::formatter<std::string_view>
+{
+    auto format(const Escaped& escaped, std::format_context& ctx) const
+    {
+        auto out = ctx.out();
+        for (char c : escaped.str)
+        {
+            if (c == '"' || c == '\\')
+            {
+                *out++ = '\\';
+                *out++ = c;
+            }
+            else if (static_cast<unsigned char>(c) < 0x20)
+            {
+                out = std::format_to(out, "\\u{:04x}", c);
+            }
+            else
+            {
+                *out++ = c;
+            }
+        }
+        return out;
+    }
+};
+
+ChromeTraceWriter::ChromeTraceWriter(std::ostream& out,
+                                     std::string_view processName) :
+    out(out)
+{
+    out << R"({"displayTimeUnit":"ms","traceEvents":[)";
+    startProcess(processName);
+}
+
+void ChromeTraceWriter::startProcess(std::string_view processName)
+{
+    ++pid;
+    event(R"("ph":"M","pid":{},"name":"process_name","args":{{"name":"{}"}})",
+          pid, Escaped(processName));
+}
+
+void ChromeTraceWriter::nameTrack(int track, std::string_view name)
+{
+    event(R"("ph":"M","pid":{},"tid":{},"name":"thread_name",)"
+          R"("args":{{"name":"{}"}})",
+          pid, track, Escaped(name));
+}
+
+void ChromeTraceWriter::counter(std::string_view name, int64_t timestampUs,
+                                double value)
+{
+    event(R"("ph":"C","pid":{},"name":"{}","ts":{},"args":{{"value":{}}})",
+          pid, Escaped(name), timestampUs, value);
+}
+
+void ChromeTraceWriter::begin(int track, std::string_view name,
+                              int64_t timestampUs)
+{
+    event(R"("ph":"B","pid":{},"tid":{},"name":"{}","ts":{})", pid, track,
+          Escaped(name), timestampUs);
+}
+
+void ChromeTraceWriter::end(int track, int64_t timestampUs)
+{
+    event(R"("ph":"E","pid":{},"tid":{},"ts":{})", pid, track, timestampUs);
+}
+
+void ChromeTraceWriter::finish()
+{
+    if (!finished)
+    {
+        finished = true;
+        out << "]}\n";
+        out.flush();
+    }
+}
+
+template <typename... Args>
+void ChromeTraceWriter::event(std::format_string<Args...> fmt, Args&&... args)
+{
+    // Leave room for the separator and braces; events are short and fixed
+    // apart from names, which are truncated if need be.
+    auto result = std::format_to_n(buffer.data(), buffer.size(),
+                                   "{}{{", first ? "\n" : ",\n");
+    result = std::format_to_n(result.out, buffer.data() + buffer.size() -
+                                              result.out - 1,
+                              fmt, std::forward<Args>(args)...);
+    *result.out++ = '}';
+    out.write(buffer.data(), result.out - buffer.data());
+    first = false;
+}
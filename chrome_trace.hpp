@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <format>
+#include <ostream>
+#include <string_view>
+
+// Streaming writer for the Chrome JSON trace event format, which Perfetto
+// (ui.perfetto.dev) and chrome://tracing both load. Events are written as they
+// are added, so a trace of any length needs constant memory.
+//
+// Timestamps are microseconds. Slices are begin/end pairs on a named track;
+// counters are a named series of values. Both belong to the current process.
+class ChromeTraceWriter
+{
+  public:
+    // Writes the trace header and names the process holding every track
+    ChromeTraceWriter(std::ostream& out, std::string_view processName);
+
+    // Starts a new process for the events that follow, with no named tracks
+    void startProcess(std::string_view processName);
+
+    // Names track `track` (a thread id in the trace); call before using it
+    void nameTrack(int track, std::string_view name);
+
+    void counter(std::string_view name, int64_t timestampUs, double value);
+    void begin(int track, std::string_view name, int64_t timestampUs);
+    void end(int track, int64_t timestampUs);
+
+    // Closes the event list
+    void finish();
+
+  private:
+    template <typename... Args>
+    void event(std::format_string<Args...> fmt, Args&&... args);
+
+    std::ostream& out;
+    std::array<char, 256> buffer{};
+    int pid = 0;
+    bool first = true;
+    bool finished = false;
+};
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+
+// Online fit of a one-RC equivalent circuit to the battery's terminal voltage
+// and current:
+//
+//   V = OCV - R0 * I - Vrc,   Vrc' = a * Vrc + R1 * (1 - a) * I
+//
+// with I positive when discharging. Written in terms of the previous sample
+// this is linear in four parameters,
+//
+//   V[k] = (1 - a) * OCV + a * V[k-1] - R0 * I[k]
+//          + (a * R0 - R1 * (1 - a)) * I[k-1]
+//
+// which recursive least squares with a forgetting factor tracks as OCV drifts
+// with the charge and the resistances with temperature and age. Each sample
+// costs a few dozen multiplications on fixed-size arrays.
+//
+// a stands for exp(-dt / tau), so the fit assumes roughly even sampling;
+// pairs of samples further apart than maxInterval (e.g. across a suspend)
+// aren't used.
+class CircuitModel
+{
+  public:
+    struct Estimate
+    {
+        double openCircuitVolts;
+        // Series resistance, the part that causes voltage sag under load
+        double ohmicResistance;
+        double polarizationResistance;
+        double timeConstantSeconds;
+    };
+
+    static constexpr double forgetting = 0.995;
+    static constexpr std::chrono::minutes maxInterval{5};
+    // Samples before an estimate is offered
+    static constexpr size_t minSamples = 20;
+
+    void add(Time time, double volts, double amps)
+    {
+        if (previous && time > previous->time &&
+            time - previous->time <= maxInterval)
+        {
+            update({1, previous->volts, amps, previous->amps}, volts);
+            const Clock::duration step = time - previous->time;
+            interval = samples == 0 ? step : interval + (step - interval) / 8;
+            ++samples;
+        }
+        previous = Sample{time, volts, amps};
+    }
+
+    // Forgets the previous sample, e.g. on suspend, keeping the fit
+    void restart()
+    {
+        previous.reset();
+    }
+
+    std::optional<Estimate> estimate() const
+    {
+        const double a = theta[1];
+        if (samples < minSamples || !(a > 0 && a < 1))
+        {
+            return std::nullopt;
+        }
+        const double r0 = -theta[2];
+        const double r1 = (a * r0 - theta[3]) / (1 - a);
+        if (!(r0 > 0 && r0 < maxResistance) || !std::isfinite(r1))
+        {
+            return std::nullopt;
+        }
+        const double dt = std::chrono::duration<double>(interval).count();
+        return Estimate{.openCircuitVolts = theta[0] / (1 - a),
+                        .ohmicResistance = r0,
+                        .polarizationResistance = r1,
+                        .timeConstantSeconds = -dt / std::log(a)};
+    }
+
+  private:
+    static constexpr size_t n = 4;
+    using Vector = std::array<double, n>;
+
+    // Anything above this is a bad fit rather than a real battery
+    static constexpr double maxResistance = 1;
+    // Bounds the covariance while the input doesn't vary, which would
+    // otherwise grow without limit under the forgetting factor
+    static constexpr double maxCovarianceTrace = 1e6;
+
+    struct Sample
+    {
+        Time time;
+        double volts;
+        double amps;
+    };
+
+    static std::array<Vector, n> initialCovariance()
+    {
+        std::array<Vector, n> p{};
+        for (size_t i = 0; i < n; ++i)
+        {
+            p[i][i] = 1000;
+        }
+        return p;
+    }
+
+    void update(const Vector& phi, double y)
+    {
+        Vector pPhi{};
+        double denominator = forgetting;
+        double predicted = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                pPhi[i] += covariance[i][j] * phi[j];
+            }
+            denominator += phi[i] * pPhi[i];
+            predicted += phi[i] * theta[i];
+        }
+
+        const double error = y - predicted;
+        double trace = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            theta[i] += pPhi[i] / denominator * error;
+            trace += covariance[i][i];
+        }
+        const double scale = trace > maxCovarianceTrace ? 1 : 1 / forgetting;
+        for (size_t i = 0; i < n; ++i)
+        {
+            for (size_t j = 0; j < n; ++j)
+            {
+                covariance[i][j] =
+                    (covariance[i][j] - pPhi[i] * pPhi[j] / denominator) *
+                    scale;
+            }
+        }
+    }
+
+    Vector theta{};
+    std::array<Vector, n> covariance = initialCovariance();
+    std::optional<Sample> previous;
+    // Smoothed interval between samples, for the time constant
+    Clock::duration interval{};
+    size_t samples = 0;
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+// Offline subcommands, run as `battery-stats COMMAND [ARGS]`. argv[0] is the
+// command name. Each returns the process exit status.
+
+int exportCommand(int argc, char** argv);
+int reportCommand(int argc, char** argv);
+int bundleCommand(int argc, char** argv);
+int forecastCommand(int argc, char** argv);
@@ -0,0 +1,135 @@
+#include "cycles.hpp"
+
+void CycleTracker::add(const history::Record& record)
+{
+    switch (record.kind)
+    {
+        case RecordKind::Energy:
+            if (asleep)
+            {
+                // Matches BatteryMonitor, which drops readings while suspended
+                break;
+            }
+            if (sleep)
+            {
+                sleep->energyAfter = record.energy();
+                if (cycle && sleep->energyBefore)
+                {
+                    cycle->sleepEnergy +=
+                        record.energy() - *sleep->energyBefore;
+                }
+                closeSleep();
+            }
+            ledger.reading(record.time, record.energy());
+            if (energyEmpty && energyFull && *energyFull > *energyEmpty)
+            {
+                wear.stateOfCharge(
+                    record.time,
+                    100.0 *
+                        static_cast<double>(record.energy() - *energyEmpty) /
+                        static_cast<double>(*energyFull - *energyEmpty));
+            }
+            if (cycle)
+            {
+                if (!cycle->startEnergy)
+                {
+                    cycle->startEnergy = record.energy();
+                }
+                cycle->endEnergy = record.energy();
+                cycle->end = record.time;
+            }
+            lastEnergy = record.energy();
+            break;
+
+        case RecordKind::BatteryState:
+        {
+            const auto state = static_cast<BatteryState>(record.value);
+            if (state == BatteryState::Idle)
+            {
+                break;
+            }
+            if (cycle)
+            {
+                cycle->end = record.time;
+                cycle->ledger = ledger.totals();
+                cycle->wear = wear.metrics() - cycleStartWear;
+                onCycle(*cycle);
+            }
+            ledger.reset();
+            cycleStartWear = wear.metrics();
+            cycle = Cycle{.state = state,
+                          .start = record.time,
+                          .end = record.time};
+            break;
+        }
+
+        case RecordKind::Suspend:
+            closeSleep();
+            sleep = SleepPeriod{.start = record.time,
+                                .end = record.time,
+                                .energyBefore = lastEnergy};
+            asleep = true;
+            ledger.suspend(record.time);
+            if (cycle)
+            {
+                ++cycle->suspendCount;
+            }
+            break;
+
+        case RecordKind::Resume:
+            if (sleep && asleep)
+            {
+                sleep->end = record.time;
+                if (cycle)
+                {
+                    cycle->asleepTime +=
+                        std::chrono::duration_cast<std::chrono::milliseconds>(
+                            sleep->end - sleep->start);
+                    cycle->end = record.time;
+                }
+            }
+            ledger.resume(record.time);
+            asleep = false;
+            break;
+
+        case RecordKind::EnergyEmpty:
+            energyEmpty = record.energy();
+            break;
+
+        case RecordKind::EnergyFull:
+            energyFull = record.energy();
+            break;
+
+        case RecordKind::Temperature:
+            wear.temperature(record.time, toCelsius(record.value));
+            break;
+
+        default:
+            break;
+    }
+}
+
+void CycleTracker::finish()
+{
+    closeSleep();
+    if (cycle)
+    {
+        cycle->open = true;
+        cycle->ledger = ledger.totals();
+        cycle->wear = wear.metrics() - cycleStartWear;
+        onCycle(*cycle);
+        cycle.reset();
+    }
+}
+
+void CycleTracker::closeSleep()
+{
+    // A suspend without a matching resume (e.g. the daemon was stopped) isn't
+    // a sleep period we can say anything about.
+    if (sleep && !asleep && onSleep)
+    {
+        onSleep(*sleep);
+    }
+    sleep.reset();
+    asleep = false;
+}
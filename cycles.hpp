@@ -0,0 +1,85 @@
+#pragma once
+
+#include "energy_ledger.hpp"
+#include "history.hpp"
+#include "reading.hpp"
+#include "wear.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+struct SleepPeriod
+{
+    Time start;
+    Time end;
+    // Last reading before suspend and first after resume, when there were any
+    std::optional<MicrowattHours> energyBefore{};
+    std::optional<MicrowattHours> energyAfter{};
+};
+
+// One charge or discharge cycle
+struct Cycle
+{
+    BatteryState state;
+    Time start;
+    Time end;
+    std::optional<MicrowattHours> startEnergy{};
+    std::optional<MicrowattHours> endEnergy{};
+    std::chrono::milliseconds asleepTime{0};
+    MicrowattHours sleepEnergy = 0;
+    uint32_t suspendCount = 0;
+    // sleepEnergy is the whole change across each sleep; the ledger splits
+    // it at the suspend and resume instants
+    EnergyLedger::Totals ledger{};
+    // Wear accrued during the cycle, including rainflow cycles that it
+    // closed
+    WearMetrics wear{};
+    // Still in progress at the end of the history
+    bool open = false;
+
+    std::chrono::milliseconds awakeTime() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   end - start) -
+               asleepTime;
+    }
+};
+
+// Rebuilds cycles and sleep periods from history records, by the same rules
+// BatteryMonitor applies live: a cycle starts at each change to charging,
+// discharging or idling at the charge threshold, while plain idle doesn't start
+// or end one, and the energy used asleep is the difference between the last
+// reading before suspend and the first after resume.
+class CycleTracker
+{
+  public:
+    explicit CycleTracker(
+        std::function<void(const Cycle&)> onCycle,
+        std::function<void(const SleepPeriod&)> onSleep = {}) :
+        onCycle(std::move(onCycle)), onSleep(std::move(onSleep))
+    {}
+
+    void add(const history::Record& record);
+
+    // Reports the cycle and sleep period still in progress, if any
+    void finish();
+
+  private:
+    void closeSleep();
+
+    std::function<void(const Cycle&)> onCycle;
+    std::function<void(const SleepPeriod&)> onSleep;
+
+    std::optional<Cycle> cycle;
+    std::optional<SleepPeriod> sleep;
+    bool asleep = false;
+    std::optional<MicrowattHours> lastEnergy;
+    EnergyLedger ledger;
+    // Runs across cycles, as a rainflow cycle spans a charge and a discharge
+    WearTracker wear;
+    WearMetrics cycleStartWear;
+    std::optional<MicrowattHours> energyEmpty;
+    std::optional<MicrowattHours> energyFull;
+};
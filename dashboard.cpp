@@ -0,0 +1,571 @@
+#include "dashboard.hpp"
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <system_error>
+
+namespace
+{
+
+constexpr std::string_view enterScreen = "\x1b[?1049h\x1b[?25l\x1b[2J";
+constexpr std::string_view leaveScreen = "\x1b[?25h\x1b[?1049l";
+// Unchanged cells shorter than this between two changes are rewritten rather
+// than skipped, as that's cheaper than a cursor move.
+constexpr size_t maxGap = 6;
+constexpr char32_t sparkBase = U'▁'; // Lower one eighth block
+constexpr std::array<int, 5> handledSignals = {SIGINT, SIGTERM, SIGWINCH,
+                                               SIGTSTP, SIGCONT};
+
+void appendUtf8(std::string& out, char32_t c)
+{
+    if (c < 0x80)
+    {
+        out.push_back(static_cast<char>(c));
+    }
+    else if (c < 0x800)
+    {
+        out.push_back(static_cast<char>(0xc0 | (c >> 6)));
+        out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+    }
+    else
+    {
+        out.push_back(static_cast<char>(0xe0 | (c >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (c & 0x3f)));
+    }
+}
+
+void writeAll(std::string_view data)
+{
+    while (!data.empty())
+    {
+        const ssize_t len = write(STDOUT_FILENO, data.data(), data.size());
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            return;
+        }
+        data.remove_prefix(static_cast<size_t>(len));
+    }
+}
+
+double hoursOf(Clock::duration duration)
+{
+    return std::chrono::duration<double, std::ratio<3600>>(duration).count();
+}
+
+// True if the steady clock stopped between the readings, i.e. we slept
+bool spansSuspend(const Reading& a, const Reading& b)
+{
+    return (b.time - a.time) - (b.relTime - a.relTime) >
+           std::chrono::seconds(5);
+}
+
+} // namespace
+
+Dashboard::Dashboard(sd_event* event, BatteryMonitor& batmon,
+                     std::function<void()> onQuit) :
+    event(event), batmon(batmon), onQuit(std::move(onQuit))
+{
+    if (!isatty(STDOUT_FILENO))
+    {
+        throw std::system_error(ENOTTY, std::generic_category(),
+                                "Dashboard output");
+    }
+
+    // sd-event only sees signals that are blocked
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int sig : handledSignals)
+    {
+        sigaddset(&mask, sig);
+    }
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+
+    int r = sd_event_add_defer(event, &redrawSource, onRedraw, this);
+    for (size_t i = 0; r >= 0 && i < handledSignals.size(); ++i)
+    {
+        r = sd_event_add_signal(event, &signalSources[i], handledSignals[i],
+                                onSignal, this);
+    }
+    if (r >= 0 && isatty(STDIN_FILENO))
+    {
+        r = sd_event_add_io(event, &inputSource, STDIN_FILENO, EPOLLIN,
+                            onInput, this);
+    }
+    if (r < 0)
+    {
+        sd_event_source_unref(redrawSource);
+        for (sd_event_source* source : signalSources)
+        {
+            sd_event_source_unref(source);
+        }
+        throw std::system_error(-r, std::generic_category(),
+                                "Adding dashboard to event loop");
+    }
+
+    // Keys are read as typed, without echo
+    if (termios attrs{}; inputSource && tcgetattr(STDIN_FILENO, &attrs) == 0)
+    {
+        savedTermios = attrs;
+        attrs.c_lflag &= ~static_cast<tcflag_t>(ICANON | ECHO);
+        attrs.c_cc[VMIN] = 1;
+        attrs.c_cc[VTIME] = 0;
+        dashboardTermios = attrs;
+    }
+
+    enterTerminal();
+    resize();
+    batmon.addListener([this] { statsChanged(); });
+    scheduleRedraw();
+}
+
+Dashboard::~Dashboard()
+{
+    if (!stopped)
+    {
+        leaveTerminal();
+    }
+    sd_event_source_unref(inputSource);
+    for (sd_event_source* source : signalSources)
+    {
+        sd_event_source_unref(source);
+    }
+    sd_event_source_unref(redrawSource);
+}
+
+int Dashboard::onRedraw(sd_event_source* /* source */, void* userdata)
+{
+    auto* dashboard = static_cast<Dashboard*>(userdata);
+    // Writing to the terminal from the background would stop us (or scribble
+    // over the foreground job), so don't even compose a frame; catch up with a
+    // full redraw on SIGCONT instead.
+    if (dashboard->stopped || !dashboard->inForeground())
+    {
+        dashboard->fullRedraw = true;
+        return 0;
+    }
+    dashboard->compose();
+    dashboard->draw();
+    return 0;
+}
+
+int Dashboard::onSignal(sd_event_source* /* source */,
+                        const signalfd_siginfo* info, void* userdata)
+{
+    auto* dashboard = static_cast<Dashboard*>(userdata);
+    switch (info->ssi_signo)
+    {
+        case SIGWINCH:
+            dashboard->resize();
+            dashboard->scheduleRedraw();
+            break;
+        case SIGTSTP:
+            // Give the shell its terminal back as it was before stopping
+            if (!dashboard->stopped)
+            {
+                dashboard->leaveTerminal();
+                dashboard->stopped = true;
+            }
+            raise(SIGSTOP);
+            break;
+        case SIGCONT:
+            // Back in the foreground, and the screen may have been used.
+            // Taking the terminal back from the background would stop us
+            // again, so that waits for the SIGCONT of being brought forward.
+            if (dashboard->stopped && dashboard->inForeground())
+            {
+                dashboard->enterTerminal();
+                dashboard->stopped = false;
+            }
+            dashboard->fullRedraw = true;
+            dashboard->scheduleRedraw();
+            break;
+        default:
+            dashboard->onQuit();
+            break;
+    }
+    return 0;
+}
+
+int Dashboard::onInput(sd_event_source* source, int fd, uint32_t /* revents */,
+                       void* userdata)
+{
+    std::array<char, 64> buf;
+    const ssize_t len = read(fd, buf.data(), buf.size());
+    if (len <= 0)
+    {
+        // Nothing more will come from a closed terminal
+        sd_event_source_set_enabled(source, SD_EVENT_OFF);
+        return 0;
+    }
+    if (std::ranges::find(buf.begin(), buf.begin() + len, 'q') !=
+        buf.begin() + len)
+    {
+        static_cast<Dashboard*>(userdata)->onQuit();
+    }
+    return 0;
+}
+
+void Dashboard::enterTerminal()
+{
+    if (dashboardTermios)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &*dashboardTermios);
+    }
+    writeAll(enterScreen);
+}
+
+void Dashboard::leaveTerminal()
+{
+    writeAll(leaveScreen);
+    if (savedTermios)
+    {
+        tcsetattr(STDIN_FILENO, TCSANOW, &*savedTermios);
+    }
+}
+
+bool Dashboard::inForeground() const
+{
+    return tcgetpgrp(STDOUT_FILENO) == getpgrp();
+}
+
+void Dashboard::statsChanged()
+{
+    // Called from the battery event path, so only record what happened and
+    // leave the drawing for later.
+    const bool suspended = batmon.isSuspended();
+    if (suspended && !wasSuspended)
+    {
+        if (currentSleep)
+        {
+            // Slept again before a reading after the last resume
+            sleeps.push_back(*currentSleep);
+        }
+        currentSleep = SleepPeriod{.start = Clock::now(), .end = Clock::now()};
+        if (!recent.empty())
+        {
+            currentSleep->energyBefore = recent.back().energy;
+        }
+    }
+    else if (!suspended && wasSuspended && currentSleep)
+    {
+        currentSleep->end = Clock::now();
+    }
+    wasSuspended = suspended;
+
+    if (const auto reading = batmon.lastReading();
+        reading &&
+        (recent.empty() || reading->relTime != recent.back().relTime))
+    {
+        recent.push_back(*reading);
+        if (currentSleep && !suspended)
+        {
+            currentSleep->energyAfter = reading->energy;
+            sleeps.push_back(*currentSleep);
+            currentSleep.reset();
+        }
+    }
+
+    scheduleRedraw();
+}
+
+void Dashboard::scheduleRedraw()
+{
+    sd_event_source_set_enabled(redrawSource, SD_EVENT_ONESHOT);
+}
+
+void Dashboard::resize()
+{
+    winsize size{};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0 || size.ws_col == 0)
+    {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+    rows = size.ws_row;
+    cols = size.ws_col;
+    frame.assign(rows * cols, U' ');
+    shown.assign(rows * cols, U' ');
+    fullRedraw = true;
+}
+
+void Dashboard::text(size_t row, size_t col, std::string_view str)
+{
+    if (row >= rows)
+    {
+        return;
+    }
+    for (size_t i = 0; i < str.size() && col + i < cols; ++i)
+    {
+        frame[row * cols + col + i] = static_cast<unsigned char>(str[i]);
+    }
+}
+
+void Dashboard::compose()
+{
+    std::ranges::fill(frame, U' ');
+    const Time now = Clock::now();
+
+    text(0, 0, "battery-stats");
+    {
+        auto end = std::format_to_n(line.data(), line.size(), "updated ").out;
+        end = formatLocalTime(end, now);
+        const std::string_view updated(line.data(), end);
+        text(0, cols > updated.size() ? cols - updated.size() : 0, updated);
+    }
+
+    const auto state = batmon.batteryState();
+    const auto& energy = batmon.energyStat();
+    text(2, 0, "State");
+    text(2, 11,
+         batmon.isSuspended() ? "suspended"
+         : state              ? batteryStateName(*state)
+                              : "unknown");
+    if (energy)
+    {
+        if (energy->percent)
+        {
+            print(2, 25, "{:.1f}%  {:.3f} Wh", *energy->percent,
+                  toWattHours(energy->energy));
+        }
+        else
+        {
+            print(2, 25, "{:.3f} Wh", toWattHours(energy->energy));
+        }
+    }
+
+    text(3, 0, "Power");
+    if (const auto& rate = batmon.rateStat())
+    {
+        print(3, 11, "{:+.2f} W", rate->watts);
+        if (rate->percentPerHour)
+        {
+            print(3, 25, "{:+.1f} %/h", *rate->percentPerHour);
+        }
+    }
+
+    text(4, 0, "Average");
+    size_t col = 11;
+    for (const std::chrono::minutes window :
+         {std::chrono::minutes(1), std::chrono::minutes(5),
+          std::chrono::minutes(15), std::chrono::minutes(60)})
+    {
+        if (const auto watts = averageWatts(now, window))
+        {
+            print(4, col, "{}m {:+.2f} W", window.count(), *watts);
+        }
+        else
+        {
+            print(4, col, "{}m -", window.count());
+        }
+        col += 15;
+    }
+
+    text(5, 0, "Cycle");
+    const auto& average = batmon.averageRateStat();
+    if (average)
+    {
+        print(5, 11, "{:+.2f} W", average->watts);
+        if (average->percentPerHour)
+        {
+            print(5, 25, "{:+.1f} %/h", *average->percentPerHour);
+        }
+    }
+
+    // Time left at the cycle's average rate. Charging stops at the charge
+    // threshold, if there is one.
+    const auto emptyEnergy = batmon.emptyEnergy();
+    const auto fullEnergy = batmon.usableFullEnergy();
+    if (energy && average && average->watts != 0 && emptyEnergy &&
+        fullEnergy && state != BatteryState::Idle &&
+        state != BatteryState::AtThreshold)
+    {
+        const bool charging = average->watts > 0;
+        const MicrowattHours remaining = charging
+                                             ? *fullEnergy - energy->energy
+                                             : energy->energy - *emptyEnergy;
+        const double hours = toWattHours(remaining) / std::abs(average->watts);
+        text(6, 0, charging ? "To full" : "To empty");
+        if (hours >= 0 && hours < 1000)
+        {
+            const auto end = formatRelTime(
+                line.data(),
+                std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::duration<double, std::ratio<3600>>(hours)));
+            text(6, 11, {line.data(), end});
+        }
+    }
+
+    composeSparkline(8, now);
+
+    text(11, 0, "Sleep");
+    size_t row = 12;
+    for (size_t i = sleeps.size(); i > 0; --i, ++row)
+    {
+        const SleepPeriod& sleep = sleeps[i - 1];
+        auto end = formatLocalTime(line.data(), sleep.start);
+        end = std::format_to_n(end, line.data() + line.size() - end, "  ").out;
+        end = formatRelTime(end, sleep.end - sleep.start);
+        if (sleep.energyBefore && sleep.energyAfter)
+        {
+            const MicrowattHours used =
+                *sleep.energyAfter - *sleep.energyBefore;
+            const double hours = hoursOf(sleep.end - sleep.start);
+            end = std::format_to_n(end, line.data() + line.size() - end,
+                                   "  {:+.3f} Wh", toWattHours(used))
+                      .out;
+            if (hours > 0)
+            {
+                end = std::format_to_n(end, line.data() + line.size() - end,
+                                       "  {:+.0f} mW",
+                                       toWattHours(used) * 1000 / hours)
+                          .out;
+            }
+        }
+        text(row, 2, {line.data(), end});
+    }
+
+    if (rows > 0)
+    {
+        text(rows - 1, 0, "q to quit");
+    }
+}
+
+void Dashboard::composeSparkline(size_t row, Time now)
+{
+    text(row, 0, "Last hour");
+    const size_t width = std::min(cols > 13 ? cols - 13 : 0, maxSparklineWidth);
+    if (width == 0 || row + 1 >= rows)
+    {
+        return;
+    }
+
+    // Energy and awake time per column, from consecutive readings
+    std::array<double, maxSparklineWidth> energy{};
+    std::array<double, maxSparklineWidth> hours{};
+    const Time start = now - sparklineSpan;
+    for (size_t i = 1; i < recent.size(); ++i)
+    {
+        const Reading& a = recent[i - 1];
+        const Reading& b = recent[i];
+        if (b.time < start || spansSuspend(a, b))
+        {
+            continue;
+        }
+        const auto column = std::min(
+            static_cast<size_t>(hoursOf(b.time - start) /
+                                hoursOf(sparklineSpan) *
+                                static_cast<double>(width)),
+            width - 1);
+        energy[column] += toWattHours(b.energy - a.energy);
+        hours[column] += hoursOf(b.relTime - a.relTime);
+    }
+
+    double maxWatts = 0;
+    for (size_t i = 0; i < width; ++i)
+    {
+        if (hours[i] > 0)
+        {
+            maxWatts = std::max(maxWatts, std::abs(energy[i] / hours[i]));
+        }
+    }
+    for (size_t i = 0; i < width; ++i)
+    {
+        char32_t cell = U' ';
+        if (hours[i] > 0 && maxWatts > 0)
+        {
+            const double level = std::abs(energy[i] / hours[i]) / maxWatts;
+            cell = sparkBase + static_cast<char32_t>(std::lround(level * 7));
+        }
+        if (11 + i < cols)
+        {
+            frame[(row + 1) * cols + 11 + i] = cell;
+        }
+    }
+    print(row, 11, "peak {:.2f} W", maxWatts);
+}
+
+std::optional<double> Dashboard::averageWatts(Time now,
+                                              std::chrono::minutes window) const
+{
+    MicrowattHours energy = 0;
+    RelClock::duration awake{};
+    for (size_t i = recent.size(); i > 1; --i)
+    {
+        const Reading& a = recent[i - 2];
+        const Reading& b = recent[i - 1];
+        if (a.time < now - window)
+        {
+            break;
+        }
+        if (!spansSuspend(a, b))
+        {
+            energy += b.energy - a.energy;
+            awake += b.relTime - a.relTime;
+        }
+    }
+    if (awake <= RelClock::duration::zero())
+    {
+        return std::nullopt;
+    }
+    return toWattHours(energy) / hoursOf(awake);
+}
+
+void Dashboard::draw()
+{
+    output.clear();
+    if (fullRedraw)
+    {
+        output += "\x1b[2J";
+        std::ranges::fill(shown, U' ');
+        fullRedraw = false;
+    }
+
+    for (size_t row = 0; row < rows; ++row)
+    {
+        const char32_t* next = &frame[row * cols];
+        char32_t* current = &shown[row * cols];
+        size_t col = 0;
+        while (col < cols)
+        {
+            if (next[col] == current[col])
+            {
+                ++col;
+                continue;
+            }
+
+            // Extend the run over short gaps of unchanged cells
+            const size_t start = col;
+            size_t last = col;
+            for (++col; col < cols && col - last <= maxGap; ++col)
+            {
+                if (next[col] != current[col])
+                {
+                    last = col;
+                }
+            }
+
+            const auto result =
+                std::format_to_n(line.data(), line.size(), "\x1b[{};{}H",
+                                 row + 1, start + 1);
+            output.append(line.data(), result.out);
+            for (size_t i = start; i <= last; ++i)
+            {
+                appendUtf8(output, next[i]);
+                current[i] = next[i];
+            }
+            col = last + 1;
+        }
+    }
+    writeAll(output);
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "battery_monitor.hpp"
+#include "cycles.hpp"
+#include "reading.hpp"
+#include "ring_buffer.hpp"
+
+#include <sys/signalfd.h>
+#include <systemd/sd-event.h>
+#include <termios.h>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <format>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Full-screen live view for --tui, shown instead of printed lines: current and
+// windowed average power, a sparkline of the last hour, recent sleeps and time
+// to empty or full.
+//
+// Runs on the daemon's sd-event loop. A battery update only marks the screen
+// dirty; a deferred event then composes the next frame and writes just the
+// cells that differ from the last one, so a burst of updates costs one small
+// write. Nothing runs while nothing changes, and no frame is composed or drawn
+// while the terminal has us in the background. Ctrl-Z restores the terminal
+// before stopping, and the dashboard takes it back when brought forward.
+class Dashboard
+{
+  public:
+    // Throws std::system_error if stdout isn't a terminal or the event sources
+    // can't be added. onQuit is called on q, Ctrl-C or SIGTERM.
+    Dashboard(sd_event* event, BatteryMonitor& batmon,
+              std::function<void()> onQuit);
+    Dashboard(const Dashboard&) = delete;
+    Dashboard& operator=(const Dashboard&) = delete;
+    // Restores the terminal
+    ~Dashboard();
+
+  private:
+    static constexpr size_t maxSparklineWidth = 120;
+    static constexpr std::chrono::hours sparklineSpan{1};
+
+    static int onRedraw(sd_event_source* source, void* userdata);
+    static int onSignal(sd_event_source* source, const signalfd_siginfo* info,
+                        void* userdata);
+    static int onInput(sd_event_source* source, int fd, uint32_t revents,
+                       void* userdata);
+
+    // Switch the terminal to the dashboard's screen and key handling, and
+    // back as it was
+    void enterTerminal();
+    void leaveTerminal();
+    bool inForeground() const;
+
+    void statsChanged();
+    void scheduleRedraw();
+    void resize();
+    void compose();
+    void draw();
+
+    // Writes ASCII text into the next frame, clipped to the screen
+    void text(size_t row, size_t col, std::string_view str);
+    template <typename... Args>
+    void print(size_t row, size_t col, std::format_string<Args...> fmt,
+               Args&&... args)
+    {
+        const auto result = std::format_to_n(line.data(), line.size(), fmt,
+                                             std::forward<Args>(args)...);
+        text(row, col, {line.data(), result.out});
+    }
+    void composeSparkline(size_t row, Time now);
+
+    // Average power over the awake time within the window before now
+    std::optional<double> averageWatts(Time now,
+                                       std::chrono::minutes window) const;
+
+    sd_event* event;
+    BatteryMonitor& batmon;
+    std::function<void()> onQuit;
+    sd_event_source* redrawSource = nullptr;
+    std::array<sd_event_source*, 5> signalSources{};
+    sd_event_source* inputSource = nullptr;
+    std::optional<termios> savedTermios;
+    std::optional<termios> dashboardTermios;
+    // Stopped by Ctrl-Z and not yet back in the foreground
+    bool stopped = false;
+
+    size_t rows = 0;
+    size_t cols = 0;
+    // Cells of the frame being composed and of what's on screen
+    std::vector<char32_t> frame;
+    std::vector<char32_t> shown;
+    bool fullRedraw = true;
+    std::string output;
+    std::array<char, 256> line{};
+
+    // Readings since about the last hour, for the sparkline and averages
+    RingBuffer<Reading, 1024> recent;
+    RingBuffer<SleepPeriod, 4> sleeps;
+    std::optional<SleepPeriod> currentSleep;
+    bool wasSuspended = false;
+};
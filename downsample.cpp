@@ -0,0 +1,197 @@
+#include "downsample.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace
+{
+
+double seconds(Clock::duration duration)
+{
+    return std::chrono::duration<double>(duration).count();
+}
+
+} // namespace
+
+Downsampler::Downsampler(DownsampleMethod method, Time from, Time to,
+                         size_t points,
+                         std::function<void(const Sample&)> emit) :
+    method(method), from(from), span(seconds(to - from)),
+    buckets(std::max<size_t>(
+        method == DownsampleMethod::Lttb ? points - std::min<size_t>(points, 2)
+                                         : points / 2,
+        1)),
+    emit(std::move(emit))
+{}
+
+void Downsampler::add(const Sample& sample)
+{
+    if (method == DownsampleMethod::Lttb)
+    {
+        addLttb(sample);
+    }
+    else
+    {
+        addEnvelope(sample);
+    }
+}
+
+void Downsampler::finish()
+{
+    if (method == DownsampleMethod::Lttb)
+    {
+        finishLttb();
+    }
+    else if (started)
+    {
+        flushEnvelope();
+        started = false;
+    }
+}
+
+size_t Downsampler::bucketOf(Time time) const
+{
+    if (span <= 0 || time <= from)
+    {
+        return 0;
+    }
+    const double position = seconds(time - from) / span;
+    return std::min(
+        static_cast<size_t>(position * static_cast<double>(buckets)),
+        buckets - 1);
+}
+
+void Downsampler::addLttb(const Sample& sample)
+{
+    if (!started)
+    {
+        // The first sample is always kept
+        emit(sample);
+        previous = sample;
+        started = true;
+        return;
+    }
+
+    const size_t bucket = bucketOf(sample.time);
+    if (!next.empty() && bucket != nextBucket)
+    {
+        // `next` is complete, so its average is known and a sample can be
+        // chosen from `current`
+        selectFromNext();
+        current.swap(next);
+        next.clear();
+    }
+    next.push_back(sample);
+    nextBucket = bucket;
+}
+
+void Downsampler::finishLttb()
+{
+    if (!started)
+    {
+        return;
+    }
+
+    // The last sample is always kept, and stands in for the bucket after the
+    // last two
+    if (!next.empty())
+    {
+        const Sample last = next.back();
+        next.pop_back();
+        if (next.empty())
+        {
+            selectFromCurrent(last.time, static_cast<double>(last.value));
+        }
+        else
+        {
+            selectFromNext();
+        }
+        current.swap(next);
+        selectFromCurrent(last.time, static_cast<double>(last.value));
+        emit(last);
+    }
+    current.clear();
+    next.clear();
+    started = false;
+}
+
+void Downsampler::selectFromNext()
+{
+    double sum = 0;
+    for (const Sample& s : next)
+    {
+        sum += static_cast<double>(s.value);
+    }
+    const Time middle =
+        next.front().time + (next.back().time - next.front().time) / 2;
+    selectFromCurrent(middle, sum / static_cast<double>(next.size()));
+}
+
+void Downsampler::selectFromCurrent(Time targetTime, double targetValue)
+{
+    if (current.empty())
+    {
+        return;
+    }
+
+    const double previousTime = seconds(previous.time - from);
+    const double previousValue = static_cast<double>(previous.value);
+    const double targetDt = seconds(targetTime - from) - previousTime;
+    const double targetDv = targetValue - previousValue;
+
+    const Sample* best = &current.front();
+    double bestArea = -1;
+    for (const Sample& s : current)
+    {
+        // Twice the triangle's area; only the comparison matters
+        const double area =
+            std::abs((seconds(s.time - from) - previousTime) * targetDv -
+                     targetDt * (static_cast<double>(s.value) - previousValue));
+        if (area > bestArea)
+        {
+            bestArea = area;
+            best = &s;
+        }
+    }
+    previous = *best;
+    emit(previous);
+    current.clear();
+}
+
+void Downsampler::addEnvelope(const Sample& sample)
+{
+    const size_t bucket = bucketOf(sample.time);
+    if (started && bucket != nextBucket)
+    {
+        flushEnvelope();
+        started = false;
+    }
+    if (!started)
+    {
+        min = max = sample;
+        nextBucket = bucket;
+        started = true;
+        return;
+    }
+    if (sample.value < min.value)
+    {
+        min = sample;
+    }
+    if (sample.value > max.value)
+    {
+        max = sample;
+    }
+}
+
+void Downsampler::flushEnvelope()
+{
+    // In time order, and only once if both are the same sample
+    const Sample& first = min.time <= max.time ? min : max;
+    const Sample& second = min.time <= max.time ? max : min;
+    emit(first);
+    if (second.time != first.time || second.value != first.value)
+    {
+        emit(second);
+    }
+}
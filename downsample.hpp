@@ -0,0 +1,70 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Reduces a long series of readings to about `points` samples that still look
+// the same when plotted, in one pass over the input in time order.
+//
+// The range [from, to] is split into equal time buckets.
+// - Lttb (Largest-Triangle-Three-Buckets) keeps the first and last samples and
+//   one per bucket: the one forming the largest triangle with the sample kept
+//   from the bucket before and the average of the bucket after. Only the
+//   current and next buckets are held in memory.
+// - Envelope keeps the minimum and maximum of each bucket, so no spike is ever
+//   lost, at the cost of a jagged line.
+// Empty buckets (e.g. while suspended or off) produce nothing.
+struct Sample
+{
+    Time time;
+    int64_t value;
+};
+
+enum class DownsampleMethod
+{
+    Lttb,
+    Envelope,
+};
+
+class Downsampler
+{
+  public:
+    Downsampler(DownsampleMethod method, Time from, Time to, size_t points,
+                std::function<void(const Sample&)> emit);
+
+    void add(const Sample& sample);
+    // Emits whatever is still buffered
+    void finish();
+
+  private:
+    size_t bucketOf(Time time) const;
+    void addLttb(const Sample& sample);
+    void addEnvelope(const Sample& sample);
+    void finishLttb();
+    void flushEnvelope();
+    // Keeps the sample in `current` with the largest triangle between the
+    // last kept sample and `target`
+    void selectFromCurrent(Time targetTime, double targetValue);
+    // The same, with `next`'s average as the target
+    void selectFromNext();
+
+    DownsampleMethod method;
+    Time from;
+    double span;
+    size_t buckets;
+    std::function<void(const Sample&)> emit;
+
+    bool started = false;
+    Sample previous{};
+    std::vector<Sample> current;
+    std::vector<Sample> next;
+    size_t nextBucket = 0;
+
+    // Envelope state for the bucket being filled
+    Sample min{};
+    Sample max{};
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <optional>
+
+// Splits the energy change over a cycle by where it went. Rather than putting
+// the whole change between the readings either side of a sleep down to sleep,
+// the energy at the suspend and resume instants is interpolated at the cycle's
+// awake rate so far:
+//
+//   reading   suspend                resume      reading
+//      |-awake-|-------- asleep --------|- resume -|
+//                                         transient
+//
+// If the interpolated energies would fall outside the two readings, the awake
+// parts are scaled down to fit. Holds no allocations, so BatteryMonitor can
+// keep one per cycle.
+class EnergyLedger
+{
+  public:
+    struct Totals
+    {
+        MicrowattHours awake = 0;
+        MicrowattHours asleep = 0;
+        // From each resume to the first reading after it
+        MicrowattHours resumeTransient = 0;
+        // Changes across gaps in the readings longer than maxGap
+        MicrowattHours unaccounted = 0;
+        // Change from the first reading to the last less the sum of the
+        // above: changes that couldn't be placed at all, such as to a reading
+        // timestamped before the one it follows
+        MicrowattHours closureError = 0;
+    };
+
+    // Longest interval between awake readings whose change is trusted
+    static constexpr std::chrono::minutes maxGap{30};
+
+    void reading(Time time, MicrowattHours energy)
+    {
+        if (asleep)
+        {
+            return;
+        }
+        if (!first)
+        {
+            first = Point{time, energy};
+        }
+        else
+        {
+            const MicrowattHours change = energy - last.energy;
+            if (time < last.time)
+            {
+                // Left for closureError
+            }
+            else if (suspendTime)
+            {
+                splitSleep(time, change);
+            }
+            else if (time - last.time > maxGap)
+            {
+                sums.unaccounted += change;
+            }
+            else
+            {
+                sums.awake += change;
+                awakeTime += time - last.time;
+            }
+        }
+        last = Point{time, energy};
+        suspendTime.reset();
+    }
+
+    void suspend(Time time)
+    {
+        if (asleep)
+        {
+            return;
+        }
+        asleep = true;
+        if (!first)
+        {
+            return;
+        }
+        // Several sleeps without a reading in between are split as one, with
+        // the awake time between them counted before the first
+        if (suspendTime)
+        {
+            awakeBeforeSleep += time - resumeTime;
+        }
+        else
+        {
+            awakeBeforeSleep = time - last.time;
+        }
+        suspendTime = time;
+    }
+
+    void resume(Time time)
+    {
+        if (!asleep)
+        {
+            return;
+        }
+        asleep = false;
+        resumeTime = time;
+    }
+
+    // Starts a new cycle, keeping whether we're asleep
+    void reset()
+    {
+        const bool wasAsleep = asleep;
+        *this = EnergyLedger();
+        asleep = wasAsleep;
+    }
+
+    Totals totals() const
+    {
+        Totals result = sums;
+        if (first)
+        {
+            result.closureError = last.energy - first->energy - sums.awake -
+                                  sums.asleep - sums.resumeTransient -
+                                  sums.unaccounted;
+        }
+        return result;
+    }
+
+  private:
+    struct Point
+    {
+        Time time;
+        MicrowattHours energy;
+    };
+
+    static double milliseconds(Clock::duration duration)
+    {
+        return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    void splitSleep(Time time, MicrowattHours change)
+    {
+        MicrowattHours beforeShare = 0;
+        MicrowattHours afterShare = 0;
+        if (awakeTime > Clock::duration::zero())
+        {
+            const double rate =
+                static_cast<double>(sums.awake) / milliseconds(awakeTime);
+            beforeShare = std::llround(rate * milliseconds(awakeBeforeSleep));
+            afterShare = std::llround(rate * milliseconds(time - resumeTime));
+
+            const MicrowattHours estimated = beforeShare + afterShare;
+            if (estimated == 0 || change == 0 ||
+                (estimated < 0) != (change < 0))
+            {
+                beforeShare = 0;
+                afterShare = 0;
+            }
+            else if (std::abs(estimated) > std::abs(change))
+            {
+                beforeShare = std::llround(static_cast<double>(beforeShare) *
+                                           static_cast<double>(change) /
+                                           static_cast<double>(estimated));
+                afterShare = change - beforeShare;
+            }
+        }
+        sums.awake += beforeShare;
+        awakeTime += awakeBeforeSleep;
+        sums.resumeTransient += afterShare;
+        sums.asleep += change - beforeShare - afterShare;
+    }
+
+    Totals sums;
+    std::optional<Point> first;
+    Point last{};
+    // Wall time behind sums.awake, for the awake rate
+    Clock::duration awakeTime{};
+
+    bool asleep = false;
+    // First suspend since the last reading
+    std::optional<Time> suspendTime;
+    Time resumeTime{};
+    Clock::duration awakeBeforeSleep{};
+};
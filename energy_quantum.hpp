@@ -0,0 +1,56 @@
+#pragma once
+
+#include "reading.hpp"
+#include "ring_buffer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <optional>
+
+// Learns the step size the battery's fuel gauge reports energy in, which
+// varies from a few mWh to a few hundred between machines. The quantum is
+// the smallest recent change between readings, ignoring changes under a
+// quarter of the median: gauges that report charge have their energy
+// computed with the voltage, whose jitter adds small changes that aren't
+// steps of the gauge.
+class QuantumEstimator
+{
+  public:
+    // Changes needed before there's an estimate
+    static constexpr size_t minChanges = 8;
+
+    void add(MicrowattHours change)
+    {
+        if (change == 0)
+        {
+            return;
+        }
+        changes.push_back(std::abs(change));
+        if (changes.size() < minChanges)
+        {
+            return;
+        }
+
+        std::array<MicrowattHours, maxChanges> sorted;
+        for (size_t i = 0; i < changes.size(); ++i)
+        {
+            sorted[i] = changes[i];
+        }
+        const auto end = sorted.begin() + changes.size();
+        std::sort(sorted.begin(), end);
+        const MicrowattHours median = sorted[changes.size() / 2];
+        estimate = *std::lower_bound(sorted.begin(), end, median / 4);
+    }
+
+    std::optional<MicrowattHours> quantum() const
+    {
+        return estimate;
+    }
+
+  private:
+    static constexpr size_t maxChanges = 64;
+
+    RingBuffer<MicrowattHours, maxChanges> changes;
+    std::optional<MicrowattHours> estimate;
+};
@@ -0,0 +1,574 @@
+#include "arrow_writer.hpp"
+#include "chrome_trace.hpp"
+#include "commands.hpp"
+#include "cycles.hpp"
+#include "downsample.hpp"
+#include "history.hpp"
+#include "network_activity.hpp"
+#include "reading.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+namespace
+{
+
+enum class Format
+{
+    Arrow,
+    ChromeTrace,
+};
+
+enum class Table
+{
+    History,
+    Cycles,
+    Sleep,
+};
+
+constexpr std::array<std::pair<RecordKind, std::string_view>, 5>
+    networkCounters = {{
+        {RecordKind::NetworkReceived, "Network received (KiB)"},
+        {RecordKind::NetworkSent, "Network sent (KiB)"},
+        {RecordKind::NetworkReceivedPackets, "Network packets received"},
+        {RecordKind::NetworkSentPackets, "Network packets sent"},
+        {RecordKind::NetworkWakeups, "Network wakeups"},
+    }};
+
+constexpr std::array<std::pair<Radio, std::string_view>, 4> radioCounters = {{
+    {Radio::wifiBlocked, "Wi-Fi blocked"},
+    {Radio::bluetoothBlocked, "Bluetooth blocked"},
+    {Radio::wwanBlocked, "WWAN blocked"},
+    {Radio::wifiPowerSave, "Wi-Fi power save"},
+}};
+
+void appendEnergy(arrow::FileWriter& writer, size_t column,
+                  const std::optional<MicrowattHours>& energy)
+{
+    if (energy)
+    {
+        writer.append(column, *energy);
+    }
+    else
+    {
+        writer.appendNull(column);
+    }
+}
+
+struct Downsampling
+{
+    DownsampleMethod method;
+    size_t points;
+};
+
+void exportHistory(const HistoryReader& reader, std::ostream& out,
+                   const std::optional<Downsampling>& downsampling)
+{
+    arrow::FileWriter writer(out, {{"time", arrow::ColumnType::TimestampMs},
+                                   {"kind", arrow::ColumnType::Utf8},
+                                   {"value", arrow::ColumnType::UInt32}});
+    const auto writeRow = [&](Time time, RecordKind kind, int64_t value) {
+        writer.append(0, toEpochMilliseconds(time));
+        writer.append(1, recordKindName(kind));
+        writer.append(2, value);
+        writer.endRow();
+    };
+
+    const auto span = reader.timeSpan();
+    if (downsampling && span)
+    {
+        // Only energy readings are numerous enough to be worth thinning
+        Downsampler downsampler(downsampling->method, span->first,
+                                span->second, downsampling->points,
+                                [&](const Sample& sample) {
+            writeRow(sample.time, RecordKind::Energy, sample.value);
+        });
+        reader.forEach([&](const history::Record& record) {
+            if (record.kind == RecordKind::Energy)
+            {
+                downsampler.add({record.time, record.value});
+            }
+        });
+        downsampler.finish();
+    }
+    else
+    {
+        reader.forEach([&](const history::Record& record) {
+            writeRow(record.time, record.kind, record.value);
+        });
+    }
+    writer.finish();
+}
+
+void exportCycles(const HistoryReader& reader, std::ostream& out)
+{
+    using arrow::ColumnType;
+    arrow::FileWriter writer(
+        out, {{"state", ColumnType::Utf8},
+              {"start", ColumnType::TimestampMs},
+              {"end", ColumnType::TimestampMs},
+              {"start_energy_uwh", ColumnType::Int64, true},
+              {"end_energy_uwh", ColumnType::Int64, true},
+              {"awake", ColumnType::DurationMs},
+              {"asleep", ColumnType::DurationMs},
+              {"sleep_energy_uwh", ColumnType::Int64},
+              {"suspends", ColumnType::Int64},
+              {"open", ColumnType::Utf8},
+              {"awake_energy_uwh", ColumnType::Int64},
+              {"asleep_energy_uwh", ColumnType::Int64},
+              {"resume_energy_uwh", ColumnType::Int64},
+              {"unaccounted_uwh", ColumnType::Int64},
+              {"closure_error_uwh", ColumnType::Int64},
+              {"equivalent_cycles", ColumnType::Float64},
+              {"depth_half_cycles", ColumnType::Utf8},
+              {"high_charge_time", ColumnType::DurationMs},
+              {"high_temperature_time", ColumnType::DurationMs}});
+    CycleTracker tracker([&](const Cycle& cycle) {
+        writer.append(0, batteryStateName(cycle.state));
+        writer.append(1, toEpochMilliseconds(cycle.start));
+        writer.append(2, toEpochMilliseconds(cycle.end));
+        appendEnergy(writer, 3, cycle.startEnergy);
+        appendEnergy(writer, 4, cycle.endEnergy);
+        writer.append(5, static_cast<int64_t>(cycle.awakeTime().count()));
+        writer.append(6, static_cast<int64_t>(cycle.asleepTime.count()));
+        writer.append(7, cycle.sleepEnergy);
+        writer.append(8, static_cast<int64_t>(cycle.suspendCount));
+        writer.append(9, cycle.open ? "yes" : "no");
+        writer.append(10, cycle.ledger.awake);
+        writer.append(11, cycle.ledger.asleep);
+        writer.append(12, cycle.ledger.resumeTransient);
+        writer.append(13, cycle.ledger.unaccounted);
+        writer.append(14, cycle.ledger.closureError);
+        writer.append(15, cycle.wear.equivalentCycles);
+        std::array<char, 128> halfCycles;
+        writer.append(16, std::string_view(halfCycles.data(),
+                                           cycle.wear.formatHalfCycles(
+                                               halfCycles.data())));
+        writer.append(17, static_cast<int64_t>(
+                              cycle.wear.highChargeTime.count()));
+        writer.append(18, static_cast<int64_t>(
+                              cycle.wear.highTemperatureTime.count()));
+        writer.endRow();
+    });
+    reader.forEach([&](const history::Record& record) { tracker.add(record); });
+    tracker.finish();
+    writer.finish();
+}
+
+void exportSleep(const HistoryReader& reader, std::ostream& out)
+{
+    using arrow::ColumnType;
+    arrow::FileWriter writer(out,
+                             {{"start", ColumnType::TimestampMs},
+                              {"end", ColumnType::TimestampMs},
+                              {"duration", ColumnType::DurationMs},
+                              {"energy_before_uwh", ColumnType::Int64, true},
+                              {"energy_after_uwh", ColumnType::Int64, true}});
+    CycleTracker tracker([](const Cycle&) {}, [&](const SleepPeriod& sleep) {
+        writer.append(0, toEpochMilliseconds(sleep.start));
+        writer.append(1, toEpochMilliseconds(sleep.end));
+        writer.append(2, static_cast<int64_t>(
+                             std::chrono::duration_cast<
+                                 std::chrono::milliseconds>(sleep.end -
+                                                            sleep.start)
+                                 .count()));
+        appendEnergy(writer, 3, sleep.energyBefore);
+        appendEnergy(writer, 4, sleep.energyAfter);
+        writer.endRow();
+    });
+    reader.forEach([&](const history::Record& record) { tracker.add(record); });
+    tracker.finish();
+    writer.finish();
+}
+
+// Monotonic time restarts from zero at boot, so a boot shows up as it going
+// backwards or, after a short boot, as the wall clock getting well ahead of it
+// with no suspend to explain the difference
+bool startsBoot(const history::Record& last, const history::Record& record)
+{
+    if (record.relTime < last.relTime)
+    {
+        return true;
+    }
+    return last.kind != RecordKind::Suspend &&
+           (record.time - last.time) - (record.relTime - last.relTime) >
+               std::chrono::minutes(1);
+}
+
+// Everything on one timeline: energy, power, charge, network and radio
+// counters, and slices for the battery state and each sleep. With monotonic
+// timestamps the trace lines up with perf or ftrace traces from the same boot
+// (but sleeps collapse to nothing, as the monotonic clock stops during
+// suspend), and each boot is a separate process as its times start again.
+void exportTrace(const HistoryReader& reader, std::ostream& out, bool monotonic)
+{
+    enum Track
+    {
+        batteryStateTrack = 1,
+        sleepTrack = 2,
+    };
+
+    ChromeTraceWriter writer(out, "battery-stats");
+    writer.nameTrack(batteryStateTrack, "Battery state");
+    writer.nameTrack(sleepTrack, "Sleep");
+
+    std::optional<MicrowattHours> energyEmpty;
+    std::optional<MicrowattHours> energyFull;
+    // Last reading since the last suspend or resume, if any
+    std::optional<std::pair<Time, MicrowattHours>> lastEnergy;
+    std::optional<BatteryState> state;
+    bool asleep = false;
+    std::optional<history::Record> lastRecord;
+    int boot = 1;
+    int64_t lastTimestamp = 0;
+    // Network counts are only recorded when non-zero, so counters that were
+    // non-zero go back to zero at the next reading without them
+    std::array<bool, networkCounters.size()> networkNonZero{};
+
+    reader.forEach([&](const history::Record& record) {
+        const int64_t timestamp =
+            monotonic ? std::chrono::duration_cast<std::chrono::microseconds>(
+                            record.relTime.time_since_epoch())
+                            .count()
+                      : toEpochMilliseconds(record.time) * 1000;
+
+        if (monotonic && lastRecord && startsBoot(*lastRecord, record))
+        {
+            // Close this boot's slices and carry the battery state over
+            if (state)
+            {
+                writer.end(batteryStateTrack, lastTimestamp);
+            }
+            if (asleep)
+            {
+                writer.end(sleepTrack, lastTimestamp);
+            }
+            writer.startProcess(std::format("battery-stats boot {}", ++boot));
+            writer.nameTrack(batteryStateTrack, "Battery state");
+            writer.nameTrack(sleepTrack, "Sleep");
+            if (state)
+            {
+                writer.begin(batteryStateTrack, batteryStateName(*state),
+                             timestamp);
+            }
+            asleep = false;
+            lastEnergy.reset();
+            networkNonZero = {};
+        }
+        lastRecord = record;
+        lastTimestamp = timestamp;
+
+        switch (record.kind)
+        {
+            case RecordKind::Energy:
+                writer.counter("Energy (Wh)", timestamp,
+                               toWattHours(record.energy()));
+                if (energyEmpty && energyFull && *energyFull > *energyEmpty)
+                {
+                    writer.counter(
+                        "Charge (%)", timestamp,
+                        100.0 *
+                            static_cast<double>(record.energy() -
+                                                *energyEmpty) /
+                            static_cast<double>(*energyFull - *energyEmpty));
+                }
+                if (lastEnergy && record.time > lastEnergy->first)
+                {
+                    const auto [lastTime, lastValue] = *lastEnergy;
+                    const double hours =
+                        std::chrono::duration<double, std::ratio<3600>>(
+                            record.time - lastTime)
+                            .count();
+                    writer.counter("Power (W)", timestamp,
+                                   toWattHours(record.energy() - lastValue) /
+                                       hours);
+                }
+                lastEnergy.emplace(record.time, record.energy());
+                for (size_t i = 0; i < networkCounters.size(); ++i)
+                {
+                    if (networkNonZero[i])
+                    {
+                        writer.counter(networkCounters[i].second, timestamp, 0);
+                        networkNonZero[i] = false;
+                    }
+                }
+                break;
+
+            case RecordKind::BatteryState:
+                if (state)
+                {
+                    writer.end(batteryStateTrack, timestamp);
+                }
+                state = static_cast<BatteryState>(record.value);
+                writer.begin(batteryStateTrack, batteryStateName(*state),
+                             timestamp);
+                break;
+
+            case RecordKind::Suspend:
+                if (asleep)
+                {
+                    writer.end(sleepTrack, timestamp);
+                }
+                writer.begin(sleepTrack, "suspended", timestamp);
+                asleep = true;
+                lastEnergy.reset();
+                break;
+
+            case RecordKind::Resume:
+                if (asleep)
+                {
+                    writer.end(sleepTrack, timestamp);
+                }
+                asleep = false;
+                lastEnergy.reset();
+                break;
+
+            case RecordKind::EnergyEmpty:
+                energyEmpty = record.energy();
+                break;
+
+            case RecordKind::EnergyFull:
+                energyFull = record.energy();
+                break;
+
+            case RecordKind::Temperature:
+                writer.counter("Temperature (C)", timestamp,
+                               toCelsius(record.value));
+                break;
+
+            case RecordKind::Resistance:
+                writer.counter("Internal resistance (mOhm)", timestamp,
+                               static_cast<double>(record.value) / 1000);
+                break;
+
+            case RecordKind::ChargeThreshold:
+                writer.counter("Charge threshold (%)", timestamp,
+                               static_cast<double>(record.value));
+                break;
+
+            case RecordKind::SystemPower:
+                writer.counter("System power on AC (W)", timestamp,
+                               static_cast<double>(record.value) / 1000);
+                break;
+
+            case RecordKind::NetworkReceived:
+            case RecordKind::NetworkSent:
+            case RecordKind::NetworkReceivedPackets:
+            case RecordKind::NetworkSentPackets:
+            case RecordKind::NetworkWakeups:
+            {
+                const auto counter = std::ranges::find(
+                    networkCounters, record.kind,
+                    &std::pair<RecordKind, std::string_view>::first);
+                writer.counter(counter->second, timestamp,
+                               static_cast<double>(record.value));
+                networkNonZero[static_cast<size_t>(
+                    counter - networkCounters.begin())] = true;
+                break;
+            }
+
+            case RecordKind::RadioState:
+                for (const auto& [radio, name] : radioCounters)
+                {
+                    writer.counter(name, timestamp,
+                                   static_cast<uint32_t>(record.value) & radio
+                                       ? 1
+                                       : 0);
+                }
+                break;
+        }
+    });
+
+    if (state)
+    {
+        writer.end(batteryStateTrack, lastTimestamp);
+    }
+    if (asleep)
+    {
+        writer.end(sleepTrack, lastTimestamp);
+    }
+    writer.finish();
+}
+
+void printExportUsage()
+{
+    std::cerr << "Usage: battery-stats export [--format=arrow|chrome]"
+                 " [--table=history|cycles|sleep]\n"
+              << "       [--points=N [--downsample=lttb|envelope]]"
+                 " [--clock=wall|monotonic]\n"
+              << "       [--history=PATH] [--output=FILE]\n"
+              << "  --format=arrow   Arrow IPC file (Feather v2), the default."
+                 "\n"
+              << "  --format=chrome  Chrome JSON trace of every table, for"
+                 " Perfetto.\n"
+              << "  --table=TABLE    Raw history records (default), charge"
+                 " and discharge\n"
+              << "                   cycles, or sleep periods.\n"
+              << "  --points=N       Reduce history to about N energy readings"
+                 " for plotting.\n"
+              << "  --downsample=M   How: lttb (default) keeps the shape,"
+                 " envelope keeps\n"
+              << "                   each interval's minimum and maximum.\n"
+              << "  --clock=CLOCK    Trace timestamps from the wall clock"
+                 " (default) or the\n"
+              << "                   monotonic clock, to match perf and ftrace,"
+                 " with a\n"
+              << "                   process per boot.\n"
+              << "  --history=PATH   History file to read (default "
+              << history::defaultPath().string() << ").\n"
+              << "  --output=FILE    Write to FILE instead of stdout.\n";
+}
+
+} // namespace
+
+int exportCommand(int argc, char** argv)
+{
+    Format format = Format::Arrow;
+    std::optional<Table> table;
+    bool monotonic = false;
+    std::optional<Downsampling> downsampling;
+    DownsampleMethod downsampleMethod = DownsampleMethod::Lttb;
+    std::filesystem::path historyPath = history::defaultPath();
+    std::optional<std::filesystem::path> outputPath;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg(argv[i]);
+        if (arg == "--format=arrow" || arg == "--format=feather")
+        {
+            format = Format::Arrow;
+        }
+        else if (arg == "--format=chrome" || arg == "--format=perfetto")
+        {
+            format = Format::ChromeTrace;
+        }
+        else if (constexpr std::string_view pointsArg = "--points=";
+                 arg.starts_with(pointsArg))
+        {
+            const std::string_view value = arg.substr(pointsArg.size());
+            size_t points = 0;
+            const auto [end, ec] = std::from_chars(
+                value.data(), value.data() + value.size(), points);
+            if (ec != std::errc() || end != value.data() + value.size() ||
+                points < 2)
+            {
+                std::cerr << "Invalid value for --points: " << value << '\n';
+                return 1;
+            }
+            downsampling = {DownsampleMethod::Lttb, points};
+        }
+        else if (arg == "--downsample=lttb")
+        {
+            downsampleMethod = DownsampleMethod::Lttb;
+        }
+        else if (arg == "--downsample=envelope")
+        {
+            downsampleMethod = DownsampleMethod::Envelope;
+        }
+        else if (arg == "--clock=wall" || arg == "--clock=monotonic")
+        {
+            monotonic = arg == "--clock=monotonic";
+        }
+        else if (constexpr std::string_view tableArg = "--table=";
+                 arg.starts_with(tableArg))
+        {
+            const std::string_view value = arg.substr(tableArg.size());
+            if (value == "history")
+            {
+                table = Table::History;
+            }
+            else if (value == "cycles")
+            {
+                table = Table::Cycles;
+            }
+            else if (value == "sleep")
+            {
+                table = Table::Sleep;
+            }
+            else
+            {
+                std::cerr << "Unknown table: " << value << '\n';
+                return 1;
+            }
+        }
+        else if (constexpr std::string_view historyArg = "--history=";
+                 arg.starts_with(historyArg))
+        {
+            historyPath = arg.substr(historyArg.size());
+        }
+        else if (constexpr std::string_view outputArg = "--output=";
+                 arg.starts_with(outputArg))
+        {
+            outputPath = arg.substr(outputArg.size());
+        }
+        else
+        {
+            printExportUsage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    // Rather than silently ignore options that don't apply to the format
+    if (format == Format::ChromeTrace && (table || downsampling))
+    {
+        std::cerr << "--table and --points don't apply to --format=chrome,"
+                     " which has every table in full\n";
+        return 1;
+    }
+    if (format == Format::Arrow && monotonic)
+    {
+        std::cerr << "--clock=monotonic only applies to --format=chrome\n";
+        return 1;
+    }
+
+    if (downsampling)
+    {
+        downsampling->method = downsampleMethod;
+    }
+
+    try
+    {
+        const HistoryReader reader(historyPath);
+
+        std::ofstream file;
+        if (outputPath)
+        {
+            file.open(*outputPath, std::ios::binary | std::ios::trunc);
+        }
+        std::ostream& out = outputPath ? file : std::cout;
+        out.exceptions(std::ios::badbit | std::ios::failbit);
+
+        if (format == Format::ChromeTrace)
+        {
+            exportTrace(reader, out, monotonic);
+            return 0;
+        }
+        switch (table.value_or(Table::History))
+        {
+            case Table::History:
+                exportHistory(reader, out, downsampling);
+                break;
+            case Table::Cycles:
+                exportCycles(reader, out);
+                break;
+            case Table::Sleep:
+                exportSleep(reader, out);
+                break;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Export failed: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,372 @@
+#include "battery_monitor.hpp"
+#include "commands.hpp"
+#include "energy_ledger.hpp"
+#include "history.hpp"
+#include "reading.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// Consecutive discharge history is cut into blocks of about this much wall
+// time, which are resampled whole so each keeps its mix of busy, idle and
+// asleep. A sleep is never split, so overnight blocks are longer.
+constexpr std::chrono::minutes blockLength{30};
+// Fewer blocks than this don't say much about how the machine is used
+constexpr size_t minBlocks = 8;
+// Traces still running after this long are cut off here
+constexpr std::chrono::days maxRuntime{30};
+
+struct Block
+{
+    double seconds = 0;
+    // Positive while discharging
+    double drainMicrowattHours = 0;
+};
+
+// What the history says about the battery: discharge blocks in the sampled
+// range and the latest charge.
+struct Usage
+{
+    std::vector<Block> blocks;
+    std::optional<history::Record> lastReading;
+    std::optional<MicrowattHours> energyEmpty;
+    std::optional<MicrowattHours> energyFull;
+};
+
+// Builds blocks from the records in one pass. Awake intervals between
+// readings further apart than the ledger's maxGap end a block rather than
+// being counted, as there's no knowing what happened in them.
+class BlockBuilder
+{
+  public:
+    BlockBuilder(Usage& usage, Time from) : usage(usage), from(from) {}
+
+    void add(const history::Record& record)
+    {
+        switch (record.kind)
+        {
+            case RecordKind::Energy:
+                if (asleep)
+                {
+                    break;
+                }
+                if (last && discharging && record.time > last->time &&
+                    last->time >= from &&
+                    (sleptSince || record.time - last->time <=
+                                       EnergyLedger::maxGap))
+                {
+                    current.seconds +=
+                        std::chrono::duration<double>(record.time - last->time)
+                            .count();
+                    current.drainMicrowattHours +=
+                        static_cast<double>(last->energy() - record.energy());
+                    if (current.seconds >=
+                        std::chrono::duration<double>(blockLength).count())
+                    {
+                        flush();
+                    }
+                }
+                else
+                {
+                    flush();
+                }
+                last = record;
+                sleptSince = false;
+                usage.lastReading = record;
+                break;
+
+            case RecordKind::BatteryState:
+                flush();
+                last.reset();
+                discharging = static_cast<BatteryState>(record.value) ==
+                              BatteryState::Discharging;
+                break;
+
+            case RecordKind::Suspend:
+                asleep = true;
+                sleptSince = true;
+                break;
+
+            case RecordKind::Resume:
+                asleep = false;
+                break;
+
+            case RecordKind::EnergyEmpty:
+                usage.energyEmpty = record.energy();
+                break;
+
+            case RecordKind::EnergyFull:
+                usage.energyFull = record.energy();
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void finish()
+    {
+        flush();
+    }
+
+  private:
+    void flush()
+    {
+        if (current.seconds > 0)
+        {
+            usage.blocks.push_back(current);
+        }
+        current = Block();
+    }
+
+    Usage& usage;
+    Time from;
+    std::optional<history::Record> last;
+    Block current;
+    bool discharging = false;
+    bool asleep = false;
+    // Whether there was a suspend since the last reading
+    bool sleptSince = false;
+};
+
+// Draws blocks until the energy runs out, writing one runtime in seconds per
+// element of runtimes.
+void simulate(std::span<const Block> blocks, double energy, uint64_t seed,
+              std::span<double> runtimes)
+{
+    std::mt19937_64 random(seed);
+    std::uniform_int_distribution<size_t> pick(0, blocks.size() - 1);
+    const double limit = std::chrono::duration<double>(maxRuntime).count();
+
+    for (double& runtime : runtimes)
+    {
+        double remaining = energy;
+        double seconds = 0;
+        while (remaining > 0 && seconds < limit)
+        {
+            const Block& block = blocks[pick(random)];
+            if (block.drainMicrowattHours >= remaining)
+            {
+                seconds += block.seconds * remaining /
+                           block.drainMicrowattHours;
+                break;
+            }
+            remaining -= block.drainMicrowattHours;
+            seconds += block.seconds;
+        }
+        runtime = std::min(seconds, limit);
+    }
+}
+
+// Splits the traces evenly over the available cores. Each thread has its own
+// generator, seeded from one base seed.
+std::vector<double> simulateParallel(std::span<const Block> blocks,
+                                     double energy, size_t traces)
+{
+    std::vector<double> runtimes(traces);
+    const size_t threadCount = std::clamp<size_t>(
+        std::thread::hardware_concurrency(), 1, std::max<size_t>(traces, 1));
+    const uint64_t seed = std::random_device()();
+
+    std::vector<std::jthread> threads;
+    threads.reserve(threadCount);
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        const size_t begin = traces * i / threadCount;
+        const size_t end = traces * (i + 1) / threadCount;
+        threads.emplace_back(simulate, blocks, energy, seed + i,
+                             std::span(runtimes).subspan(begin, end - begin));
+    }
+    // Joins them
+    threads.clear();
+    return runtimes;
+}
+
+std::string formatRuntime(double seconds)
+{
+    std::string result;
+    if (seconds >= std::chrono::duration<double>(maxRuntime).count())
+    {
+        result = "over ";
+    }
+    // Minutes are as precise as the simulation gets
+    const auto minutes = std::chrono::minutes(std::llround(seconds / 60));
+    if (minutes.count() == 0)
+    {
+        return result + "under a minute";
+    }
+    formatRelTime(std::back_inserter(result), minutes);
+    return result;
+}
+
+void printForecastUsage()
+{
+    std::cerr << "Usage: battery-stats forecast [--days=N] [--traces=N]"
+                 " [--history=PATH]\n"
+              << "  --days=N         Sample the last N days of history"
+                 " (default 30).\n"
+              << "  --traces=N       Number of traces to simulate"
+                 " (default 10000).\n"
+              << "  --history=PATH   History file to read (default "
+              << history::defaultPath().string() << ").\n";
+}
+
+// Parses a positive integer option value, or prints an error
+template <typename T>
+std::optional<T> parseCount(std::string_view name, std::string_view value)
+{
+    T result{};
+    const auto [end, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), result);
+    if (ec != std::errc() || end != value.data() + value.size() ||
+        result == 0)
+    {
+        std::cerr << "Invalid value for " << name << ": " << value << '\n';
+        return std::nullopt;
+    }
+    return result;
+}
+
+} // namespace
+
+int forecastCommand(int argc, char** argv)
+{
+    unsigned days = 30;
+    size_t traces = 10'000;
+    std::filesystem::path historyPath = history::defaultPath();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string_view arg(argv[i]);
+        if (constexpr std::string_view daysArg = "--days=";
+            arg.starts_with(daysArg))
+        {
+            const auto value =
+                parseCount<unsigned>("--days", arg.substr(daysArg.size()));
+            if (!value)
+            {
+                return 1;
+            }
+            days = *value;
+        }
+        else if (constexpr std::string_view tracesArg = "--traces=";
+                 arg.starts_with(tracesArg))
+        {
+            const auto value =
+                parseCount<size_t>("--traces", arg.substr(tracesArg.size()));
+            if (!value)
+            {
+                return 1;
+            }
+            traces = *value;
+        }
+        else if (constexpr std::string_view historyArg = "--history=";
+                 arg.starts_with(historyArg))
+        {
+            historyPath = arg.substr(historyArg.size());
+        }
+        else
+        {
+            printForecastUsage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    try
+    {
+        const HistoryReader reader(historyPath);
+        const Time from = Clock::now() - std::chrono::days(days);
+
+        // The whole history is read for the latest charge and limits, which
+        // may be older than the sampled range
+        Usage usage;
+        BlockBuilder builder(usage, from);
+        reader.forEach([&](const history::Record& record) {
+            builder.add(record);
+        });
+        builder.finish();
+
+        if (!usage.lastReading || !usage.energyEmpty)
+        {
+            std::cerr << "Forecast failed: no battery readings in "
+                      << historyPath.string() << '\n';
+            return 1;
+        }
+        if (usage.blocks.size() < minBlocks)
+        {
+            std::cerr << "Forecast failed: not enough discharge history in the"
+                         " last "
+                      << days << " days\n";
+            return 1;
+        }
+        double totalDrain = 0;
+        for (const Block& block : usage.blocks)
+        {
+            totalDrain += block.drainMicrowattHours;
+        }
+        if (totalDrain <= 0)
+        {
+            std::cerr << "Forecast failed: the battery didn't drain in the"
+                         " last "
+                      << days << " days\n";
+            return 1;
+        }
+
+        const MicrowattHours energy =
+            usage.lastReading->energy() - *usage.energyEmpty;
+        std::vector<double> runtimes =
+            simulateParallel(usage.blocks, static_cast<double>(energy),
+                             traces);
+
+        std::string out = "From ";
+        formatLocalTime(std::back_inserter(out), usage.lastReading->time);
+        out += std::format(": {:.2f} Wh", toWattHours(energy));
+        if (usage.energyFull && *usage.energyFull > *usage.energyEmpty)
+        {
+            out += std::format(
+                " ({:.1f}%)",
+                100.0 * static_cast<double>(energy) /
+                    static_cast<double>(*usage.energyFull -
+                                        *usage.energyEmpty));
+        }
+        out += std::format(
+            ", {} traces resampling {} blocks from the last {} days\n", traces,
+            usage.blocks.size(), days);
+
+        const char* separator = "";
+        for (const int percentile : {10, 50, 90})
+        {
+            const auto nth = runtimes.begin() +
+                             static_cast<ptrdiff_t>(
+                                 (runtimes.size() - 1) * percentile / 100);
+            std::nth_element(runtimes.begin(), nth, runtimes.end());
+            out += std::format("{}p{} runtime {}", separator, percentile,
+                               formatRuntime(*nth));
+            separator = ", ";
+        }
+        std::cout << out << '\n';
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Forecast failed: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
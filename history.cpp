@@ -0,0 +1,437 @@
+#include "history.hpp"
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <system_error>
+
+namespace history
+{
+
+std::filesystem::path defaultPath()
+{
+    std::filesystem::path stateDir;
+    if (const char* xdgState = std::getenv("XDG_STATE_HOME");
+        xdgState != nullptr && xdgState[0] != '\0')
+    {
+        stateDir = xdgState;
+    }
+    else if (const char* home = std::getenv("HOME"); home != nullptr)
+    {
+        stateDir = std::filesystem::path(home) / ".local/state";
+    }
+    else
+    {
+        stateDir = "/var/lib";
+    }
+    return stateDir / "battery-stats" / "history";
+}
+
+} // namespace history
+
+namespace
+{
+int64_t toMilliseconds(auto timePoint)
+{
+    return std::chrono::floor<std::chrono::milliseconds>(
+               timePoint.time_since_epoch())
+        .count();
+}
+} // namespace
+
+HistoryWriter::HistoryWriter(const std::filesystem::path& path,
+                             std::optional<std::chrono::days> retention) :
+    retention(retention)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Opening " + path.string());
+    }
+
+    // Start after the last whole block, discarding any torn tail
+    struct stat st{};
+    if (fstat(fd, &st) < 0)
+    {
+        const int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "Reading size of " + path.string());
+    }
+    blockOffset = st.st_size / history::blockSize * history::blockSize;
+}
+
+HistoryWriter::~HistoryWriter()
+{
+    close(fd);
+}
+
+void HistoryWriter::append(RecordKind kind, Time time, RelTime relTime,
+                           int64_t value)
+{
+    std::optional<PackedReading> record;
+    // A clock stepping back starts a new block, so blocks stay sorted within
+    // runs that readers can search
+    if (haveBlock && header.count < history::recordsPerBlock &&
+        time >= lastTime)
+    {
+        record = PackedReading::pack(base, time, relTime, kind, value);
+    }
+    if (!record)
+    {
+        if (!startBlock(time, relTime))
+        {
+            return;
+        }
+        record = PackedReading::pack(base, time, relTime, kind, value);
+        if (!record)
+        {
+            // Value out of range; nothing sensible to store
+            return;
+        }
+    }
+
+    // Write the record before publishing it via the header count, so a crash
+    // in between just loses the record.
+    const off_t recordOffset = blockOffset + sizeof(history::BlockHeader) +
+                               header.count * sizeof(PackedReading);
+    if (pwrite(fd, &*record, sizeof(*record), recordOffset) !=
+        sizeof(*record))
+    {
+        reportError("Writing history record");
+        return;
+    }
+    ++header.count;
+    lastTime = time;
+    if (pwrite(fd, &header, sizeof(header), blockOffset) != sizeof(header))
+    {
+        reportError("Writing history block header");
+    }
+}
+
+bool HistoryWriter::startBlock(Time time, RelTime relTime)
+{
+    if (haveBlock)
+    {
+        blockOffset += history::blockSize;
+    }
+
+    header = {.magic = history::blockMagic,
+              .version = history::formatVersion,
+              .count = 0,
+              .baseTime = toMilliseconds(time),
+              .baseRelTime = toMilliseconds(relTime),
+              .reserved = 0};
+    base = {.time = Time(std::chrono::milliseconds(header.baseTime)),
+            .relTime = RelTime(std::chrono::milliseconds(header.baseRelTime))};
+
+    // Blocks are always full-size on disk so readers can index them directly
+    if (ftruncate(fd, blockOffset + history::blockSize) < 0 ||
+        pwrite(fd, &header, sizeof(header), blockOffset) != sizeof(header))
+    {
+        reportError("Starting history block");
+        haveBlock = false;
+        return false;
+    }
+    haveBlock = true;
+    lastTime = time;
+    prune(time);
+    return true;
+}
+
+void HistoryWriter::prune(Time now)
+{
+    if (!retention || pruneFailed)
+    {
+        return;
+    }
+
+    // A block ended before the cutoff if the block after it started before
+    // then. Going by the next block's start means reading only headers, and
+    // stopping at the first block that's too new keeps anything written
+    // after a clock step back.
+    const int64_t cutoff = toMilliseconds(now - *retention);
+    while (pruneOffset + static_cast<off_t>(history::blockSize) < blockOffset)
+    {
+        history::BlockHeader current{};
+        history::BlockHeader next{};
+        if (pread(fd, &current, sizeof(current), pruneOffset) !=
+                sizeof(current) ||
+            pread(fd, &next, sizeof(next), pruneOffset + history::blockSize) !=
+                sizeof(next))
+        {
+            return;
+        }
+        // Freed blocks read back as zeroes
+        if (next.magic == history::blockMagic && next.baseTime >= cutoff)
+        {
+            return;
+        }
+        if (current.magic == history::blockMagic &&
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      pruneOffset, history::blockSize) < 0)
+        {
+            // e.g. a filesystem without hole punching: keep everything
+            reportError("Freeing old history");
+            pruneFailed = true;
+            return;
+        }
+        pruneOffset += history::blockSize;
+    }
+}
+
+void HistoryWriter::reportError(const char* what)
+{
+    // Once is enough; a full disk would otherwise report on every reading
+    if (!errorReported)
+    {
+        std::cout << what << ": " << std::strerror(errno) << '\n';
+        errorReported = true;
+    }
+}
+
+HistoryReader::HistoryReader(const std::filesystem::path& path)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Opening " + path.string());
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) < 0)
+    {
+        const int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "Reading size of " + path.string());
+    }
+
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0)
+    {
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED)
+        {
+            const int err = errno;
+            close(fd);
+            throw std::system_error(err, std::generic_category(),
+                                    "Mapping " + path.string());
+        }
+        data = static_cast<const std::byte*>(mapped);
+        madvise(mapped, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Split the blocks into sorted runs, wherever one starts before the
+    // previous one's last record
+    std::optional<Time> last;
+    size_t runStart = 0;
+    for (size_t i = 0; i < blockCount(); ++i)
+    {
+        const history::Block b = block(i);
+        if (b.records.empty())
+        {
+            continue;
+        }
+        if (last && b.base.time < *last)
+        {
+            runs.push_back({.first = runStart, .end = i, .last = *last});
+            runStart = i;
+            last.reset();
+        }
+        last = std::max(last.value_or(Time::min()),
+                        b.records.back().time(b.base));
+    }
+    if (last)
+    {
+        runs.push_back({.first = runStart, .end = blockCount(), .last = *last});
+    }
+}
+
+HistoryReader::~HistoryReader()
+{
+    if (data != nullptr)
+    {
+        munmap(const_cast<std::byte*>(data), size);
+    }
+}
+
+const history::BlockHeader* HistoryReader::header(size_t index) const
+{
+    const auto* h = reinterpret_cast<const history::BlockHeader*>(
+        data + index * history::blockSize);
+    if (h->magic != history::blockMagic ||
+        h->version != history::formatVersion ||
+        h->count > history::recordsPerBlock)
+    {
+        return nullptr;
+    }
+    return h;
+}
+
+history::Block HistoryReader::block(size_t index) const
+{
+    const history::BlockHeader* h = header(index);
+    if (h == nullptr)
+    {
+        return {};
+    }
+
+    const auto* records = reinterpret_cast<const PackedReading*>(
+        data + index * history::blockSize + sizeof(history::BlockHeader));
+    return {.base = {.time = Time(std::chrono::milliseconds(h->baseTime)),
+                     .relTime =
+                         RelTime(std::chrono::milliseconds(h->baseRelTime))},
+            .records = {records, h->count}};
+}
+
+size_t HistoryReader::findBlockIn(const Run& run, Time time) const
+{
+    const int64_t target = toMilliseconds(time);
+
+    // Find the last block starting at or before time; earlier blocks can't
+    // hold anything at or after it. Unreadable blocks sort as if they started
+    // at the epoch.
+    size_t lo = run.first;
+    size_t hi = run.end;
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const history::BlockHeader* h = header(mid);
+        if (h == nullptr || h->baseTime <= target)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo == run.first ? run.first : lo - 1;
+}
+
+bool HistoryReader::startsAfter(size_t index, Time time) const
+{
+    const history::BlockHeader* h = header(index);
+    return h != nullptr && h->count > 0 && h->baseTime > toMilliseconds(time);
+}
+
+size_t HistoryReader::seek(std::vector<Run>::const_iterator run, Time from,
+                           Time to) const
+{
+    for (; run != runs.end(); ++run)
+    {
+        if (run->last < from)
+        {
+            continue;
+        }
+        const size_t index = findBlockIn(*run, from);
+        if (!startsAfter(index, to))
+        {
+            return index;
+        }
+    }
+    return blockCount();
+}
+
+std::vector<history::Record> HistoryReader::stateBefore(Time time) const
+{
+    // Capacity first, so a cycle starts with it known
+    constexpr std::array kinds = {RecordKind::EnergyEmpty,
+                                  RecordKind::EnergyFull,
+                                  RecordKind::ChargeThreshold,
+                                  RecordKind::BatteryState};
+    std::array<std::optional<history::Record>, kinds.size()> latest;
+    for (const Run& run : runs)
+    {
+        // Earlier blocks in a run hold earlier records, so stop going back
+        // once this run has had every kind
+        std::array<bool, kinds.size()> found{};
+        for (size_t i = findBlockIn(run, time) + 1;
+             i-- > run.first && !std::ranges::all_of(found, std::identity());)
+        {
+            const history::Block b = block(i);
+            for (const PackedReading& packed : b.records)
+            {
+                const history::Record record = history::widen(b.base, packed);
+                const auto kind = std::ranges::find(kinds, record.kind);
+                if (record.time >= time || kind == kinds.end())
+                {
+                    continue;
+                }
+                const auto k = static_cast<size_t>(kind - kinds.begin());
+                found[k] = true;
+                if (!latest[k] || record.time >= latest[k]->time)
+                {
+                    latest[k] = record;
+                }
+            }
+        }
+    }
+
+    std::vector<history::Record> state;
+    for (std::optional<history::Record>& record : latest)
+    {
+        if (record)
+        {
+            record->time = time;
+            state.push_back(*record);
+        }
+    }
+    return state;
+}
+
+size_t HistoryReader::firstBlock(Time from, Time to) const
+{
+    return seek(runs.begin(), from, to);
+}
+
+size_t HistoryReader::nextBlock(size_t index, Time from, Time to) const
+{
+    const auto run = std::ranges::find_if(
+        runs, [index](const Run& r) { return index < r.end; });
+    if (run == runs.end())
+    {
+        return blockCount();
+    }
+    // Later blocks in the run start later still
+    if (index + 1 < run->end && !startsAfter(index + 1, to))
+    {
+        return index + 1;
+    }
+    return seek(std::next(run), from, to);
+}
+
+std::optional<std::pair<Time, Time>> HistoryReader::timeSpan() const
+{
+    // Each run starts with its earliest record and ends with its latest
+    std::optional<std::pair<Time, Time>> span;
+    for (const Run& run : runs)
+    {
+        for (size_t i = run.first; i < run.end; ++i)
+        {
+            const history::Block b = block(i);
+            if (!b.records.empty())
+            {
+                const Time first = b.records.front().time(b.base);
+                span = span ? std::pair(std::min(span->first, first),
+                                        std::max(span->second, run.last))
+                            : std::pair(first, run.last);
+                break;
+            }
+        }
+    }
+    return span;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+// The history file is a sequence of fixed-size blocks. Each block has a header
+// giving the Segment its records are relative to, followed by up to
+// recordsPerBlock PackedReadings. Blocks are appended in time order, so a time
+// range can be located by binary search over the block headers without
+// touching the records. The exception is the wall clock stepping back (NTP,
+// an RTC fixup, a manual change), which starts a new block that begins a new
+// sorted run; readers search each run separately.
+//
+// Blocks older than the retention period are freed by punching holes in the
+// file, which keeps block offsets (and concurrent readers' mappings) valid and
+// reads back as zeroes, i.e. blocks with a bad header.
+namespace history
+{
+
+constexpr uint32_t blockMagic = 0x42485342; // "BSHB"
+constexpr uint16_t formatVersion = 1;
+constexpr size_t blockSize = 4096;
+
+struct BlockHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;        // Records used in this block
+    int64_t baseTime;      // system_clock ms since the epoch
+    int64_t baseRelTime;   // steady_clock ms, only comparable within a block
+    uint64_t reserved;
+};
+
+static_assert(sizeof(BlockHeader) == 32);
+
+constexpr size_t recordsPerBlock =
+    (blockSize - sizeof(BlockHeader)) / sizeof(PackedReading);
+
+struct Block
+{
+    Segment base;
+    std::span<const PackedReading> records;
+};
+
+// A history record with its times widened
+struct Record
+{
+    RecordKind kind;
+    Time time;
+    RelTime relTime;
+    int64_t value;
+
+    MicrowattHours energy() const
+    {
+        return value;
+    }
+};
+
+inline Record widen(const Segment& base, const PackedReading& packed)
+{
+    return {.kind = packed.kind(),
+            .time = packed.time(base),
+            .relTime = packed.relTime(base),
+            .value = packed.value};
+}
+
+// Default location: $XDG_STATE_HOME/battery-stats/history
+std::filesystem::path defaultPath();
+
+} // namespace history
+
+// Appends records to a history file. A new block is started each time the
+// writer is opened (the steady clock isn't comparable across boots), when a
+// block fills up, and when a record's times don't fit the current block's
+// Segment or are earlier than its last record. Appending is two pwrite()s and
+// never allocates; starting a block may also free blocks past retention.
+class HistoryWriter
+{
+  public:
+    // Throws std::system_error if the file can't be opened. Blocks whose
+    // records are all older than `retention` are freed, if it's set.
+    explicit HistoryWriter(const std::filesystem::path& path,
+                           std::optional<std::chrono::days> retention =
+                               std::nullopt);
+    HistoryWriter(const HistoryWriter&) = delete;
+    HistoryWriter& operator=(const HistoryWriter&) = delete;
+    ~HistoryWriter();
+
+    void append(RecordKind kind, Time time, RelTime relTime, int64_t value);
+
+    void append(const Reading& reading)
+    {
+        append(RecordKind::Energy, reading.time, reading.relTime,
+               reading.energy);
+    }
+
+  private:
+    bool startBlock(Time time, RelTime relTime);
+    // Frees blocks that ended before `now - retention`
+    void prune(Time now);
+    void reportError(const char* what);
+
+    int fd = -1;
+    off_t blockOffset = 0;
+    history::BlockHeader header{};
+    Segment base{};
+    Time lastTime{};
+    bool haveBlock = false;
+    bool errorReported = false;
+    std::optional<std::chrono::days> retention;
+    // Blocks before this one are known to be freed or kept for good reason
+    off_t pruneOffset = 0;
+    bool pruneFailed = false;
+};
+
+// Read-only view of a history file, mapped into memory.
+class HistoryReader
+{
+  public:
+    // Throws std::system_error if the file can't be opened or mapped
+    explicit HistoryReader(const std::filesystem::path& path);
+    HistoryReader(const HistoryReader&) = delete;
+    HistoryReader& operator=(const HistoryReader&) = delete;
+    ~HistoryReader();
+
+    size_t blockCount() const
+    {
+        return size / history::blockSize;
+    }
+
+    // Blocks with a bad header (e.g. a torn write) come back empty
+    history::Block block(size_t index) const;
+
+    // Index of the first block that may hold records at or after time, or
+    // blockCount() if none can
+    size_t findBlock(Time time) const
+    {
+        return firstBlock(time, Time::max());
+    }
+
+    // Index of the first block that may hold records from `from` to `to`, and
+    // of the one to read after `index`, in file order. blockCount() if there
+    // are no more.
+    size_t firstBlock(Time from, Time to) const;
+    size_t nextBlock(size_t index, Time from, Time to) const;
+
+    // The file's bytes from block `first` on, which make a history file of
+    // their own
+    std::span<const std::byte> blockData(size_t first) const
+    {
+        const size_t end = blockCount() * history::blockSize;
+        const size_t offset = std::min(first * history::blockSize, end);
+        return {data + offset, end - offset};
+    }
+
+    // Times of the first and last records, if there are any
+    std::optional<std::pair<Time, Time>> timeSpan() const;
+
+    // The latest battery state, EnergyEmpty, EnergyFull and charge threshold
+    // records before `time`, retimed to it, for seeding anything that reads
+    // from `time` on with the state then in effect. Searches back from `time`,
+    // so is cheap when they were recorded recently.
+    std::vector<history::Record> stateBefore(Time time) const;
+
+    // Calls f(const history::Record&) for each record from `from` to `to`, in
+    // file order (which is time order unless the clock stepped back)
+    template <typename F>
+    void forEach(Time from, Time to, F&& f) const
+    {
+        for (size_t i = firstBlock(from, to); i < blockCount();
+             i = nextBlock(i, from, to))
+        {
+            const history::Block b = block(i);
+            for (const PackedReading& packed : b.records)
+            {
+                const history::Record record = history::widen(b.base, packed);
+                if (record.time >= from && record.time <= to)
+                {
+                    f(record);
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    void forEach(F&& f) const
+    {
+        forEach(Time::min(), Time::max(), std::forward<F>(f));
+    }
+
+  private:
+    // Blocks [first, end) in time order, ending with a record at `last`
+    struct Run
+    {
+        size_t first;
+        size_t end;
+        Time last;
+    };
+
+    const history::BlockHeader* header(size_t index) const;
+    // Last block of the run starting at or before time
+    size_t findBlockIn(const Run& run, Time time) const;
+    // The first block to read in the first run from `run` on that may hold
+    // records in range
+    size_t seek(std::vector<Run>::const_iterator run, Time from,
+                Time to) const;
+    bool startsAfter(size_t index, Time time) const;
+
+    const std::byte* data = nullptr;
+    size_t size = 0;
+    std::vector<Run> runs;
+};
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Counts durations in power-of-two buckets: bucket i holds durations of at
+// least 2^(i-1) ns and under 2^i ns, and the last bucket everything longer.
+// Storage is inline, so recording never allocates.
+class LatencyHistogram
+{
+  public:
+    // The last bucket starts at about 4.6 minutes
+    static constexpr size_t bucketCount = 40;
+
+    void record(std::chrono::nanoseconds duration)
+    {
+        const auto ns = static_cast<uint64_t>(
+            std::max<std::chrono::nanoseconds::rep>(duration.count(), 0));
+        ++buckets[std::min<size_t>(std::bit_width(ns), bucketCount - 1)];
+        ++total;
+    }
+
+    uint64_t count(size_t bucket) const
+    {
+        return buckets[bucket];
+    }
+
+    uint64_t count() const
+    {
+        return total;
+    }
+
+    // Exclusive upper bound of a bucket, except the last
+    static std::chrono::nanoseconds upperBound(size_t bucket)
+    {
+        return std::chrono::nanoseconds(int64_t{1} << bucket);
+    }
+
+  private:
+    std::array<uint64_t, bucketCount> buckets{};
+    uint64_t total = 0;
+};
@@ -0,0 +1,205 @@
+#include "network_activity.hpp"
+
+#include "sysfs.hpp"
+
+#include <linux/wireless.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+
+namespace
+{
+
+// sysfs attributes for each NetworkActivity counter, in Counter order
+constexpr std::array<std::string_view, 5> counterFiles = {
+    "statistics/rx_bytes", "statistics/tx_bytes", "statistics/rx_packets",
+    "statistics/tx_packets", "device/power/wakeup_count"};
+
+// ARPHRD_LOOPBACK
+constexpr std::string_view loopbackType = "772";
+
+std::optional<Radio> rfkillRadio(std::string_view type)
+{
+    if (type == "wlan")
+    {
+        return Radio::wifiBlocked;
+    }
+    if (type == "bluetooth")
+    {
+        return Radio::bluetoothBlocked;
+    }
+    if (type == "wwan")
+    {
+        return Radio::wwanBlocked;
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+NetworkActivity::NetworkActivity(sd_event* event,
+                                 const std::filesystem::path& sysfsRoot) :
+    sysfsRoot(sysfsRoot),
+    uevents(event, {"net", "rfkill"}, [this] { refresh(); })
+{
+    // Without it there's just no power save state
+    ioctlFd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    refresh();
+}
+
+NetworkActivity::~NetworkActivity()
+{
+    closeAll();
+    sysfs::closeAttribute(ioctlFd);
+}
+
+void NetworkActivity::refresh()
+{
+    std::vector<Interface> found;
+    std::error_code ec;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(sysfsRoot / "class/net", ec))
+    {
+        const auto& dir = entry.path();
+        const std::string name = dir.filename().string();
+        if (name.size() >= IFNAMSIZ ||
+            !std::filesystem::exists(dir / "device", ec) ||
+            sysfs::readFile(dir / "type") == loopbackType)
+        {
+            continue;
+        }
+
+        Interface interface;
+        std::ranges::copy(name, interface.name.begin());
+        interface.wireless = std::filesystem::exists(dir / "wireless", ec) ||
+                             std::filesystem::exists(dir / "phy80211", ec);
+        for (size_t i = 0; i < counterCount; ++i)
+        {
+            interface.fds[i] = sysfs::openAttribute(dir / counterFiles[i]);
+        }
+
+        // Interfaces still present carry on where they were
+        const auto old =
+            std::ranges::find(interfaces, interface.name, &Interface::name);
+        if (old != interfaces.end())
+        {
+            interface.last = old->last;
+        }
+        found.push_back(interface);
+    }
+
+    std::vector<RfkillSwitch> switches;
+    for (const auto& entry :
+         std::filesystem::directory_iterator(sysfsRoot / "class/rfkill", ec))
+    {
+        const auto radio = rfkillRadio(sysfs::readFile(entry.path() / "type"));
+        if (!radio)
+        {
+            continue;
+        }
+        switches.push_back(
+            {.radio = *radio,
+             .softFd = sysfs::openAttribute(entry.path() / "soft"),
+             .hardFd = sysfs::openAttribute(entry.path() / "hard")});
+    }
+
+    closeAll();
+    interfaces = std::move(found);
+    rfkillSwitches = std::move(switches);
+}
+
+void NetworkActivity::closeAll()
+{
+    for (const Interface& interface : interfaces)
+    {
+        for (const int fd : interface.fds)
+        {
+            sysfs::closeAttribute(fd);
+        }
+    }
+    interfaces.clear();
+    for (const RfkillSwitch& rfkill : rfkillSwitches)
+    {
+        sysfs::closeAttribute(rfkill.softFd);
+        sysfs::closeAttribute(rfkill.hardFd);
+    }
+    rfkillSwitches.clear();
+}
+
+std::optional<bool> NetworkActivity::readWifiPowerSave() const
+{
+    if (ioctlFd < 0)
+    {
+        return std::nullopt;
+    }
+    std::optional<bool> powerSave;
+    for (const Interface& interface : interfaces)
+    {
+        if (!interface.wireless)
+        {
+            continue;
+        }
+        // Wireless extensions, which cfg80211 still answers, rather than
+        // nl80211 and the netlink library it would need
+        iwreq request{};
+        std::ranges::copy(interface.name, request.ifr_name);
+        if (ioctl(ioctlFd, SIOCGIWPOWER, &request) < 0)
+        {
+            continue;
+        }
+        powerSave = powerSave.value_or(true) && request.u.power.disabled == 0;
+    }
+    return powerSave;
+}
+
+NetworkActivity::Interval NetworkActivity::sample()
+{
+    Interval interval;
+    for (Interface& interface : interfaces)
+    {
+        std::array<uint64_t, counterCount> deltas{};
+        for (size_t i = 0; i < counterCount; ++i)
+        {
+            const auto value = sysfs::readInteger(interface.fds[i]);
+            if (!value || *value < 0)
+            {
+                interface.last[i].reset();
+                continue;
+            }
+            // Bytes are counted in whole KiB. Taking the difference of the
+            // truncated totals keeps the remainder for the next interval.
+            const auto current =
+                static_cast<uint64_t>(*value) /
+                (i == rxBytes || i == txBytes ? 1024 : 1);
+            // A counter going backwards was reset, e.g. by the driver
+            // reloading, so it starts again from here
+            if (interface.last[i] && current >= *interface.last[i])
+            {
+                deltas[i] = current - *interface.last[i];
+            }
+            interface.last[i] = current;
+        }
+        interval.receivedKiB += deltas[rxBytes];
+        interval.sentKiB += deltas[txBytes];
+        interval.receivedPackets += deltas[rxPackets];
+        interval.sentPackets += deltas[txPackets];
+        interval.wakeups += deltas[wakeupCount];
+    }
+
+    for (const RfkillSwitch& rfkill : rfkillSwitches)
+    {
+        if (sysfs::readInteger(rfkill.softFd).value_or(0) != 0 ||
+            sysfs::readInteger(rfkill.hardFd).value_or(0) != 0)
+        {
+            interval.radios |= std::to_underlying(rfkill.radio);
+        }
+    }
+    if (readWifiPowerSave().value_or(false))
+    {
+        interval.radios |= std::to_underlying(Radio::wifiPowerSave);
+    }
+    return interval;
+}
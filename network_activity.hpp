@@ -0,0 +1,105 @@
+#pragma once
+
+#include "uevent_monitor.hpp"
+
+#include <net/if.h>
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Bits of a RadioState record
+enum class Radio : uint32_t
+{
+    wifiBlocked = 1,
+    bluetoothBlocked = 2,
+    wwanBlocked = 4,
+    // Power save enabled on every Wi-Fi interface that says
+    wifiPowerSave = 8,
+};
+
+constexpr bool operator&(uint32_t flags, Radio radio)
+{
+    return (flags & std::to_underlying(radio)) != 0;
+}
+
+// Network traffic and radio state over each interval between battery
+// readings, so drain can be put next to what the network was doing. Only
+// interfaces backed by a device are counted: loopback, bridges, tunnels and
+// the like would count the same traffic again, and draw nothing themselves.
+//
+// Like RuntimePmAudit, the lists of interfaces and rfkill switches are
+// rebuilt only when one is added or removed, and their attributes kept open,
+// so each sample is a pass of pread() calls (and an ioctl per Wi-Fi
+// interface) that doesn't allocate.
+class NetworkActivity
+{
+  public:
+    // Totals since the previous sample, summed over interfaces
+    struct Interval
+    {
+        // Whole KiB, counted off each interface's byte counter so nothing is
+        // lost to rounding
+        uint64_t receivedKiB = 0;
+        uint64_t sentKiB = 0;
+        uint64_t receivedPackets = 0;
+        uint64_t sentPackets = 0;
+        // Wakeup events signalled by the network devices, e.g. Wake-on-WLAN
+        uint64_t wakeups = 0;
+        // Radio bits as of this sample
+        uint32_t radios = 0;
+    };
+
+    // Throws std::system_error if the uevent socket can't be set up
+    NetworkActivity(sd_event* event,
+                    const std::filesystem::path& sysfsRoot = "/sys");
+    NetworkActivity(const NetworkActivity&) = delete;
+    NetworkActivity& operator=(const NetworkActivity&) = delete;
+    ~NetworkActivity();
+
+    // Ends an interval, starting the next. Interfaces seen for the first time
+    // count from here on.
+    Interval sample();
+
+  private:
+    enum Counter : size_t
+    {
+        rxBytes,
+        txBytes,
+        rxPackets,
+        txPackets,
+        wakeupCount,
+        counterCount
+    };
+
+    struct Interface
+    {
+        std::array<char, IFNAMSIZ> name{};
+        bool wireless = false;
+        std::array<int, counterCount> fds{};
+        std::array<std::optional<uint64_t>, counterCount> last{};
+    };
+
+    struct RfkillSwitch
+    {
+        Radio radio;
+        int softFd = -1;
+        int hardFd = -1;
+    };
+
+    void refresh();
+    void closeAll();
+    // Whether power save is on for every wireless interface that answers,
+    // if any does
+    std::optional<bool> readWifiPowerSave() const;
+
+    std::filesystem::path sysfsRoot;
+    std::vector<Interface> interfaces;
+    std::vector<RfkillSwitch> rfkillSwitches;
+    // For wireless extension ioctls
+    int ioctlFd = -1;
+    UeventMonitor uevents;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+// Static (USDT) tracepoints for profiling with bpftrace/perf, e.g.
+//   bpftrace -e 'usdt:./battery-stats:battery_stats:update_energy
+//                { printf("%d uWh %d mW\n", arg0, arg1); }'
+//
+// When built without <sys/sdt.h> the probes compile to nothing. When built
+// with it, each probe is a single nop until a tracer attaches. Arguments that
+// are expensive to compute should be guarded with PROBE_ENABLED(), which reads
+// the probe's semaphore (incremented by the tracer on attach).
+
+#ifdef BATTERY_STATS_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PROBE_SEMAPHORE(name) battery_stats_##name##_semaphore
+
+#define PROBE_DECLARE_SEMAPHORE(name)                                          \
+    extern "C" unsigned short PROBE_SEMAPHORE(name);
+
+#define PROBE_DEFINE_SEMAPHORE(name)                                           \
+    __extension__ unsigned short PROBE_SEMAPHORE(name)                         \
+        __attribute__((unused)) __attribute__((section(".probes")));
+
+#define PROBE(name, ...)                                                       \
+    STAP_PROBEV(battery_stats, name __VA_OPT__(, ) __VA_ARGS__)
+
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name), 0)
+
+#else
+
+// Arguments are only named in an unevaluated context, so they cost nothing but
+// still count as used.
+template <typename... Args>
+void probeArgs(Args&&...);
+
+#define PROBE_DECLARE_SEMAPHORE(name)
+#define PROBE_DEFINE_SEMAPHORE(name)
+#define PROBE(name, ...) static_cast<void>(sizeof(probeArgs(__VA_ARGS__), 0))
+#define PROBE_ENABLED(name) false
+
+#endif
+
+// Every probe must be listed here so its semaphore gets declared, and defined
+// by battery_properties.cpp.
+#define BATTERY_STATS_PROBES(X)                                                \
+    X(battery_properties)                                                      \
+    X(battery_state)                                                           \
+    X(power_state)                                                             \
+    X(update_energy)                                                           \
+    X(output)
+
+BATTERY_STATS_PROBES(PROBE_DECLARE_SEMAPHORE)
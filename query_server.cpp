@@ -0,0 +1,813 @@
+#include "query_server.hpp"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <span>
+#include <system_error>
+
+namespace
+{
+// Splits off the next space-separated word of str
+std::string_view nextWord(std::string_view& str)
+{
+    const size_t start = str.find_first_not_of(' ');
+    if (start == std::string_view::npos)
+    {
+        str = {};
+        return {};
+    }
+    str.remove_prefix(start);
+    const size_t end = std::min(str.find(' '), str.size());
+    const std::string_view word = str.substr(0, end);
+    str.remove_prefix(end);
+    return word;
+}
+
+template <typename T>
+std::optional<T> parseNumber(std::string_view str)
+{
+    T value{};
+    const auto [end, ec] =
+        std::from_chars(str.data(), str.data() + str.size(), value);
+    if (str.empty() || ec != std::errc() || end != str.data() + str.size())
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+uint64_t toMonotonicUsec(RelTime time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               time.time_since_epoch())
+        .count();
+}
+} // namespace
+
+QueryServer::QueryServer(sd_event* event, BatteryMonitor& batmon,
+                         std::optional<std::filesystem::path> historyPath,
+                         const std::filesystem::path& socketPath,
+                         const RuntimePmAudit* runtimePm) :
+    event(event), batmon(batmon), historyPath(std::move(historyPath)),
+    socketPath(socketPath), runtimePm(runtimePm)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    const std::string pathStr = socketPath.string();
+    if (pathStr.size() >= sizeof(addr.sun_path))
+    {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(),
+                                "Socket path " + pathStr);
+    }
+    std::memcpy(addr.sun_path, pathStr.c_str(), pathStr.size() + 1);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Creating socket");
+    }
+
+    // Replace a stale socket from a previous run
+    unlink(pathStr.c_str());
+    if (bind(listenFd, reinterpret_cast<const sockaddr*>(&addr),
+             sizeof(addr)) < 0 ||
+        chmod(pathStr.c_str(), 0600) < 0 || listen(listenFd, 16) < 0)
+    {
+        const int err = errno;
+        close(listenFd);
+        throw std::system_error(err, std::generic_category(),
+                                "Listening on " + pathStr);
+    }
+
+    int r = sd_event_add_io(event, &listenSource, listenFd, EPOLLIN, onAccept,
+                            this);
+    if (r >= 0)
+    {
+        r = sd_event_add_time(event, &timer, CLOCK_MONOTONIC, UINT64_MAX,
+                              1000, onTimer, this);
+    }
+    if (r < 0)
+    {
+        sd_event_source_unref(listenSource);
+        close(listenFd);
+        unlink(pathStr.c_str());
+        throw std::system_error(-r, std::generic_category(),
+                                "Adding socket to event loop");
+    }
+    sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+
+    batmon.addListener([this] { statsChanged(); });
+}
+
+QueryServer::~QueryServer()
+{
+    while (!clients.empty())
+    {
+        disconnect(clients.front());
+    }
+    sd_event_source_unref(timer);
+    sd_event_source_unref(listenSource);
+    close(listenFd);
+    unlink(socketPath.c_str());
+}
+
+std::optional<std::filesystem::path> QueryServer::defaultSocketPath()
+{
+    const char* runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir == nullptr || runtimeDir[0] == '\0')
+    {
+        return std::nullopt;
+    }
+    return std::filesystem::path(runtimeDir) / "battery-stats.sock";
+}
+
+int QueryServer::onAccept(sd_event_source* /* source */, int fd,
+                          uint32_t /* revents */, void* userdata)
+{
+    auto* server = static_cast<QueryServer*>(userdata);
+
+    while (true)
+    {
+        const int clientFd =
+            accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd < 0)
+        {
+            // EAGAIN once the backlog is drained; anything else is a problem
+            // with that one connection.
+            return 0;
+        }
+        if (server->clients.size() >= maxClients)
+        {
+            close(clientFd);
+            continue;
+        }
+
+        Client& client = server->clients.emplace_back();
+        client.server = server;
+        client.fd = clientFd;
+        client.self = std::prev(server->clients.end());
+        client.input.reserve(maxRequestLength);
+        client.output.reserve(outputCapacity);
+
+        if (sd_event_add_io(server->event, &client.source, clientFd, EPOLLIN,
+                            onClientIo, &client) < 0)
+        {
+            close(clientFd);
+            server->clients.pop_back();
+        }
+    }
+}
+
+int QueryServer::onClientIo(sd_event_source* /* source */, int /* fd */,
+                            uint32_t revents, void* userdata)
+{
+    Client& client = *static_cast<Client*>(userdata);
+    QueryServer& server = *client.server;
+
+    if ((revents & EPOLLIN) != 0 && !server.readRequests(client))
+    {
+        return 0;
+    }
+    if ((revents & (EPOLLERR | EPOLLHUP)) != 0 && (revents & EPOLLIN) == 0)
+    {
+        server.disconnect(client);
+        return 0;
+    }
+
+    if (!server.flush(client))
+    {
+        return 0;
+    }
+
+    // Space may have freed up for a merged update, more query results or
+    // waiting requests
+    server.sendPendingUpdate(client, RelClock::now());
+    server.continueQuery(client);
+    server.handleRequests(client);
+    server.flush(client);
+    return 0;
+}
+
+int QueryServer::onTimer(sd_event_source* /* source */, uint64_t /* usec */,
+                         void* userdata)
+{
+    auto* server = static_cast<QueryServer*>(userdata);
+    const RelTime now = RelClock::now();
+    for (auto it = server->clients.begin(); it != server->clients.end();)
+    {
+        // flush() may disconnect the client
+        Client& client = *it++;
+        server->sendPendingUpdate(client, now);
+        server->flush(client);
+    }
+    server->scheduleUpdates(now);
+    return 0;
+}
+
+void QueryServer::statsChanged()
+{
+    const RelTime now = RelClock::now();
+    for (auto it = clients.begin(); it != clients.end();)
+    {
+        Client& client = *it++;
+        if (client.subscribed)
+        {
+            client.updatePending = true;
+            sendPendingUpdate(client, now);
+            flush(client);
+        }
+    }
+    scheduleUpdates(now);
+}
+
+bool QueryServer::readRequests(Client& client)
+{
+    // Requests that must wait are left in the socket, which holds up the
+    // client rather than growing our buffers
+    std::array<char, 1024> buf;
+    while (handleRequests(client))
+    {
+        const ssize_t len = recv(client.fd, buf.data(), buf.size(), 0);
+        if (len == 0)
+        {
+            // Still answer what was asked, e.g. by `echo stats | socat ...`
+            client.readClosed = true;
+            break;
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            disconnect(client);
+            return false;
+        }
+        if (len < 0)
+        {
+            break;
+        }
+        client.input.append(buf.data(), static_cast<size_t>(len));
+
+        if (client.input.size() > maxRequestLength &&
+            client.input.find('\n') == std::string::npos)
+        {
+            queueLine(client, "error request too long");
+            // flush() disconnects the client itself if sending fails
+            if (flush(client))
+            {
+                disconnect(client);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool QueryServer::handleRequests(Client& client)
+{
+    // handleRequest() only queues output and never flushes or disconnects,
+    // so the client and its input stay valid throughout
+    size_t lineEnd = 0;
+    while ((lineEnd = client.input.find('\n')) != std::string::npos)
+    {
+        // Every reply but a query's fits in half the buffer, and a query's
+        // is generated as the client reads it, so the next request waits for
+        // either to drain rather than having its reply dropped
+        if (client.query ||
+            client.output.size() - client.outputStart > outputCapacity / 2)
+        {
+            return false;
+        }
+        std::string_view request(client.input.data(), lineEnd);
+        if (request.ends_with('\r'))
+        {
+            request.remove_suffix(1);
+        }
+        handleRequest(client, request);
+        client.input.erase(0, lineEnd + 1);
+    }
+    return true;
+}
+
+void QueryServer::handleRequest(Client& client, std::string_view request)
+{
+    const std::string_view command = nextWord(request);
+
+    if (command == "stats")
+    {
+        std::array<char, maxLineLength> line;
+        queueLine(client, formatStats(allStatsFilter, line));
+    }
+    else if (command == "subscribe")
+    {
+        std::string_view word = nextWord(request);
+        std::chrono::milliseconds minInterval{0};
+        if (auto ms = parseNumber<uint32_t>(word))
+        {
+            minInterval = std::chrono::milliseconds(*ms);
+            word = nextWord(request);
+        }
+
+        StatFlags filter;
+        for (; !word.empty(); word = nextWord(request))
+        {
+            if (word == "energy")
+            {
+                filter = filter | Stat::energy;
+            }
+            else if (word == "relenergy")
+            {
+                filter = filter | Stat::relEnergy;
+            }
+            else if (word == "rate")
+            {
+                filter = filter | Stat::rate;
+            }
+            else if (word == "avg")
+            {
+                filter = filter | Stat::averageRate;
+            }
+            else
+            {
+                queueLine(client, "error unknown stat");
+                return;
+            }
+        }
+
+        client.subscribed = true;
+        client.statFilter = filter.value != 0 ? filter : allStatsFilter;
+        client.minInterval = minInterval;
+        client.lastUpdate = {};
+        queueLine(client, "ok");
+    }
+    else if (command == "unsubscribe")
+    {
+        client.subscribed = false;
+        client.updatePending = false;
+        queueLine(client, "ok");
+    }
+    else if (command == "query")
+    {
+        startQuery(client, request);
+    }
+    else if (command == "wear")
+    {
+        const WearMetrics& wear = batmon.wearMetrics();
+        std::array<char, maxLineLength> line;
+        auto out = std::format_to_n(line.data(), line.size(),
+                                    "wear cycles={:.3f} depths=",
+                                    wear.equivalentCycles)
+                       .out;
+        out = wear.formatHalfCycles(out);
+        out = std::format_to_n(out, line.data() + line.size() - out,
+                               " highcharge={} hightemp={}",
+                               wear.highChargeTime.count(),
+                               wear.highTemperatureTime.count())
+                  .out;
+        queueLine(client, {line.data(), out});
+    }
+    else if (command == "latency")
+    {
+        // At most bucketCount short lines, which always fit the buffer
+        const LatencyHistogram& latency = batmon.processingLatency();
+        std::array<char, maxLineLength> line;
+        for (size_t i = 0; i < LatencyHistogram::bucketCount; ++i)
+        {
+            if (latency.count(i) != 0)
+            {
+                const auto result = std::format_to_n(
+                    line.data(), line.size(), "bucket {} {}",
+                    LatencyHistogram::upperBound(i).count(), latency.count(i));
+                queueLine(client, {line.data(), result.out});
+            }
+        }
+        const auto result = std::format_to_n(line.data(), line.size(),
+                                             "end {}", latency.count());
+        queueLine(client, {line.data(), result.out});
+    }
+    else if (command == "runtime-pm")
+    {
+        sendRuntimePm(client);
+    }
+    else if (!command.empty())
+    {
+        queueLine(client, "error unknown command");
+    }
+}
+
+void QueryServer::sendRuntimePm(Client& client)
+{
+    if (runtimePm == nullptr)
+    {
+        queueLine(client, "error runtime PM audit not available");
+        return;
+    }
+
+    std::array<char, maxLineLength> line;
+    const auto interval = runtimePm->lastInterval();
+    const auto screenOff = runtimePm->screenWasOff();
+    const std::string_view policy = runtimePm->aspmPolicy();
+    auto result = std::format_to_n(
+        line.data(), line.size(),
+        "runtime-pm interval={} screen={} aspm-policy={}",
+        interval ? std::to_string(interval->count()) : "-",
+        !screenOff ? "unknown" : (*screenOff ? "off" : "on"),
+        policy.empty() ? "-" : policy);
+    queueLine(client, {line.data(), result.out});
+
+    // Only the devices worth looking at, so the reply stays short
+    size_t count = 0;
+    for (const RuntimePmAudit::Device& device : runtimePm->devices())
+    {
+        const bool stayedActive =
+            device.activeFraction.value_or(0) >= RuntimePmAudit::stayedActive;
+        if (!stayedActive && device.screenOffActiveIntervals == 0)
+        {
+            continue;
+        }
+        const char* aspm = "-";
+        if (device.l0sAspm || device.l1Aspm)
+        {
+            const bool l0s = device.l0sAspm.value_or(false);
+            const bool l1 = device.l1Aspm.value_or(false);
+            aspm = l0s && l1 ? "l0s,l1" : l0s ? "l0s" : l1 ? "l1" : "off";
+        }
+        result = std::format_to_n(
+            line.data(), line.size(),
+            "device {} active={} status={} control={} aspm={} screenoff={} {}",
+            device.name,
+            device.activeFraction
+                ? std::format("{:.1f}", *device.activeFraction * 100)
+                : "-",
+            !device.supported ? "unsupported"
+                              : (device.active ? "active" : "suspended"),
+            device.alwaysOn ? "on" : "auto", aspm,
+            device.screenOffActiveIntervals, device.label);
+        if (!queueLine(client, {line.data(), result.out}))
+        {
+            break;
+        }
+        ++count;
+    }
+    result = std::format_to_n(line.data(), line.size(), "end {}", count);
+    queueLine(client, {line.data(), result.out});
+}
+
+void QueryServer::startQuery(Client& client, std::string_view args)
+{
+    const auto from = parseNumber<int64_t>(nextWord(args));
+    const auto to = parseNumber<int64_t>(nextWord(args));
+    const std::string_view method = nextWord(args);
+    const auto points = parseNumber<uint32_t>(nextWord(args));
+    if (!from || !to ||
+        (!method.empty() &&
+         ((method != "lttb" && method != "envelope") || !points ||
+          *points < 2)))
+    {
+        queueLine(client, "error usage: query FROM TO [lttb|envelope N]");
+        return;
+    }
+    if (client.query)
+    {
+        queueLine(client, "error query already running");
+        return;
+    }
+    if (!historyPath)
+    {
+        queueLine(client, "error history disabled");
+        return;
+    }
+
+    Query& query = client.query.emplace();
+    try
+    {
+        // Mapped per query so it sees everything written so far
+        query.reader.emplace(*historyPath);
+    }
+    catch (const std::system_error&)
+    {
+        client.query.reset();
+        queueLine(client, "error history unavailable");
+        return;
+    }
+    query.from = Time(std::chrono::milliseconds(*from));
+    query.to = Time(std::chrono::milliseconds(*to));
+    query.block = query.reader->firstBlock(query.from, query.to);
+
+    if (!method.empty())
+    {
+        // Spread the buckets over the part of the range that has records
+        Time bucketsFrom = query.from;
+        Time bucketsTo = query.to;
+        if (const auto span = query.reader->timeSpan())
+        {
+            bucketsFrom = std::max(bucketsFrom, span->first);
+            bucketsTo = std::min(bucketsTo, span->second);
+        }
+        query.downsampler.emplace(
+            method == "lttb" ? DownsampleMethod::Lttb
+                             : DownsampleMethod::Envelope,
+            bucketsFrom, bucketsTo, *points,
+            [&query](const Sample& sample) {
+            query.samples.push_back(sample);
+        });
+    }
+    continueQuery(client);
+}
+
+void QueryServer::continueQuery(Client& client)
+{
+    if (!client.query)
+    {
+        return;
+    }
+
+    Query& query = *client.query;
+    std::array<char, maxLineLength> line;
+    const auto queueRecord = [&](Time time, RecordKind kind, int64_t value) {
+        const auto result = std::format_to_n(
+            line.data(), line.size(), "record {} {} {}",
+            toEpochMilliseconds(time), recordKindName(kind), value);
+        return queueLine(client, {line.data(), result.out});
+    };
+    const auto queueSamples = [&] {
+        for (; query.samplesSent < query.samples.size(); ++query.samplesSent)
+        {
+            const Sample& sample = query.samples[query.samplesSent];
+            if (!queueRecord(sample.time, RecordKind::Energy, sample.value))
+            {
+                return false;
+            }
+            ++query.count;
+        }
+        query.samples.clear();
+        query.samplesSent = 0;
+        return true;
+    };
+
+    // Each return below resumes here once the client has read some output
+    if (!queueSamples())
+    {
+        return;
+    }
+
+    while (query.block < query.reader->blockCount())
+    {
+        const history::Block block = query.reader->block(query.block);
+
+        while (query.record < block.records.size())
+        {
+            const PackedReading& record = block.records[query.record];
+            const Time time = record.time(block.base);
+            if (time < query.from || time > query.to)
+            {
+                ++query.record;
+                continue;
+            }
+
+            if (query.downsampler)
+            {
+                // Consumed even if its output doesn't fit yet
+                ++query.record;
+                if (record.kind() == RecordKind::Energy)
+                {
+                    query.downsampler->add({time, record.energy()});
+                    if (!queueSamples())
+                    {
+                        return;
+                    }
+                }
+                continue;
+            }
+
+            if (!queueRecord(time, record.kind(), record.value))
+            {
+                return;
+            }
+            ++query.count;
+            ++query.record;
+        }
+        query.block =
+            query.reader->nextBlock(query.block, query.from, query.to);
+        query.record = 0;
+    }
+
+    if (query.downsampler)
+    {
+        query.downsampler->finish();
+        query.downsampler.reset();
+        if (!queueSamples())
+        {
+            return;
+        }
+    }
+
+    const auto result =
+        std::format_to_n(line.data(), line.size(), "end {}", query.count);
+    if (queueLine(client, {line.data(), result.out}))
+    {
+        client.query.reset();
+    }
+}
+
+std::string_view QueryServer::formatStats(StatFlags filter,
+                                         std::span<char> buf)
+{
+    auto out = std::format_to_n(buf.data(), buf.size(), "stats {}",
+                                toEpochMilliseconds(Clock::now()))
+                   .out;
+    const auto remaining = [&] {
+        return static_cast<size_t>(buf.data() + buf.size() - out);
+    };
+
+    if (const auto state = batmon.batteryState())
+    {
+        out = std::format_to_n(out, remaining(), " state={}",
+                               batteryStateName(*state))
+                  .out;
+    }
+    if (const auto threshold = batmon.chargeEndThreshold())
+    {
+        out = std::format_to_n(out, remaining(), " threshold={}", *threshold)
+                  .out;
+    }
+    if (const auto quantum = batmon.energyQuantum())
+    {
+        out = std::format_to_n(out, remaining(), " quantum={:.6f}",
+                               toWattHours(*quantum))
+                  .out;
+    }
+    if (const auto system = batmon.systemPower())
+    {
+        out = std::format_to_n(out, remaining(), " system={:.2f} source={}",
+                               system->watts, powerSourceName(system->source))
+                  .out;
+    }
+    if (const auto circuit = batmon.circuitEstimate())
+    {
+        out = std::format_to_n(out, remaining(), " resistance={:.4f}",
+                               circuit->ohmicResistance)
+                  .out;
+    }
+    if (filter & Stat::energy)
+    {
+        if (const auto& stat = batmon.energyStat())
+        {
+            out = std::format_to_n(out, remaining(), " energy={:.3f}",
+                                   toWattHours(stat->energy))
+                      .out;
+            if (stat->percent)
+            {
+                out = std::format_to_n(out, remaining(), " percent={:.2f}",
+                                       *stat->percent)
+                          .out;
+            }
+        }
+    }
+    if (filter & Stat::relEnergy)
+    {
+        if (const auto& stat = batmon.relEnergyStat())
+        {
+            out = std::format_to_n(out, remaining(), " relenergy={:.3f}",
+                                   toWattHours(stat->energy))
+                      .out;
+        }
+    }
+    if (filter & Stat::rate)
+    {
+        if (const auto& stat = batmon.rateStat())
+        {
+            out = std::format_to_n(out, remaining(), " rate={:.3f}",
+                                   stat->watts)
+                      .out;
+        }
+    }
+    if (filter & Stat::averageRate)
+    {
+        if (const auto& stat = batmon.averageRateStat())
+        {
+            out = std::format_to_n(out, remaining(), " avg={:.3f}", stat->watts)
+                      .out;
+        }
+    }
+    return {buf.data(), out};
+}
+
+void QueryServer::sendPendingUpdate(Client& client, RelTime now)
+{
+    if (!client.updatePending || now < client.lastUpdate + client.minInterval)
+    {
+        return;
+    }
+
+    // If the buffer is full the update stays pending and is retried, with the
+    // latest values, once the client reads some output.
+    std::array<char, maxLineLength> line;
+    if (queueLine(client, formatStats(client.statFilter, line)))
+    {
+        client.updatePending = false;
+        client.lastUpdate = now;
+    }
+}
+
+void QueryServer::scheduleUpdates(RelTime now)
+{
+    std::optional<RelTime> next;
+    for (const Client& client : clients)
+    {
+        if (client.updatePending)
+        {
+            const RelTime due = client.lastUpdate + client.minInterval;
+            if (due > now && (!next || due < *next))
+            {
+                next = due;
+            }
+        }
+    }
+
+    if (next)
+    {
+        sd_event_source_set_time(timer, toMonotonicUsec(*next));
+        sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
+    }
+    else
+    {
+        sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+    }
+}
+
+bool QueryServer::queueLine(Client& client, std::string_view line)
+{
+    if (client.output.size() + line.size() + 1 > outputCapacity)
+    {
+        // Reclaim space already sent before giving up
+        client.output.erase(0, client.outputStart);
+        client.outputStart = 0;
+        if (client.output.size() + line.size() + 1 > outputCapacity)
+        {
+            return false;
+        }
+    }
+    client.output.append(line);
+    client.output.push_back('\n');
+    return true;
+}
+
+bool QueryServer::flush(Client& client)
+{
+    while (client.outputStart < client.output.size())
+    {
+        const ssize_t len =
+            send(client.fd, client.output.data() + client.outputStart,
+                 client.output.size() - client.outputStart,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (len < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                break;
+            }
+            disconnect(client);
+            return false;
+        }
+        client.outputStart += static_cast<size_t>(len);
+    }
+    if (client.outputStart == client.output.size())
+    {
+        client.output.clear();
+        client.outputStart = 0;
+    }
+
+    const bool requestWaiting = client.input.find('\n') != std::string::npos;
+    if (client.readClosed && !requestWaiting && !client.query &&
+        client.output.empty())
+    {
+        disconnect(client);
+        return false;
+    }
+
+    // Only ask to hear about writability while there's something to write or
+    // requests waiting for room, and about more requests while none wait
+    const bool wantRead = !client.readClosed && !requestWaiting;
+    const bool wantWrite =
+        !client.output.empty() || client.query.has_value() || requestWaiting;
+    const uint32_t events =
+        (wantWrite ? EPOLLOUT : 0u) | (wantRead ? EPOLLIN : 0u);
+    sd_event_source_set_io_events(client.source, events);
+    return true;
+}
+
+void QueryServer::disconnect(Client& client)
+{
+    sd_event_source_unref(client.source);
+    close(client.fd);
+    clients.erase(client.self);
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "battery_monitor.hpp"
+#include "downsample.hpp"
+#include "history.hpp"
+#include "runtime_pm.hpp"
+
+#include <systemd/sd-event.h>
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Serves stats and history to local clients over a Unix stream socket, on the
+// same sd-event loop as the D-Bus handling. The protocol is line based:
+//
+//   stats                    -> one "stats ..." line with the current values
+//   subscribe [MS] [STAT...] -> "ok", then a "stats ..." line after each
+//                               change, at most every MS ms, limited to the
+//                               named stats (energy, relenergy, rate, avg)
+//   unsubscribe              -> "ok"
+//   query FROM TO            -> "record TIME KIND VALUE" for each history
+//                               record from FROM to TO (ms since the epoch),
+//                               then "end COUNT"
+//   query FROM TO lttb|envelope N
+//                            -> the same for about N energy readings picked
+//                               by the given Downsampler method
+//   wear                     -> one "wear ..." line with the equivalent full
+//                               cycles, rainflow half cycles per 10% of depth
+//                               and ms spent at high charge and temperature
+//   latency                  -> "bucket BOUND COUNT" for each non-empty
+//                               bucket of battery update processing times
+//                               (durations under BOUND ns), then "end COUNT"
+//   runtime-pm               -> "runtime-pm interval=MS screen=on|off|unknown
+//                               aspm-policy=POLICY" for the last audited
+//                               interval, "device NAME ..." for each device
+//                               that stayed active through it or through a
+//                               screen-off interval, then "end COUNT"
+//
+// Failures are reported as "error MESSAGE". Socket I/O is non-blocking and each
+// client's output buffer has a fixed size: updates for a slow subscriber are
+// merged until it catches up, and query results are generated only as fast as
+// the client reads them, so no client can hold up battery processing.
+class QueryServer
+{
+  public:
+    // Throws std::system_error if the socket can't be set up
+    QueryServer(sd_event* event, BatteryMonitor& batmon,
+                std::optional<std::filesystem::path> historyPath,
+                const std::filesystem::path& socketPath,
+                const RuntimePmAudit* runtimePm = nullptr);
+    QueryServer(const QueryServer&) = delete;
+    QueryServer& operator=(const QueryServer&) = delete;
+    ~QueryServer();
+
+    // $XDG_RUNTIME_DIR/battery-stats.sock, if there is a runtime dir
+    static std::optional<std::filesystem::path> defaultSocketPath();
+
+  private:
+    struct Query
+    {
+        std::optional<HistoryReader> reader;
+        size_t block = 0;
+        size_t record = 0;
+        Time from;
+        Time to;
+        size_t count = 0;
+
+        std::optional<Downsampler> downsampler;
+        // Output from the downsampler not yet queued
+        std::vector<Sample> samples;
+        size_t samplesSent = 0;
+    };
+
+    struct Client
+    {
+        QueryServer* server = nullptr;
+        int fd = -1;
+        sd_event_source* source = nullptr;
+        std::list<Client>::iterator self;
+
+        std::string input;
+        std::string output;
+        size_t outputStart = 0;
+        // The client shut down its end; it's disconnected once answered
+        bool readClosed = false;
+
+        bool subscribed = false;
+        StatFlags statFilter;
+        std::chrono::milliseconds minInterval{0};
+        RelTime lastUpdate{};
+        bool updatePending = false;
+
+        std::optional<Query> query;
+    };
+
+    static constexpr size_t maxClients = 64;
+    static constexpr size_t maxRequestLength = 1024;
+    static constexpr size_t outputCapacity = 64 * 1024;
+    // Longest single line we generate
+    static constexpr size_t maxLineLength = 256;
+    static constexpr StatFlags allStatsFilter{~0u};
+
+    static int onAccept(sd_event_source* source, int fd, uint32_t revents,
+                        void* userdata);
+    static int onClientIo(sd_event_source* source, int fd, uint32_t revents,
+                          void* userdata);
+    static int onTimer(sd_event_source* source, uint64_t usec, void* userdata);
+
+    void statsChanged();
+    // Returns false if the client was disconnected
+    bool readRequests(Client& client);
+    // Returns false if a request has to wait for output to drain
+    bool handleRequests(Client& client);
+    void handleRequest(Client& client, std::string_view request);
+    void startQuery(Client& client, std::string_view args);
+    void sendRuntimePm(Client& client);
+    void continueQuery(Client& client);
+    std::string_view formatStats(StatFlags filter, std::span<char> buf);
+    // Queues the client's pending update if it's due. The caller flushes.
+    void sendPendingUpdate(Client& client, RelTime now);
+    void scheduleUpdates(RelTime now);
+    bool queueLine(Client& client, std::string_view line);
+    // Returns false if the client was disconnected
+    bool flush(Client& client);
+    void disconnect(Client& client);
+
+    sd_event* event;
+    BatteryMonitor& batmon;
+    std::optional<std::filesystem::path> historyPath;
+    std::filesystem::path socketPath;
+    const RuntimePmAudit* runtimePm;
+    int listenFd = -1;
+    sd_event_source* listenSource = nullptr;
+    sd_event_source* timer = nullptr;
+    std::list<Client> clients;
+};
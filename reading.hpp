@@ -0,0 +1,326 @@
+#pragma once
+
+#include "ring_buffer.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+
+enum class PowerState
+{
+    Awake,
+    Suspended,
+    Hibernating
+};
+
+enum class BatteryState
+{
+    Charging,
+    Discharging,
+    Idle,
+    // Idle because charging stopped at the charge threshold
+    AtThreshold,
+};
+
+// Energy is kept as integer microwatt-hours from the point it is read off the
+// bus until it is printed, so differences of nearly equal values and sums over
+// long cycles are exact.
+using MicrowattHours = int64_t;
+
+inline MicrowattHours toMicrowattHours(double wattHours)
+{
+    return std::llround(wattHours * 1e6);
+}
+
+inline double toWattHours(MicrowattHours energy)
+{
+    return static_cast<double>(energy) / 1e6;
+}
+
+using Clock = std::chrono::system_clock;
+using Time = Clock::time_point;
+// Doesn't advance during suspend, so differences are awake time
+using RelClock = std::chrono::steady_clock;
+using RelTime = RelClock::time_point;
+
+inline int64_t toEpochMilliseconds(Time time)
+{
+    return std::chrono::floor<std::chrono::milliseconds>(
+               time.time_since_epoch())
+        .count();
+}
+
+struct Reading
+{
+    Time time;
+    RelTime relTime;
+    MicrowattHours energy;
+};
+
+// Base times that PackedReading offsets are relative to
+struct Segment
+{
+    Time time;
+    RelTime relTime;
+};
+
+// What a PackedReading records. Everything except Energy marks an event, with
+// the new state (if any) stored in place of the energy.
+enum class RecordKind : uint8_t
+{
+    Energy,
+    BatteryState,
+    Suspend,
+    Resume,
+    EnergyEmpty,
+    EnergyFull,
+    // Battery temperature in tenths of a kelvin, see toDeciKelvin()
+    Temperature,
+    // Fitted internal resistance in micro-ohms, see CircuitModel
+    Resistance,
+    // Charge end threshold in percent of EnergyFull, 0 when there's none
+    ChargeThreshold,
+    // Estimated whole-system power on AC in mW, see SystemPowerMeter
+    SystemPower,
+    // Network traffic since the previous reading, omitted when zero: KiB,
+    // packets, and wakeups signalled by network devices. See NetworkActivity.
+    NetworkReceived,
+    NetworkSent,
+    NetworkReceivedPackets,
+    NetworkSentPackets,
+    NetworkWakeups,
+    // Radio bits (see Radio) whenever they change
+    RadioState,
+};
+
+// Temperatures are recorded in tenths of a kelvin, so they stay positive
+inline int64_t toDeciKelvin(double celsius)
+{
+    return std::llround((celsius + 273.15) * 10);
+}
+
+inline double toCelsius(int64_t deciKelvin)
+{
+    return static_cast<double>(deciKelvin) / 10 - 273.15;
+}
+
+inline const char* recordKindName(RecordKind kind)
+{
+    switch (kind)
+    {
+        case RecordKind::Energy:
+            return "energy";
+        case RecordKind::BatteryState:
+            return "battery-state";
+        case RecordKind::Suspend:
+            return "suspend";
+        case RecordKind::Resume:
+            return "resume";
+        case RecordKind::EnergyEmpty:
+            return "energy-empty";
+        case RecordKind::EnergyFull:
+            return "energy-full";
+        case RecordKind::Temperature:
+            return "temperature";
+        case RecordKind::Resistance:
+            return "resistance";
+        case RecordKind::ChargeThreshold:
+            return "charge-threshold";
+        case RecordKind::SystemPower:
+            return "system-power";
+        case RecordKind::NetworkReceived:
+            return "network-received";
+        case RecordKind::NetworkSent:
+            return "network-sent";
+        case RecordKind::NetworkReceivedPackets:
+            return "network-received-packets";
+        case RecordKind::NetworkSentPackets:
+            return "network-sent-packets";
+        case RecordKind::NetworkWakeups:
+            return "network-wakeups";
+        case RecordKind::RadioState:
+            return "radio-state";
+    }
+    return "unknown";
+}
+
+inline const char* batteryStateName(BatteryState state)
+{
+    switch (state)
+    {
+        case BatteryState::Charging:
+            return "charging";
+        case BatteryState::Discharging:
+            return "discharging";
+        case BatteryState::Idle:
+            return "idle";
+        case BatteryState::AtThreshold:
+            return "at-threshold";
+    }
+    return "unknown";
+}
+
+// 16-byte form of a Reading, used for in-memory windows and the on-disk
+// history. Times are millisecond offsets from a Segment (about 49 days of
+// range) and energy is 32-bit uWh (up to 4294 Wh). Widening back to a Reading
+// is lossless for anything that was packed at millisecond resolution.
+struct PackedReading
+{
+    uint32_t timeOffset;    // ms after Segment::time
+    uint32_t relTimeOffset; // ms after Segment::relTime
+    uint32_t value;         // uWh for Energy records
+    uint32_t flags;         // RecordKind in the low byte, rest reserved
+
+    RecordKind kind() const
+    {
+        return static_cast<RecordKind>(flags & 0xff);
+    }
+
+    MicrowattHours energy() const
+    {
+        return value;
+    }
+
+    Time time(const Segment& base) const
+    {
+        return base.time + std::chrono::milliseconds(timeOffset);
+    }
+
+    RelTime relTime(const Segment& base) const
+    {
+        return base.relTime + std::chrono::milliseconds(relTimeOffset);
+    }
+
+    Reading widen(const Segment& base) const
+    {
+        return {.time = time(base), .relTime = relTime(base),
+                .energy = energy()};
+    }
+
+    // Returns nullopt if the times fall outside the range representable
+    // relative to base, or the value doesn't fit.
+    static std::optional<PackedReading> pack(const Segment& base, Time time,
+                                             RelTime relTime, RecordKind kind,
+                                             int64_t value)
+    {
+        const auto timeOffset =
+            std::chrono::floor<std::chrono::milliseconds>(time - base.time);
+        const auto relTimeOffset =
+            std::chrono::floor<std::chrono::milliseconds>(relTime -
+                                                          base.relTime);
+        if (!fits(timeOffset.count()) || !fits(relTimeOffset.count()) ||
+            !fits(value))
+        {
+            return std::nullopt;
+        }
+        return PackedReading{
+            .timeOffset = static_cast<uint32_t>(timeOffset.count()),
+            .relTimeOffset = static_cast<uint32_t>(relTimeOffset.count()),
+            .value = static_cast<uint32_t>(value),
+            .flags = static_cast<uint32_t>(kind)};
+    }
+
+    static std::optional<PackedReading> pack(const Segment& base,
+                                             const Reading& reading)
+    {
+        return pack(base, reading.time, reading.relTime, RecordKind::Energy,
+                    reading.energy);
+    }
+
+  private:
+    static bool fits(int64_t v)
+    {
+        return v >= 0 && v <= UINT32_MAX;
+    }
+};
+
+static_assert(sizeof(PackedReading) == 16);
+
+// The last N energy readings, stored packed relative to a shared Segment.
+template <size_t N>
+class ReadingWindow
+{
+  public:
+    void push_back(const Reading& reading)
+    {
+        if (items.empty())
+        {
+            base = {reading.time, reading.relTime};
+        }
+
+        auto packed = PackedReading::pack(base, reading);
+        if (!packed)
+        {
+            rebase(reading);
+            packed = PackedReading::pack(base, reading);
+        }
+        if (packed)
+        {
+            items.push_back(*packed);
+        }
+    }
+
+    void clear()
+    {
+        items.clear();
+    }
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    bool empty() const
+    {
+        return items.empty();
+    }
+
+    // Index 0 is the oldest reading
+    Reading operator[](size_t i) const
+    {
+        return items[i].widen(base);
+    }
+
+    Reading front() const
+    {
+        return items.front().widen(base);
+    }
+
+    Reading back() const
+    {
+        return items.back().widen(base);
+    }
+
+  private:
+    // Moves the base up to the oldest reading that can still be stored
+    // alongside next, dropping any that are older than that. If none can (the
+    // clock went backwards, or a gap of ~49 days), only next is kept.
+    void rebase(const Reading& next)
+    {
+        RingBuffer<Reading, N> kept;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            const Reading r = (*this)[i];
+            if (kept.empty() && !PackedReading::pack({r.time, r.relTime}, next))
+            {
+                continue;
+            }
+            kept.push_back(r);
+        }
+
+        items.clear();
+        base = kept.empty() ? Segment{next.time, next.relTime}
+                            : Segment{kept.front().time, kept.front().relTime};
+        for (size_t i = 0; i < kept.size(); ++i)
+        {
+            if (auto packed = PackedReading::pack(base, kept[i]))
+            {
+                items.push_back(*packed);
+            }
+        }
+    }
+
+    Segment base{};
+    RingBuffer<PackedReading, N> items;
+};
@@ -0,0 +1,498 @@
+#include "battery_monitor.hpp"
+#include "commands.hpp"
+#include "cycles.hpp"
+#include "downsample.hpp"
+#include "history.hpp"
+#include "reading.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace
+{
+
+// Points per line chart, which is about one per horizontal pixel
+constexpr size_t chartPoints = 900;
+constexpr double chartWidth = 900;
+constexpr double chartHeight = 220;
+constexpr double marginLeft = 60;
+constexpr double marginBottom = 24;
+
+constexpr std::string_view style = R"(
+body { font: 14px sans-serif; margin: 2em; color: #222; }
+h2 { margin-top: 2em; }
+svg { background: #fafafa; border: 1px solid #ddd; }
+svg text { font-size: 11px; fill: #555; }
+polyline { fill: none; stroke-width: 1.2; }
+table { border-collapse: collapse; }
+td, th { padding: 2px 10px; text-align: right; border-bottom: 1px solid #eee; }
+)";
+
+struct Point
+{
+    Time time;
+    double value;
+};
+
+std::optional<std::chrono::seconds> parseSince(std::string_view str)
+{
+    if (str.empty())
+    {
+        return std::nullopt;
+    }
+    int64_t count = 0;
+    const auto [end, ec] =
+        std::from_chars(str.data(), str.data() + str.size() - 1, count);
+    if (ec != std::errc() || end != str.data() + str.size() - 1 || count <= 0)
+    {
+        return std::nullopt;
+    }
+    switch (str.back())
+    {
+        case 'h':
+            return std::chrono::hours(count);
+        case 'd':
+            return std::chrono::days(count);
+        case 'w':
+            return std::chrono::weeks(count);
+        default:
+            return std::nullopt;
+    }
+}
+
+std::string localTime(Time time)
+{
+    std::string str;
+    formatLocalTime(std::back_inserter(str), time);
+    return str;
+}
+
+std::string relTime(Clock::duration duration)
+{
+    std::string str;
+    formatRelTime(std::back_inserter(str), duration);
+    return str.empty() ? "0s" : str;
+}
+
+double hoursOf(Clock::duration duration)
+{
+    return std::chrono::duration<double, std::ratio<3600>>(duration).count();
+}
+
+// A line chart as inline SVG, with the time axis from `from` to `to`
+void lineChart(std::ostream& out, std::span<const Point> points, Time from,
+               Time to, std::string_view unit, std::string_view color)
+{
+    out << std::format(R"(<svg width="{}" height="{}">)", chartWidth,
+                       chartHeight);
+    if (points.empty())
+    {
+        out << R"(<text x="20" y="30">No data</text></svg>)";
+        return;
+    }
+
+    const auto [minIt, maxIt] = std::ranges::minmax_element(
+        points, {}, [](const Point& p) { return p.value; });
+    double low = minIt->value;
+    double high = maxIt->value;
+    if (high == low)
+    {
+        high += 1;
+        low -= 1;
+    }
+    const double span = std::max(hoursOf(to - from), 1e-9);
+    const double plotWidth = chartWidth - marginLeft - 10;
+    const double plotHeight = chartHeight - marginBottom - 10;
+    const auto x = [&](Time time) {
+        return marginLeft + hoursOf(time - from) / span * plotWidth;
+    };
+    const auto y = [&](double value) {
+        return 10 + (high - value) / (high - low) * plotHeight;
+    };
+
+    // Axis labels: value range, and the dates at each end
+    out << std::format(R"(<text x="4" y="{:.0f}">{:.2f} {}</text>)",
+                       y(high) + 4, high, unit)
+        << std::format(R"(<text x="4" y="{:.0f}">{:.2f} {}</text>)", y(low),
+                       low, unit);
+    if (low < 0 && high > 0)
+    {
+        out << std::format(R"(<line x1="{}" x2="{}" y1="{:.1f}" y2="{:.1f}" )"
+                           R"(stroke="#bbb"/>)",
+                           marginLeft, chartWidth - 10, y(0), y(0));
+    }
+    out << std::format(R"(<text x="{}" y="{}">{}</text>)", marginLeft,
+                       chartHeight - 6, localTime(from))
+        << std::format(R"(<text x="{}" y="{}" text-anchor="end">{}</text>)",
+                       chartWidth - 10, chartHeight - 6, localTime(to));
+
+    out << std::format(R"(<polyline stroke="{}" points=")", color);
+    for (const Point& p : points)
+    {
+        out << std::format("{:.1f},{:.1f} ", x(p.time), y(p.value));
+    }
+    out << "\"/></svg>\n";
+}
+
+// Sleep drain as one bar per suspend, in mW
+void sleepChart(std::ostream& out, std::span<const SleepPeriod> sleeps)
+{
+    std::vector<Point> drains;
+    for (const SleepPeriod& sleep : sleeps)
+    {
+        const double hours = hoursOf(sleep.end - sleep.start);
+        if (sleep.energyBefore && sleep.energyAfter && hours > 0)
+        {
+            drains.push_back(
+                {sleep.start,
+                 toWattHours(*sleep.energyBefore - *sleep.energyAfter) * 1000 /
+                     hours});
+        }
+    }
+
+    out << std::format(R"(<svg width="{}" height="{}">)", chartWidth,
+                       chartHeight);
+    if (drains.empty())
+    {
+        out << R"(<text x="20" y="30">No sleeps with readings either )"
+               R"(side</text></svg>)"
+            << '\n';
+        return;
+    }
+
+    const double high = std::max(
+        std::ranges::max(drains, {}, [](const Point& p) { return p.value; })
+            .value,
+        1.0);
+    const double plotWidth = chartWidth - marginLeft - 10;
+    const double plotHeight = chartHeight - marginBottom - 10;
+    const double barWidth = plotWidth / static_cast<double>(drains.size());
+    out << std::format(R"(<text x="4" y="14">{:.0f} mW</text>)", high)
+        << std::format(R"(<text x="4" y="{}">0 mW</text>)", 10 + plotHeight)
+        << std::format(R"(<text x="{}" y="{}">{} sleeps</text>)", marginLeft,
+                       chartHeight - 6, drains.size());
+    for (size_t i = 0; i < drains.size(); ++i)
+    {
+        const double value = std::max(drains[i].value, 0.0);
+        const double height = value / high * plotHeight;
+        out << std::format(R"(<rect x="{:.1f}" y="{:.1f}" width="{:.1f}" )"
+                           R"(height="{:.1f}" fill="#7a5"><title>{} {:.0f} )"
+                           R"(mW</title></rect>)",
+                           marginLeft + static_cast<double>(i) * barWidth,
+                           10 + plotHeight - height,
+                           std::max(barWidth - 1, 0.5), height,
+                           localTime(drains[i].time), drains[i].value);
+    }
+    out << "</svg>\n";
+}
+
+// Totals of the cycles' wear, with the rainflow depth histogram as bars
+void wearSection(std::ostream& out, std::span<const Cycle> cycles)
+{
+    WearMetrics total;
+    for (const Cycle& cycle : cycles)
+    {
+        for (size_t i = 0; i < WearMetrics::depthBins; ++i)
+        {
+            total.halfCycles[i] += cycle.wear.halfCycles[i];
+        }
+        total.equivalentCycles += cycle.wear.equivalentCycles;
+        total.highChargeTime += cycle.wear.highChargeTime;
+        total.highTemperatureTime += cycle.wear.highTemperatureTime;
+    }
+
+    out << std::format("<p>{:.2f} equivalent full cycles. {} at over {:.0f}% "
+                       "charge, {} at over {:.0f} &deg;C.</p>\n",
+                       total.equivalentCycles, relTime(total.highChargeTime),
+                       WearTracker::highCharge,
+                       relTime(total.highTemperatureTime),
+                       WearTracker::highTemperature);
+
+    const uint32_t high =
+        std::max(std::ranges::max(total.halfCycles), uint32_t{1});
+    const double plotWidth = chartWidth - marginLeft - 10;
+    const double plotHeight = chartHeight - marginBottom - 10;
+    const double barWidth =
+        plotWidth / static_cast<double>(WearMetrics::depthBins);
+    out << std::format(R"(<svg width="{}" height="{}">)", chartWidth,
+                       chartHeight)
+        << std::format(R"(<text x="4" y="14">{:g} cycles</text>)",
+                       high / 2.0)
+        << std::format(R"(<text x="4" y="{}">0</text>)", 10 + plotHeight);
+    for (size_t i = 0; i < WearMetrics::depthBins; ++i)
+    {
+        const double height =
+            static_cast<double>(total.halfCycles[i]) / high * plotHeight;
+        const double x = marginLeft + static_cast<double>(i) * barWidth;
+        out << std::format(R"(<rect x="{:.1f}" y="{:.1f}" width="{:.1f}" )"
+                           R"(height="{:.1f}" fill="#a75"><title>{:g} cycles)"
+                           R"(</title></rect>)",
+                           x, 10 + plotHeight - height, barWidth - 2, height,
+                           total.halfCycles[i] / 2.0)
+            << std::format(R"(<text x="{:.1f}" y="{}">{}-{}%</text>)", x,
+                           chartHeight - 6, i * 10, (i + 1) * 10);
+    }
+    out << "</svg>\n";
+}
+
+void cycleTable(std::ostream& out, std::span<const Cycle> cycles)
+{
+    if (cycles.empty())
+    {
+        out << "<p>No complete charge or discharge cycles.</p>\n";
+        return;
+    }
+    out << "<table><tr><th>Start</th><th>State</th><th>Awake</th>"
+           "<th>Asleep</th><th>Energy (Wh)</th><th>Average (W)</th>"
+           "<th>Sleep (Wh)</th><th>Resume (Wh)</th><th>Unaccounted (Wh)</th>"
+           "<th>Closure error (Wh)</th><th>Suspends</th></tr>\n";
+    for (const Cycle& cycle : cycles)
+    {
+        const double awakeHours = hoursOf(cycle.awakeTime());
+        std::string energy = "-";
+        std::string average = "-";
+        if (cycle.startEnergy && cycle.endEnergy)
+        {
+            const MicrowattHours change = *cycle.endEnergy - *cycle.startEnergy;
+            energy = std::format("{:+.2f}", toWattHours(change));
+            if (awakeHours > 0)
+            {
+                average = std::format(
+                    "{:+.2f}",
+                    toWattHours(change - cycle.ledger.asleep) / awakeHours);
+            }
+        }
+        const EnergyLedger::Totals& ledger = cycle.ledger;
+        out << std::format("<tr><td>{}</td><td>{}{}</td><td>{}</td>"
+                           "<td>{}</td><td>{}</td><td>{}</td><td>{:+.2f}</td>"
+                           "<td>{:+.2f}</td><td>{:+.2f}</td><td>{:+.3f}</td>"
+                           "<td>{}</td></tr>\n",
+                           localTime(cycle.start),
+                           batteryStateName(cycle.state),
+                           cycle.open ? " (current)" : "",
+                           relTime(cycle.awakeTime()),
+                           relTime(cycle.asleepTime), energy, average,
+                           toWattHours(ledger.asleep),
+                           toWattHours(ledger.resumeTransient),
+                           toWattHours(ledger.unaccounted),
+                           toWattHours(ledger.closureError),
+                           cycle.suspendCount);
+    }
+    out << "</table>\n";
+}
+
+void printReportUsage()
+{
+    std::cerr << "Usage: battery-stats report [--since=N(h|d|w)]"
+                 " [--history=PATH] [--output=FILE]\n"
+              << "  --since=30d      How far back to report (default 30d).\n"
+              << "  --history=PATH   History file to read (default "
+              << history::defaultPath().string() << ").\n"
+              << "  --output=FILE    Write to FILE instead of stdout.\n";
+}
+
+} // namespace
+
+int reportCommand(int argc, char** argv)
+{
+    std::chrono::seconds since = std::chrono::days(30);
+    std::filesystem::path historyPath = history::defaultPath();
+    std::optional<std::filesystem::path> outputPath;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg(argv[i]);
+        // Also accept "--since 30d"
+        if (arg == "--since" && i + 1 < argc)
+        {
+            arg = argv[++i];
+        }
+        else if (constexpr std::string_view sinceArg = "--since=";
+                 arg.starts_with(sinceArg))
+        {
+            arg.remove_prefix(sinceArg.size());
+        }
+        else if (constexpr std::string_view historyArg = "--history=";
+                 arg.starts_with(historyArg))
+        {
+            historyPath = arg.substr(historyArg.size());
+            continue;
+        }
+        else if (constexpr std::string_view outputArg = "--output=";
+                 arg.starts_with(outputArg))
+        {
+            outputPath = arg.substr(outputArg.size());
+            continue;
+        }
+        else
+        {
+            printReportUsage();
+            return arg == "--help" ? 0 : 1;
+        }
+
+        const auto value = parseSince(arg);
+        if (!value)
+        {
+            std::cerr << "Invalid value for --since: " << arg << '\n';
+            return 1;
+        }
+        since = *value;
+    }
+
+    try
+    {
+        const HistoryReader reader(historyPath);
+        const Time to = Clock::now();
+        const Time from = to - since;
+
+        // One pass over the range feeds every chart. Line charts are
+        // downsampled as they go; cycles, sleeps and capacity changes are few
+        // enough to keep.
+        std::vector<Point> energy;
+        std::vector<Point> power;
+        std::vector<Point> capacity;
+        std::vector<Point> resistance;
+        std::vector<Point> systemPower;
+        std::vector<Cycle> cycles;
+        std::vector<SleepPeriod> sleeps;
+        size_t readingCount = 0;
+
+        Downsampler energyDownsampler(
+            DownsampleMethod::Lttb, from, to, chartPoints,
+            [&](const Sample& sample) {
+            energy.push_back({sample.time, toWattHours(sample.value)});
+        });
+        // Power is kept in mW so it fits Sample's integer values
+        Downsampler powerDownsampler(
+            DownsampleMethod::Envelope, from, to, chartPoints,
+            [&](const Sample& sample) {
+            power.push_back(
+                {sample.time, static_cast<double>(sample.value) / 1000});
+        });
+        Downsampler systemPowerDownsampler(
+            DownsampleMethod::Envelope, from, to, chartPoints,
+            [&](const Sample& sample) {
+            systemPower.push_back(
+                {sample.time, static_cast<double>(sample.value) / 1000});
+        });
+        CycleTracker tracker(
+            [&](const Cycle& cycle) { cycles.push_back(cycle); },
+            [&](const SleepPeriod& sleep) { sleeps.push_back(sleep); });
+
+        // Previous reading, unless there was a suspend or state change since
+        std::optional<std::pair<Time, MicrowattHours>> last;
+        const auto add = [&](const history::Record& record) {
+            tracker.add(record);
+            switch (record.kind)
+            {
+                case RecordKind::Energy:
+                    ++readingCount;
+                    energyDownsampler.add({record.time, record.value});
+                    if (last && record.time > last->first)
+                    {
+                        const auto [lastTime, lastEnergy] = *last;
+                        powerDownsampler.add(
+                            {record.time,
+                             std::llround(
+                                 toWattHours(record.energy() - lastEnergy) *
+                                 1000 / hoursOf(record.time - lastTime))});
+                    }
+                    last.emplace(record.time, record.energy());
+                    break;
+                case RecordKind::Suspend:
+                case RecordKind::Resume:
+                case RecordKind::BatteryState:
+                    last.reset();
+                    break;
+                case RecordKind::EnergyFull:
+                    capacity.push_back(
+                        {record.time, toWattHours(record.energy())});
+                    break;
+                case RecordKind::SystemPower:
+                    systemPowerDownsampler.add({record.time, record.value});
+                    break;
+                case RecordKind::Resistance:
+                    // Recorded in uOhm, charted in mOhm
+                    resistance.push_back(
+                        {record.time,
+                         static_cast<double>(record.value) / 1000});
+                    break;
+                default:
+                    break;
+            }
+        };
+        // Start from the state and capacity in effect at the range's start
+        for (const history::Record& record : reader.stateBefore(from))
+        {
+            add(record);
+        }
+        reader.forEach(from, to, add);
+        energyDownsampler.finish();
+        powerDownsampler.finish();
+        systemPowerDownsampler.finish();
+        tracker.finish();
+
+        std::ofstream file;
+        if (outputPath)
+        {
+            file.open(*outputPath, std::ios::trunc);
+        }
+        std::ostream& out = outputPath ? file : std::cout;
+        out.exceptions(std::ios::badbit | std::ios::failbit);
+
+        out << "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\">"
+               "<title>Battery report</title><style>"
+            << style << "</style></head><body>\n"
+            << "<h1>Battery report</h1>\n"
+            << std::format("<p>{} to {}: {} readings, {} cycles, {} sleeps."
+                           "</p>\n",
+                           localTime(from), localTime(to), readingCount,
+                           cycles.size(), sleeps.size());
+
+        out << "<h2>Energy</h2>\n";
+        lineChart(out, energy, from, to, "Wh", "#36c");
+        out << "<h2>Power while awake</h2>\n"
+               "<p>Minimum and maximum over each interval; negative is"
+               " drain.</p>\n";
+        lineChart(out, power, from, to, "W", "#c63");
+        out << "<h2>System power on AC</h2>\n"
+               "<p>What the whole system draws while charging or idle on AC,"
+               " estimated from the adapter or power sensors.</p>\n";
+        lineChart(out, systemPower, from, to, "W", "#c36");
+        out << "<h2>Sleep drain</h2>\n";
+        sleepChart(out, sleeps);
+        out << "<h2>Capacity</h2>\n"
+               "<p>Full charge capacity as reported by the battery.</p>\n";
+        lineChart(out, capacity, from, to, "Wh", "#639");
+        out << "<h2>Internal resistance</h2>\n"
+               "<p>Series resistance fitted from voltage and power; rising"
+               " resistance means more voltage sag under load.</p>\n";
+        lineChart(out, resistance, from, to, "mOhm", "#393");
+        out << "<h2>Wear</h2>\n"
+               "<p>Charge cycles by depth, counted by rainflow over the state"
+               " of charge.</p>\n";
+        wearSection(out, cycles);
+        out << "<h2>Cycles</h2>\n";
+        cycleTable(out, cycles);
+        out << "</body></html>\n";
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Report failed: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+// Fixed-capacity FIFO that overwrites its oldest element when full. Storage is
+// inline, so pushing never allocates.
+template <typename T, size_t N>
+class RingBuffer
+{
+  public:
+    void push_back(const T& value)
+    {
+        items[(start + count) % N] = value;
+        if (count < N)
+        {
+            ++count;
+        }
+        else
+        {
+            start = (start + 1) % N;
+        }
+    }
+
+    void clear()
+    {
+        start = 0;
+        count = 0;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    // Index 0 is the oldest element
+    const T& operator[](size_t i) const
+    {
+        return items[(start + i) % N];
+    }
+
+    const T& front() const
+    {
+        return (*this)[0];
+    }
+
+    const T& back() const
+    {
+        return (*this)[count - 1];
+    }
+
+  private:
+    std::array<T, N> items{};
+    size_t start = 0;
+    size_t count = 0;
+};
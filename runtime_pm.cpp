@@ -0,0 +1,289 @@
+#include "runtime_pm.hpp"
+
+#include "sysfs.hpp"
+
+#include <time.h>
+
+#include <algorithm>
+#include <format>
+
+namespace
+{
+
+// Intervals longer than this aren't audited. Readings stopped for a reason,
+// such as a suspend that wasn't noticed, so the interval isn't idle time.
+constexpr std::chrono::minutes maxInterval{15};
+// Boot time getting this much further than monotonic time means a suspend
+constexpr std::chrono::seconds maxClockDrift{1};
+
+std::chrono::nanoseconds bootTime()
+{
+    timespec ts{};
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return std::chrono::seconds(ts.tv_sec) +
+           std::chrono::nanoseconds(ts.tv_nsec);
+}
+
+// PCI IDs are read as e.g. "0x8086"
+std::string pciId(const std::filesystem::path& path)
+{
+    std::string id = sysfs::readFile(path);
+    if (id.starts_with("0x"))
+    {
+        id.erase(0, 2);
+    }
+    return id;
+}
+
+} // namespace
+
+RuntimePmAudit::RuntimePmAudit(sd_event* event,
+                               const std::filesystem::path& sysfsRoot) :
+    sysfsRoot(sysfsRoot),
+    uevents(event, {"pci", "usb"}, [this] { refresh(); })
+{
+    aspmPolicyFd = sysfs::openAttribute(sysfsRoot /
+                                        "module/pcie_aspm/parameters/policy");
+    refresh();
+}
+
+RuntimePmAudit::~RuntimePmAudit()
+{
+    closeAll();
+    sysfs::closeAttribute(aspmPolicyFd);
+}
+
+void RuntimePmAudit::refresh()
+{
+    std::vector<Device> devices;
+    std::error_code ec;
+    for (const std::string_view bus : {"pci", "usb"})
+    {
+        for (const auto& entry : std::filesystem::directory_iterator(
+                 sysfsRoot / "bus" / bus / "devices", ec))
+        {
+            const auto& dir = entry.path();
+            const int activeTimeFd =
+                sysfs::openAttribute(dir / "power/runtime_active_time");
+            if (activeTimeFd < 0)
+            {
+                continue;
+            }
+
+            Device device;
+            device.name = std::format("{}:{}", bus, dir.filename().string());
+            device.statusFd =
+                sysfs::openAttribute(dir / "power/runtime_status");
+            device.activeTimeFd = activeTimeFd;
+            device.controlFd = sysfs::openAttribute(dir / "power/control");
+            if (bus == "pci")
+            {
+                device.label = std::format("{}:{}", pciId(dir / "vendor"),
+                                           pciId(dir / "device"));
+                device.l0sFd = sysfs::openAttribute(dir / "link/l0s_aspm");
+                device.l1Fd = sysfs::openAttribute(dir / "link/l1_aspm");
+            }
+            else
+            {
+                device.label = sysfs::readFile(dir / "product");
+            }
+
+            // Devices still present carry on where they were
+            const auto old = std::ranges::find(deviceList, device.name,
+                                               &Device::name);
+            if (old != deviceList.end())
+            {
+                device.activeFraction = old->activeFraction;
+                device.screenOffActiveIntervals =
+                    old->screenOffActiveIntervals;
+                device.lastActiveTime = old->lastActiveTime;
+            }
+            devices.push_back(std::move(device));
+        }
+    }
+
+    closeAll();
+    deviceList = std::move(devices);
+
+    for (const auto& entry : std::filesystem::directory_iterator(
+             sysfsRoot / "class/drm", ec))
+    {
+        // Connectors are named e.g. card0-eDP-1
+        const auto& dir = entry.path();
+        if (dir.filename().string().find('-') == std::string::npos)
+        {
+            continue;
+        }
+        const int statusFd = sysfs::openAttribute(dir / "status");
+        const int dpmsFd = sysfs::openAttribute(dir / "dpms");
+        if (statusFd >= 0 && dpmsFd >= 0)
+        {
+            connectors.emplace_back(statusFd, dpmsFd);
+        }
+        else
+        {
+            sysfs::closeAttribute(statusFd);
+            sysfs::closeAttribute(dpmsFd);
+        }
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(
+             sysfsRoot / "class/backlight", ec))
+    {
+        const int fd =
+            sysfs::openAttribute(entry.path() / "actual_brightness");
+        if (fd >= 0)
+        {
+            backlights.push_back(fd);
+        }
+    }
+}
+
+void RuntimePmAudit::closeAll()
+{
+    for (const Device& device : deviceList)
+    {
+        for (const int fd : {device.statusFd, device.activeTimeFd,
+                             device.controlFd, device.l0sFd, device.l1Fd})
+        {
+            sysfs::closeAttribute(fd);
+        }
+    }
+    deviceList.clear();
+    for (const auto& [statusFd, dpmsFd] : connectors)
+    {
+        sysfs::closeAttribute(statusFd);
+        sysfs::closeAttribute(dpmsFd);
+    }
+    connectors.clear();
+    for (const int fd : backlights)
+    {
+        sysfs::closeAttribute(fd);
+    }
+    backlights.clear();
+}
+
+// Off if every connected display is off, or every backlight is at zero.
+// Unknown if there's neither to go by.
+std::optional<bool> RuntimePmAudit::readScreenOff() const
+{
+    std::array<char, 32> buf;
+    bool anyConnected = false;
+    bool displaysOff = true;
+    for (const auto& [statusFd, dpmsFd] : connectors)
+    {
+        if (sysfs::readText(statusFd, buf) != "connected")
+        {
+            continue;
+        }
+        anyConnected = true;
+        if (sysfs::readText(dpmsFd, buf) == "On")
+        {
+            displaysOff = false;
+        }
+    }
+
+    bool backlightsOff = !backlights.empty();
+    for (const int fd : backlights)
+    {
+        if (sysfs::readInteger(fd).value_or(1) != 0)
+        {
+            backlightsOff = false;
+        }
+    }
+
+    if ((anyConnected && displaysOff) || backlightsOff)
+    {
+        return true;
+    }
+    if (anyConnected || !backlights.empty())
+    {
+        return false;
+    }
+    return std::nullopt;
+}
+
+// The file lists every policy with the one in use in brackets, e.g.
+// "default performance [powersave] powersupersave"
+void RuntimePmAudit::readAspmPolicy()
+{
+    std::string_view policy = sysfs::readText(aspmPolicyFd, aspmPolicyBuf);
+    const size_t start = policy.find('[');
+    const size_t end = policy.find(']', start);
+    if (start != std::string_view::npos && end != std::string_view::npos)
+    {
+        policy = policy.substr(start + 1, end - start - 1);
+    }
+    // Moving the text towards the start, so the copy can overlap
+    std::ranges::copy(policy, aspmPolicyBuf.begin());
+    aspmPolicyLength = policy.size();
+}
+
+void RuntimePmAudit::sample()
+{
+    const RelTime now = RelClock::now();
+    const std::chrono::nanoseconds boot = bootTime();
+    const std::optional<bool> screenOffNow = readScreenOff();
+    readAspmPolicy();
+
+    std::optional<std::chrono::milliseconds> elapsed;
+    if (lastSample && lastBootTime)
+    {
+        const auto awake = now - *lastSample;
+        const auto total = boot - *lastBootTime;
+        if (total - awake < maxClockDrift && awake <= maxInterval &&
+            awake > RelClock::duration::zero())
+        {
+            elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                awake);
+        }
+    }
+    if (elapsed)
+    {
+        interval = elapsed;
+        screenOff = screenOffAtLastSample && screenOffNow
+                        ? std::optional(*screenOffAtLastSample &&
+                                        *screenOffNow)
+                        : std::nullopt;
+    }
+
+    std::array<char, 32> buf;
+    for (Device& device : deviceList)
+    {
+        const std::string_view status = sysfs::readText(device.statusFd, buf);
+        device.active = status == "active";
+        device.supported = status != "unsupported";
+        device.alwaysOn = sysfs::readText(device.controlFd, buf) == "on";
+        if (const auto l0s = sysfs::readInteger(device.l0sFd))
+        {
+            device.l0sAspm = *l0s != 0;
+        }
+        if (const auto l1 = sysfs::readInteger(device.l1Fd))
+        {
+            device.l1Aspm = *l1 != 0;
+        }
+
+        // In ms, like the interval
+        const auto activeTime = sysfs::readInteger(device.activeTimeFd);
+        if (elapsed && elapsed->count() > 0)
+        {
+            device.activeFraction.reset();
+            if (activeTime && device.lastActiveTime && device.supported)
+            {
+                device.activeFraction = std::clamp(
+                    static_cast<double>(*activeTime - *device.lastActiveTime) /
+                        static_cast<double>(elapsed->count()),
+                    0.0, 1.0);
+                if (screenOff == true &&
+                    *device.activeFraction >= stayedActive)
+                {
+                    ++device.screenOffActiveIntervals;
+                }
+            }
+        }
+        device.lastActiveTime = activeTime;
+    }
+
+    lastSample = now;
+    lastBootTime = boot;
+    screenOffAtLastSample = screenOffNow;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "reading.hpp"
+#include "uevent_monitor.hpp"
+
+#include <systemd/sd-event.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Audits PCI and USB runtime power management over each interval between
+// battery readings: which devices never runtime-suspended, and whether the
+// screen was off throughout. High idle drain is usually one of these.
+//
+// The device list is built once and rebuilt only when the kernel reports a
+// PCI or USB device being added or removed, and the attributes
+// sampled are kept open, so each sample is one pass of pread() calls over
+// open files that doesn't allocate.
+class RuntimePmAudit
+{
+  public:
+    // A device that spent at least this much of an interval active never
+    // suspended in it
+    static constexpr double stayedActive = 0.95;
+
+    struct Device
+    {
+        // e.g. "pci:0000:00:14.0" or "usb:1-3"
+        std::string name;
+        // USB product name, or PCI vendor and device IDs
+        std::string label;
+        // Whether PCIe ASPM L0s and L1 are enabled on the link, if the
+        // kernel says
+        std::optional<bool> l0sAspm;
+        std::optional<bool> l1Aspm;
+
+        // From the last sample
+        bool active = false;
+        // Whether the device does runtime PM at all
+        bool supported = true;
+        // "on" keeps the device active whatever it's doing
+        bool alwaysOn = false;
+        std::optional<double> activeFraction;
+        // Screen-off intervals the device stayed active through
+        uint32_t screenOffActiveIntervals = 0;
+
+        int statusFd = -1;
+        int activeTimeFd = -1;
+        int controlFd = -1;
+        int l0sFd = -1;
+        int l1Fd = -1;
+        std::optional<int64_t> lastActiveTime;
+    };
+
+    // Throws std::system_error if the uevent socket can't be set up
+    RuntimePmAudit(sd_event* event,
+                   const std::filesystem::path& sysfsRoot = "/sys");
+    RuntimePmAudit(const RuntimePmAudit&) = delete;
+    RuntimePmAudit& operator=(const RuntimePmAudit&) = delete;
+    ~RuntimePmAudit();
+
+    // Ends an interval, starting the next. Intervals that span a suspend
+    // aren't audited.
+    void sample();
+
+    std::span<const Device> devices() const
+    {
+        return deviceList;
+    }
+
+    // Length of the last audited interval, if there was one
+    std::optional<std::chrono::milliseconds> lastInterval() const
+    {
+        return interval;
+    }
+
+    // Whether the screen was off for the whole of the last interval, if
+    // that's known
+    std::optional<bool> screenWasOff() const
+    {
+        return screenOff;
+    }
+
+    // The kernel's ASPM policy at the last sample, e.g. "powersave"
+    std::string_view aspmPolicy() const
+    {
+        return {aspmPolicyBuf.data(), aspmPolicyLength};
+    }
+
+  private:
+    void refresh();
+    void closeAll();
+    std::optional<bool> readScreenOff() const;
+    void readAspmPolicy();
+
+    std::filesystem::path sysfsRoot;
+    UeventMonitor uevents;
+
+    std::vector<Device> deviceList;
+    // DRM connector status and dpms files, and backlight brightness files
+    std::vector<std::pair<int, int>> connectors;
+    std::vector<int> backlights;
+    int aspmPolicyFd = -1;
+    std::array<char, 64> aspmPolicyBuf{};
+    size_t aspmPolicyLength = 0;
+
+    // Monotonic time stops during suspend and boot time doesn't, so a
+    // difference between their intervals means the system slept
+    std::optional<RelTime> lastSample;
+    std::optional<std::chrono::nanoseconds> lastBootTime;
+    std::optional<bool> screenOffAtLastSample;
+    std::optional<std::chrono::milliseconds> interval;
+    std::optional<bool> screenOff;
+};
@@ -0,0 +1,653 @@
+// SQLite extension exposing the history file as virtual tables, e.g.
+//   sqlite3 -cmd '.load ./batterystats'
+//   SELECT * FROM battery_readings WHERE time BETWEEN 1700000000000 AND ...;
+//
+// Tables read the default history file unless created with a path:
+//   CREATE VIRTUAL TABLE old USING battery_readings('/path/to/history');
+//
+// The file is mapped afresh for each scan, so records appended by the daemon
+// since the last query are always visible.
+
+#include "cycles.hpp"
+#include "history.hpp"
+#include "reading.hpp"
+
+#include <sqlite3ext.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+SQLITE_EXTENSION_INIT1
+
+namespace
+{
+
+struct Table : sqlite3_vtab
+{
+    std::filesystem::path path;
+};
+
+// The earliest (lower) or latest (upper) whole millisecond satisfying a bound
+// on time, or nullopt if none can. Comparisons with NULL match nothing and, as
+// in SQLite, text that isn't a number sorts after every number. The result is
+// clamped to what Time can hold.
+std::optional<Time> boundTime(sqlite3_value* value, bool lower, bool exclusive)
+{
+    using std::chrono::milliseconds;
+    constexpr int64_t minMs =
+        std::chrono::ceil<milliseconds>(Time::min().time_since_epoch())
+            .count();
+    constexpr int64_t maxMs =
+        std::chrono::floor<milliseconds>(Time::max().time_since_epoch())
+            .count();
+
+    int64_t ms = 0;
+    switch (sqlite3_value_numeric_type(value))
+    {
+        case SQLITE_NULL:
+            return std::nullopt;
+        case SQLITE_INTEGER:
+            ms = std::clamp<int64_t>(sqlite3_value_int64(value), minMs, maxMs);
+            if (exclusive)
+            {
+                ms = std::clamp<int64_t>(lower ? ms + 1 : ms - 1, minMs,
+                                         maxMs);
+            }
+            break;
+        case SQLITE_FLOAT:
+        {
+            const double x = sqlite3_value_double(value);
+            double rounded = 0;
+            if (lower)
+            {
+                rounded = exclusive ? std::floor(x) + 1 : std::ceil(x);
+            }
+            else
+            {
+                rounded = exclusive ? std::ceil(x) - 1 : std::floor(x);
+            }
+            // Compared as doubles, which can't hold the limits exactly
+            if (rounded >= static_cast<double>(maxMs))
+            {
+                ms = maxMs;
+            }
+            else if (rounded <= static_cast<double>(minMs))
+            {
+                ms = minMs;
+            }
+            else
+            {
+                ms = static_cast<int64_t>(rounded);
+            }
+            break;
+        }
+        default:
+            if (lower)
+            {
+                return std::nullopt;
+            }
+            ms = maxMs;
+            break;
+    }
+    return Time(milliseconds(ms));
+}
+
+void resultEnergy(sqlite3_context* ctx,
+                  const std::optional<MicrowattHours>& energy)
+{
+    if (energy)
+    {
+        sqlite3_result_int64(ctx, *energy);
+    }
+    else
+    {
+        sqlite3_result_null(ctx);
+    }
+}
+
+// Every history record. Constraints on time are used to seek to the first
+// block that can match and to stop at the first block past the range.
+class ReadingsCursor
+{
+  public:
+    static constexpr const char* schema =
+        "CREATE TABLE x(time INTEGER, kind TEXT, value INTEGER)";
+
+    enum Column
+    {
+        time,
+        kind,
+        value,
+    };
+
+    // idxNum bits, with argv holding the lower bound (if any) then the upper
+    enum Bounds
+    {
+        lower = 1,
+        lowerExclusive = 2,
+        upper = 4,
+        upperExclusive = 8,
+        equal = 16,
+    };
+
+    static int bestIndex(sqlite3_index_info* info)
+    {
+        int lowerConstraint = -1;
+        int upperConstraint = -1;
+        int bounds = 0;
+        for (int i = 0; i < info->nConstraint; ++i)
+        {
+            const auto& constraint = info->aConstraint[i];
+            if (!constraint.usable || constraint.iColumn != Column::time)
+            {
+                continue;
+            }
+            switch (constraint.op)
+            {
+                case SQLITE_INDEX_CONSTRAINT_EQ:
+                    lowerConstraint = i;
+                    upperConstraint = -1;
+                    bounds = equal;
+                    break;
+                case SQLITE_INDEX_CONSTRAINT_GT:
+                case SQLITE_INDEX_CONSTRAINT_GE:
+                    if (bounds & equal)
+                    {
+                        break;
+                    }
+                    lowerConstraint = i;
+                    bounds = (bounds & ~lowerExclusive) | lower |
+                             (constraint.op == SQLITE_INDEX_CONSTRAINT_GT
+                                  ? lowerExclusive
+                                  : 0);
+                    break;
+                case SQLITE_INDEX_CONSTRAINT_LT:
+                case SQLITE_INDEX_CONSTRAINT_LE:
+                    if (bounds & equal)
+                    {
+                        break;
+                    }
+                    upperConstraint = i;
+                    bounds = (bounds & ~upperExclusive) | upper |
+                             (constraint.op == SQLITE_INDEX_CONSTRAINT_LT
+                                  ? upperExclusive
+                                  : 0);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // Times are whole milliseconds and filter() rounds each bound inwards
+        // to one, so the bounds are applied exactly and SQLite needn't check
+        // them again.
+        int argvIndex = 0;
+        for (int i : {lowerConstraint, upperConstraint})
+        {
+            if (i >= 0)
+            {
+                info->aConstraintUsage[i].argvIndex = ++argvIndex;
+                info->aConstraintUsage[i].omit = 1;
+            }
+        }
+        info->idxNum = bounds;
+
+        // A bounded scan touches a handful of blocks after a binary search
+        if (bounds & equal)
+        {
+            info->estimatedCost = 10;
+            info->estimatedRows = 1;
+        }
+        else if ((bounds & lower) && (bounds & upper))
+        {
+            info->estimatedCost = 1000;
+            info->estimatedRows = 1000;
+        }
+        else if (bounds != 0)
+        {
+            info->estimatedCost = 100000;
+            info->estimatedRows = 100000;
+        }
+        else
+        {
+            info->estimatedCost = 1000000;
+            info->estimatedRows = 1000000;
+        }
+        return SQLITE_OK;
+    }
+
+    explicit ReadingsCursor(const Table& table) : table(table) {}
+
+    void filter(int bounds, sqlite3_value** argv)
+    {
+        std::optional<Time> lowerTime = Time::min();
+        std::optional<Time> upperTime = Time::max();
+        if (bounds & equal)
+        {
+            lowerTime = boundTime(argv[0], true, false);
+            upperTime = boundTime(argv[0], false, false);
+        }
+        else
+        {
+            if (bounds & lower)
+            {
+                lowerTime =
+                    boundTime(*argv++, true, (bounds & lowerExclusive) != 0);
+            }
+            if (bounds & upper)
+            {
+                upperTime =
+                    boundTime(*argv, false, (bounds & upperExclusive) != 0);
+            }
+        }
+
+        reader.reset();
+        current.reset();
+        if (!lowerTime || !upperTime || *lowerTime > *upperTime)
+        {
+            return;
+        }
+        from = *lowerTime;
+        to = *upperTime;
+
+        reader.emplace(table.path);
+        blockIndex = reader->firstBlock(from, to);
+        recordIndex = 0;
+        block = {};
+        if (blockIndex < reader->blockCount())
+        {
+            block = reader->block(blockIndex);
+        }
+        advance();
+    }
+
+    void next()
+    {
+        advance();
+    }
+
+    bool eof() const
+    {
+        return !current;
+    }
+
+    void column(sqlite3_context* ctx, int column) const
+    {
+        switch (column)
+        {
+            case Column::time:
+                sqlite3_result_int64(ctx, toEpochMilliseconds(current->time));
+                break;
+            case Column::kind:
+                sqlite3_result_text(ctx, recordKindName(current->kind), -1,
+                                    SQLITE_STATIC);
+                break;
+            case Column::value:
+                sqlite3_result_int64(ctx, current->value);
+                break;
+        }
+    }
+
+    sqlite3_int64 rowid() const
+    {
+        // Position in the file, which is stable as the file grows. advance()
+        // leaves recordIndex one past the current record.
+        return static_cast<sqlite3_int64>(
+            blockIndex * history::recordsPerBlock + recordIndex - 1);
+    }
+
+  private:
+    // Moves to the next record in range, leaving recordIndex one past it
+    void advance()
+    {
+        current.reset();
+        while (blockIndex < reader->blockCount())
+        {
+            if (recordIndex < block.records.size())
+            {
+                const history::Record record =
+                    history::widen(block.base, block.records[recordIndex++]);
+                if (record.time >= from && record.time <= to)
+                {
+                    current = record;
+                    return;
+                }
+                continue;
+            }
+
+            recordIndex = 0;
+            blockIndex = reader->nextBlock(blockIndex, from, to);
+            if (blockIndex < reader->blockCount())
+            {
+                block = reader->block(blockIndex);
+            }
+        }
+    }
+
+    const Table& table;
+    std::optional<HistoryReader> reader;
+    Time from;
+    Time to;
+    size_t blockIndex = 0;
+    size_t recordIndex = 0;
+    history::Block block{};
+    std::optional<history::Record> current;
+};
+
+// Cycles and sleep periods depend on everything before them, so are rebuilt
+// from the whole file on each scan. There are few enough to hold in memory.
+template <typename Row>
+class DerivedCursor
+{
+  public:
+    static int bestIndex(sqlite3_index_info* info)
+    {
+        info->estimatedCost = 1000000;
+        info->estimatedRows = 1000;
+        return SQLITE_OK;
+    }
+
+    explicit DerivedCursor(const Table& table) : table(table) {}
+
+    void filter(int, sqlite3_value**)
+    {
+        rows.clear();
+        index = 0;
+        const HistoryReader reader(table.path);
+        CycleTracker tracker = makeTracker();
+        reader.forEach(
+            [&](const history::Record& record) { tracker.add(record); });
+        tracker.finish();
+    }
+
+    void next()
+    {
+        ++index;
+    }
+
+    bool eof() const
+    {
+        return index >= rows.size();
+    }
+
+    void column(sqlite3_context* ctx, int column) const;
+
+    sqlite3_int64 rowid() const
+    {
+        return static_cast<sqlite3_int64>(index);
+    }
+
+    static const char* const schema;
+
+  private:
+    CycleTracker makeTracker();
+
+    const Table& table;
+    std::vector<Row> rows;
+    size_t index = 0;
+};
+
+using CyclesCursor = DerivedCursor<Cycle>;
+using SleepCursor = DerivedCursor<SleepPeriod>;
+
+template <>
+const char* const CyclesCursor::schema =
+    "CREATE TABLE x(state TEXT, start INTEGER, end INTEGER,"
+    " start_energy INTEGER, end_energy INTEGER, awake INTEGER,"
+    " asleep INTEGER, sleep_energy INTEGER, suspends INTEGER, open INTEGER,"
+    " awake_energy INTEGER, asleep_energy INTEGER, resume_energy INTEGER,"
+    " unaccounted_energy INTEGER, closure_error INTEGER,"
+    " equivalent_cycles REAL, depth_half_cycles TEXT, high_charge_time INTEGER,"
+    " high_temperature_time INTEGER)";
+
+template <>
+CycleTracker CyclesCursor::makeTracker()
+{
+    return CycleTracker([this](const Cycle& cycle) { rows.push_back(cycle); });
+}
+
+template <>
+void CyclesCursor::column(sqlite3_context* ctx, int column) const
+{
+    const Cycle& cycle = rows[index];
+    switch (column)
+    {
+        case 0:
+            sqlite3_result_text(ctx, batteryStateName(cycle.state), -1,
+                                SQLITE_STATIC);
+            break;
+        case 1:
+            sqlite3_result_int64(ctx, toEpochMilliseconds(cycle.start));
+            break;
+        case 2:
+            sqlite3_result_int64(ctx, toEpochMilliseconds(cycle.end));
+            break;
+        case 3:
+            resultEnergy(ctx, cycle.startEnergy);
+            break;
+        case 4:
+            resultEnergy(ctx, cycle.endEnergy);
+            break;
+        case 5:
+            sqlite3_result_int64(ctx, cycle.awakeTime().count());
+            break;
+        case 6:
+            sqlite3_result_int64(ctx, cycle.asleepTime.count());
+            break;
+        case 7:
+            sqlite3_result_int64(ctx, cycle.sleepEnergy);
+            break;
+        case 8:
+            sqlite3_result_int64(ctx, cycle.suspendCount);
+            break;
+        case 9:
+            sqlite3_result_int(ctx, cycle.open);
+            break;
+        case 10:
+            sqlite3_result_int64(ctx, cycle.ledger.awake);
+            break;
+        case 11:
+            sqlite3_result_int64(ctx, cycle.ledger.asleep);
+            break;
+        case 12:
+            sqlite3_result_int64(ctx, cycle.ledger.resumeTransient);
+            break;
+        case 13:
+            sqlite3_result_int64(ctx, cycle.ledger.unaccounted);
+            break;
+        case 14:
+            sqlite3_result_int64(ctx, cycle.ledger.closureError);
+            break;
+        case 15:
+            sqlite3_result_double(ctx, cycle.wear.equivalentCycles);
+            break;
+        case 16:
+        {
+            std::array<char, 128> halfCycles;
+            const char* end = cycle.wear.formatHalfCycles(halfCycles.data());
+            sqlite3_result_text(ctx, halfCycles.data(),
+                                static_cast<int>(end - halfCycles.data()),
+                                SQLITE_TRANSIENT);
+            break;
+        }
+        case 17:
+            sqlite3_result_int64(ctx, cycle.wear.highChargeTime.count());
+            break;
+        case 18:
+            sqlite3_result_int64(ctx, cycle.wear.highTemperatureTime.count());
+            break;
+    }
+}
+
+template <>
+const char* const SleepCursor::schema =
+    "CREATE TABLE x(start INTEGER, end INTEGER, energy_before INTEGER,"
+    " energy_after INTEGER)";
+
+template <>
+CycleTracker SleepCursor::makeTracker()
+{
+    return CycleTracker([](const Cycle&) {}, [this](const SleepPeriod& sleep) {
+        rows.push_back(sleep);
+    });
+}
+
+template <>
+void SleepCursor::column(sqlite3_context* ctx, int column) const
+{
+    const SleepPeriod& sleep = rows[index];
+    switch (column)
+    {
+        case 0:
+            sqlite3_result_int64(ctx, toEpochMilliseconds(sleep.start));
+            break;
+        case 1:
+            sqlite3_result_int64(ctx, toEpochMilliseconds(sleep.end));
+            break;
+        case 2:
+            resultEnergy(ctx, sleep.energyBefore);
+            break;
+        case 3:
+            resultEnergy(ctx, sleep.energyAfter);
+            break;
+    }
+}
+
+// Module arguments arrive as written in CREATE VIRTUAL TABLE, quotes included
+std::filesystem::path unquote(std::string_view arg)
+{
+    if (arg.size() >= 2 && (arg.front() == '\'' || arg.front() == '"') &&
+        arg.back() == arg.front())
+    {
+        arg = arg.substr(1, arg.size() - 2);
+    }
+    return arg;
+}
+
+template <typename Cursor>
+struct VirtualCursor : sqlite3_vtab_cursor
+{
+    explicit VirtualCursor(const Table& table) : cursor(table) {}
+
+    Cursor cursor;
+};
+
+template <typename Cursor>
+sqlite3_module makeModule()
+{
+    using Wrapper = VirtualCursor<Cursor>;
+
+    sqlite3_module module{};
+    // Same function for both, so each table is also usable without CREATE
+    // VIRTUAL TABLE, on the default history file.
+    module.xCreate = module.xConnect =
+        [](sqlite3* db, void*, int argc, const char* const* argv,
+           sqlite3_vtab** vtab, char** err) {
+        const int rc = sqlite3_declare_vtab(db, Cursor::schema);
+        if (rc != SQLITE_OK)
+        {
+            return rc;
+        }
+        try
+        {
+            auto* table = new Table();
+            table->path =
+                argc > 3 ? unquote(argv[3]) : history::defaultPath();
+            *vtab = table;
+        }
+        catch (const std::exception& e)
+        {
+            *err = sqlite3_mprintf("%s", e.what());
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    };
+    module.xBestIndex = [](sqlite3_vtab*, sqlite3_index_info* info) {
+        return Cursor::bestIndex(info);
+    };
+    module.xDisconnect = module.xDestroy = [](sqlite3_vtab* vtab) {
+        delete static_cast<Table*>(vtab);
+        return SQLITE_OK;
+    };
+    module.xOpen = [](sqlite3_vtab* vtab, sqlite3_vtab_cursor** cursor) {
+        try
+        {
+            *cursor = new Wrapper(*static_cast<Table*>(vtab));
+        }
+        catch (const std::exception&)
+        {
+            return SQLITE_NOMEM;
+        }
+        return SQLITE_OK;
+    };
+    module.xClose = [](sqlite3_vtab_cursor* cursor) {
+        delete static_cast<Wrapper*>(cursor);
+        return SQLITE_OK;
+    };
+    module.xFilter = [](sqlite3_vtab_cursor* cursor, int idxNum, const char*,
+                        int, sqlite3_value** argv) {
+        try
+        {
+            static_cast<Wrapper*>(cursor)->cursor.filter(idxNum, argv);
+        }
+        catch (const std::exception& e)
+        {
+            sqlite3_free(cursor->pVtab->zErrMsg);
+            cursor->pVtab->zErrMsg = sqlite3_mprintf("%s", e.what());
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    };
+    module.xNext = [](sqlite3_vtab_cursor* cursor) {
+        static_cast<Wrapper*>(cursor)->cursor.next();
+        return SQLITE_OK;
+    };
+    module.xEof = [](sqlite3_vtab_cursor* cursor) {
+        return static_cast<int>(static_cast<Wrapper*>(cursor)->cursor.eof());
+    };
+    module.xColumn = [](sqlite3_vtab_cursor* cursor, sqlite3_context* ctx,
+                        int column) {
+        static_cast<Wrapper*>(cursor)->cursor.column(ctx, column);
+        return SQLITE_OK;
+    };
+    module.xRowid = [](sqlite3_vtab_cursor* cursor, sqlite3_int64* rowid) {
+        *rowid = static_cast<Wrapper*>(cursor)->cursor.rowid();
+        return SQLITE_OK;
+    };
+    return module;
+}
+
+const sqlite3_module readingsModule = makeModule<ReadingsCursor>();
+const sqlite3_module cyclesModule = makeModule<CyclesCursor>();
+const sqlite3_module sleepModule = makeModule<SleepCursor>();
+
+} // namespace
+
+// Entry point SQLite looks for when loading batterystats.so
+extern "C" int sqlite3_batterystats_init(sqlite3* db, char**,
+                                         const sqlite3_api_routines* api)
+{
+    SQLITE_EXTENSION_INIT2(api);
+
+    int rc = sqlite3_create_module(db, "battery_readings", &readingsModule,
+                                   nullptr);
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_create_module(db, "battery_cycles", &cyclesModule,
+                                   nullptr);
+    }
+    if (rc == SQLITE_OK)
+    {
+        rc = sqlite3_create_module(db, "battery_sleep", &sleepModule,
+                                   nullptr);
+    }
+    return rc;
+}
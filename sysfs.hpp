@@ -0,0 +1,75 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <array>
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+// Helpers for sysfs attributes that are opened once and read many times.
+// Reads go from offset 0 with pread(), which re-reads the current value, and
+// use the caller's buffers, so they don't allocate.
+namespace sysfs
+{
+
+// Returns -1 if the attribute doesn't exist or can't be read
+inline int openAttribute(const std::filesystem::path& path)
+{
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+inline void closeAttribute(int fd)
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+// The value without its trailing newline, or empty on error
+inline std::string_view readText(int fd, std::span<char> buf)
+{
+    if (fd < 0)
+    {
+        return {};
+    }
+    const ssize_t len = pread(fd, buf.data(), buf.size(), 0);
+    std::string_view text(buf.data(), len > 0 ? static_cast<size_t>(len) : 0);
+    while (text.ends_with('\n'))
+    {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+inline std::optional<int64_t> readInteger(int fd)
+{
+    std::array<char, 32> buf;
+    const std::string_view text = readText(fd, buf);
+    int64_t value = 0;
+    const auto [end, ec] =
+        std::from_chars(text.data(), text.data() + text.size(), value);
+    if (text.empty() || ec != std::errc())
+    {
+        return std::nullopt;
+    }
+    return value;
+}
+
+// Reads a short attribute by path, for while finding devices
+inline std::string readFile(const std::filesystem::path& path)
+{
+    const int fd = openAttribute(path);
+    std::array<char, 256> buf;
+    std::string text(readText(fd, buf));
+    closeAttribute(fd);
+    return text;
+}
+
+} // namespace sysfs
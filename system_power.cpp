@@ -0,0 +1,276 @@
+#include "system_power.hpp"
+
+#include "sysfs.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace
+{
+
+// Energy counters sampled further apart than this, e.g. after a spell on
+// battery, are restarted rather than averaged over the gap
+constexpr std::chrono::minutes maxCounterInterval{10};
+
+} // namespace
+
+SystemPowerMeter::SystemPowerMeter(const std::filesystem::path& sysfsRoot)
+{
+    // Errors while looking just mean fewer sensors
+    std::error_code ec;
+
+    for (const auto& entry : std::filesystem::directory_iterator(
+             sysfsRoot / "class/power_supply", ec))
+    {
+        const std::string type = sysfs::readFile(entry.path() / "type");
+        if (type != "Mains" && !type.starts_with("USB"))
+        {
+            continue;
+        }
+        const auto& dir = entry.path();
+        Adapter adapter{
+            .online = sysfs::openAttribute(dir / "online"),
+            .power = sysfs::openAttribute(dir / "power_now"),
+            .voltage = sysfs::openAttribute(dir / "voltage_now"),
+            .current = sysfs::openAttribute(dir / "current_now")};
+        const bool measured = adapter.power >= 0 ||
+                              (adapter.voltage >= 0 && adapter.current >= 0);
+        if (adapter.online >= 0 && measured)
+        {
+            adapters.push_back(adapter);
+        }
+        else
+        {
+            for (const int fd : {adapter.online, adapter.power, adapter.voltage,
+                                 adapter.current})
+            {
+                sysfs::closeAttribute(fd);
+            }
+        }
+    }
+
+    // Top-level RAPL zones only (intel-rapl:0, not intel-rapl:0:0), as the
+    // subzones are part of them. energy_uj is often readable by root only.
+    for (const auto& entry :
+         std::filesystem::directory_iterator(sysfsRoot / "class/powercap", ec))
+    {
+        const std::string zone = entry.path().filename().string();
+        if (!zone.starts_with("intel-rapl:") ||
+            zone.find(':') != zone.rfind(':'))
+        {
+            continue;
+        }
+        const std::string name = sysfs::readFile(entry.path() / "name");
+        const bool isPlatform = name == "psys";
+        if (!isPlatform && !name.starts_with("package"))
+        {
+            continue;
+        }
+        const int rangeFd =
+            sysfs::openAttribute(entry.path() / "max_energy_range_uj");
+        const auto range = sysfs::readInteger(rangeFd);
+        sysfs::closeAttribute(rangeFd);
+        const int fd = sysfs::openAttribute(entry.path() / "energy_uj");
+        if (!range || *range <= 0 || !sysfs::readInteger(fd))
+        {
+            sysfs::closeAttribute(fd);
+            continue;
+        }
+        (isPlatform ? platform : packages)
+            .push_back({.fd = fd, .range = static_cast<uint64_t>(*range)});
+    }
+
+    for (const auto& chip :
+         std::filesystem::directory_iterator(sysfsRoot / "class/hwmon", ec))
+    {
+        for (const auto& entry :
+             std::filesystem::directory_iterator(chip.path(), ec))
+        {
+            const std::string name = entry.path().filename().string();
+            if (!name.starts_with("power") ||
+                !(name.ends_with("_input") || name.ends_with("_average")))
+            {
+                continue;
+            }
+            // One attribute per sensor, preferring the instantaneous one, as
+            // some (e.g. amdgpu) have both
+            if (constexpr std::string_view average = "_average";
+                name.ends_with(average))
+            {
+                const std::string input =
+                    name.substr(0, name.size() - average.size()) + "_input";
+                const int inputFd = sysfs::openAttribute(chip.path() / input);
+                const bool haveInput = sysfs::readInteger(inputFd).has_value();
+                sysfs::closeAttribute(inputFd);
+                if (haveInput)
+                {
+                    continue;
+                }
+            }
+            const int fd = sysfs::openAttribute(entry.path());
+            if (sysfs::readInteger(fd))
+            {
+                hwmonSensors.push_back(fd);
+            }
+            else
+            {
+                sysfs::closeAttribute(fd);
+            }
+        }
+    }
+}
+
+SystemPowerMeter::~SystemPowerMeter()
+{
+    for (const Adapter& adapter : adapters)
+    {
+        for (const int fd :
+             {adapter.online, adapter.power, adapter.voltage, adapter.current})
+        {
+            sysfs::closeAttribute(fd);
+        }
+    }
+    for (const auto* counters : {&platform, &packages})
+    {
+        for (const EnergyCounter& counter : *counters)
+        {
+            sysfs::closeAttribute(counter.fd);
+        }
+    }
+    for (const int fd : hwmonSensors)
+    {
+        sysfs::closeAttribute(fd);
+    }
+}
+
+bool SystemPowerMeter::empty() const
+{
+    return adapters.empty() && platform.empty() && packages.empty() &&
+           hwmonSensors.empty();
+}
+
+std::optional<SystemPower> SystemPowerMeter::sample(double batteryWatts)
+{
+    const RelTime now = RelClock::now();
+    std::optional<double> seconds;
+    if (lastSample && now - *lastSample <= maxCounterInterval)
+    {
+        seconds = std::chrono::duration<double>(now - *lastSample).count();
+    }
+    lastSample = now;
+
+    // Counters are read on every sample, so they're ready when needed
+    const auto platformWatts = counterWatts(platform, seconds);
+    const auto packageWatts = counterWatts(packages, seconds);
+
+    if (const auto adapter = adapterWatts())
+    {
+        // The adapter feeds both the system and the battery
+        return SystemPower{.watts = std::max(*adapter - batteryWatts, 0.0),
+                           .source = PowerSource::Adapter};
+    }
+    if (platformWatts)
+    {
+        return SystemPower{.watts = *platformWatts,
+                           .source = PowerSource::Platform};
+    }
+    if (packageWatts)
+    {
+        return SystemPower{.watts = *packageWatts,
+                           .source = PowerSource::Components};
+    }
+    if (const auto hwmon = hwmonWatts())
+    {
+        return SystemPower{.watts = *hwmon, .source = PowerSource::Components};
+    }
+    return std::nullopt;
+}
+
+// Sums the online adapters that report their power. Some USB-PD ports give
+// the negotiated rather than the measured current, which overestimates.
+std::optional<double> SystemPowerMeter::adapterWatts() const
+{
+    std::optional<double> total;
+    for (const Adapter& adapter : adapters)
+    {
+        if (sysfs::readInteger(adapter.online).value_or(0) == 0)
+        {
+            continue;
+        }
+        std::optional<double> watts;
+        if (const auto power = sysfs::readInteger(adapter.power))
+        {
+            watts = static_cast<double>(*power) / 1e6;
+        }
+        else if (const auto voltage = sysfs::readInteger(adapter.voltage))
+        {
+            if (const auto current = sysfs::readInteger(adapter.current))
+            {
+                watts = static_cast<double>(*voltage) / 1e6 *
+                        static_cast<double>(std::abs(*current)) / 1e6;
+            }
+        }
+        if (watts)
+        {
+            total = total.value_or(0) + *watts;
+        }
+    }
+    return total;
+}
+
+std::optional<double> SystemPowerMeter::hwmonWatts() const
+{
+    std::optional<double> total;
+    for (const int fd : hwmonSensors)
+    {
+        if (const auto microwatts = sysfs::readInteger(fd))
+        {
+            total = total.value_or(0) + static_cast<double>(*microwatts) / 1e6;
+        }
+    }
+    return total;
+}
+
+std::optional<double>
+    SystemPowerMeter::counterWatts(std::vector<EnergyCounter>& counters,
+                                   std::optional<double> seconds)
+{
+    if (counters.empty())
+    {
+        return std::nullopt;
+    }
+    bool complete = seconds && *seconds > 0;
+    double microjoules = 0;
+    for (EnergyCounter& counter : counters)
+    {
+        const auto value = sysfs::readInteger(counter.fd);
+        if (!value)
+        {
+            complete = false;
+            counter.last.reset();
+            continue;
+        }
+        const auto current = static_cast<uint64_t>(*value);
+        if (counter.last)
+        {
+            microjoules += static_cast<double>(
+                current >= *counter.last
+                    ? current - *counter.last
+                    : counter.range - *counter.last + current);
+        }
+        else
+        {
+            complete = false;
+        }
+        counter.last = current;
+    }
+    if (!complete)
+    {
+        return std::nullopt;
+    }
+    return microjoules / 1e6 / *seconds;
+}
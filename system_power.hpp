@@ -0,0 +1,94 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+// Where a system power estimate came from, best first
+enum class PowerSource : uint8_t
+{
+    // Adapter input (power_supply power_now, or voltage_now * current_now
+    // for USB-PD) less what goes into the battery
+    Adapter,
+    // RAPL's psys domain, which covers the whole platform
+    Platform,
+    // RAPL package domains or hwmon power sensors: a lower bound, missing
+    // the display, storage and anything else without a sensor
+    Components,
+};
+
+inline const char* powerSourceName(PowerSource source)
+{
+    switch (source)
+    {
+        case PowerSource::Adapter:
+            return "adapter";
+        case PowerSource::Platform:
+            return "platform";
+        case PowerSource::Components:
+            return "components";
+    }
+    return "unknown";
+}
+
+struct SystemPower
+{
+    double watts;
+    PowerSource source;
+};
+
+// Estimates what the whole system draws while on AC, when the battery's rate
+// only says how fast it's charging. Sensors are found once, at construction,
+// and their sysfs attributes kept open, so each sample is a handful of
+// pread() calls and doesn't allocate.
+class SystemPowerMeter
+{
+  public:
+    explicit SystemPowerMeter(const std::filesystem::path& sysfsRoot = "/sys");
+    SystemPowerMeter(const SystemPowerMeter&) = delete;
+    SystemPowerMeter& operator=(const SystemPowerMeter&) = delete;
+    ~SystemPowerMeter();
+
+    // Whether any sensor was found
+    bool empty() const;
+
+    // batteryWatts is the power going into the battery, negative when it's
+    // discharging. Energy counters need two samples before they give a
+    // power, so the first sample may come back empty.
+    std::optional<SystemPower> sample(double batteryWatts);
+
+  private:
+    struct Adapter
+    {
+        int online = -1;
+        // Either power, or both voltage and current
+        int power = -1;
+        int voltage = -1;
+        int current = -1;
+    };
+
+    // A RAPL energy_uj counter, which wraps at max_energy_range_uj
+    struct EnergyCounter
+    {
+        int fd = -1;
+        uint64_t range = 0;
+        std::optional<uint64_t> last{};
+    };
+
+    std::optional<double> adapterWatts() const;
+    std::optional<double> hwmonWatts() const;
+    // Average power since the last sample, if every counter has one
+    static std::optional<double>
+        counterWatts(std::vector<EnergyCounter>& counters,
+                     std::optional<double> seconds);
+
+    std::vector<Adapter> adapters;
+    std::vector<EnergyCounter> platform;
+    std::vector<EnergyCounter> packages;
+    // hwmon power*_input files, in uW
+    std::vector<int> hwmonSensors;
+    std::optional<RelTime> lastSample;
+};
@@ -0,0 +1,198 @@
+// Writes histories with the wall clock stepping back and with old blocks past
+// retention, and checks range reads still find exactly the records in range
+// and the state in effect before them.
+
+#include "history.hpp"
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <utility>
+
+namespace
+{
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+size_t countRecords(const HistoryReader& reader, Time from, Time to)
+{
+    size_t count = 0;
+    reader.forEach(from, to, [&](const history::Record& record) {
+        check(record.time >= from && record.time <= to, "record in range");
+        ++count;
+    });
+    return count;
+}
+
+// A record a minute from `start`, with the energy counting up so each is
+// distinct
+void writeMinutes(HistoryWriter& writer, Time start, RelTime& relTime,
+                  int minutes)
+{
+    for (int i = 0; i < minutes; ++i)
+    {
+        relTime += std::chrono::minutes(1);
+        writer.append(RecordKind::Energy, start + std::chrono::minutes(i),
+                      relTime, 1000 + i);
+    }
+}
+
+void testClockStepBack(const std::filesystem::path& path)
+{
+    using std::chrono::days;
+    using std::chrono::minutes;
+
+    const Time start{std::chrono::sys_days{std::chrono::year{2025} /
+                                           std::chrono::March / 1}};
+    const Time stepped = start - days(1);
+    RelTime relTime{};
+    {
+        HistoryWriter writer(path);
+        // Several blocks, then the clock goes back a day, then forward again
+        writeMinutes(writer, start, relTime, 1000);
+        writeMinutes(writer, stepped, relTime, 600);
+        writeMinutes(writer, start + minutes(2000), relTime, 300);
+    }
+
+    const HistoryReader reader(path);
+    check(countRecords(reader, Time::min(), Time::max()) == 1900,
+          "all records");
+    check(countRecords(reader, start, start + minutes(999)) == 1000,
+          "first run");
+    check(countRecords(reader, stepped, stepped + minutes(599)) == 600,
+          "run after the step back");
+    check(countRecords(reader, start + minutes(500), start + minutes(2099)) ==
+              600,
+          "range spanning two runs");
+    const Time later = stepped + minutes(100);
+    check(countRecords(reader, later, later + minutes(9)) == 10,
+          "small range in a later run");
+    check(reader.findBlock(start + minutes(3000)) == reader.blockCount(),
+          "nothing after the end");
+
+    const auto span = reader.timeSpan();
+    check(span && span->first == stepped &&
+              span->second == start + minutes(2299),
+          "time span covers every run");
+}
+
+void testStateBefore(const std::filesystem::path& path)
+{
+    using std::chrono::minutes;
+
+    const Time start{std::chrono::sys_days{std::chrono::year{2025} /
+                                           std::chrono::March / 1}};
+    RelTime relTime{};
+    {
+        HistoryWriter writer(path);
+        writer.append(RecordKind::EnergyFull, start, relTime, 50000000);
+        writer.append(RecordKind::BatteryState, start, relTime,
+                      std::to_underlying(BatteryState::Charging));
+        writeMinutes(writer, start, relTime, 1000);
+        writer.append(RecordKind::BatteryState, start + minutes(1000), relTime,
+                      std::to_underlying(BatteryState::Discharging));
+        writeMinutes(writer, start + minutes(1000), relTime, 1000);
+    }
+
+    const HistoryReader reader(path);
+    const Time from = start + minutes(1500);
+    const auto state = reader.stateBefore(from);
+    check(state.size() == 2, "latest state records found, several blocks back");
+    for (const history::Record& record : state)
+    {
+        check(record.time == from, "state retimed to the range start");
+        check(record.kind != RecordKind::EnergyFull ||
+                  record.value == 50000000,
+              "capacity from the start of the file");
+        check(record.kind != RecordKind::BatteryState ||
+                  record.value ==
+                      std::to_underlying(BatteryState::Discharging),
+              "latest battery state");
+    }
+    check(reader.stateBefore(start).empty(), "no state before the first");
+}
+
+bool canPunchHoles(const std::filesystem::path& path)
+{
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    const bool ok = fd >= 0 && ftruncate(fd, history::blockSize) == 0 &&
+                    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              0, history::blockSize) == 0;
+    close(fd);
+    std::filesystem::remove(path);
+    return ok;
+}
+
+void testRetention(const std::filesystem::path& path)
+{
+    using std::chrono::days;
+    using std::chrono::minutes;
+
+    if (!canPunchHoles(path))
+    {
+        std::printf("Skipping retention test: no hole punching here\n");
+        return;
+    }
+
+    const Time now{std::chrono::sys_days{std::chrono::year{2025} /
+                                         std::chrono::March / 1}};
+    RelTime relTime{};
+    {
+        HistoryWriter writer(path, days(30));
+        // 60 days of a record every 30 minutes
+        for (int i = 0; i < 60 * 48; ++i)
+        {
+            relTime += minutes(30);
+            writer.append(RecordKind::Energy,
+                          now - days(60) + minutes(30) * i, relTime, i);
+        }
+    }
+
+    const HistoryReader reader(path);
+    const auto span = reader.timeSpan();
+    // Kept from at most a block before the cutoff
+    const auto blockSpan = minutes(30) * history::recordsPerBlock;
+    check(span && span->first >= now - days(30) - 2 * blockSpan &&
+              span->first < now - days(30),
+          "old blocks freed, recent ones kept");
+    check(countRecords(reader, now - days(30), now) >= 30 * 48 - 1,
+          "records within retention kept");
+}
+
+} // namespace
+
+int main()
+{
+    const std::filesystem::path path =
+        std::filesystem::temp_directory_path() /
+        ("battery-stats-history-test-" + std::to_string(getpid()));
+
+    testClockStepBack(path);
+    std::filesystem::remove(path);
+    testRetention(path);
+    std::filesystem::remove(path);
+    testStateBefore(path);
+    std::filesystem::remove(path);
+
+    if (failures != 0)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("History tests passed\n");
+    return 0;
+}
@@ -0,0 +1,198 @@
+// Sends the query server many pipelined requests without reading, so replies
+// back up, and checks every one of them still arrives. Then sends requests
+// and shuts down the writing side, as `echo stats | socat ...` does, and
+// checks the replies, including a streamed query, arrive before the close.
+
+#include "battery_monitor.hpp"
+#include "history.hpp"
+#include "query_server.hpp"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace
+{
+
+// Each stats reply is around 100 bytes, so this is several times the
+// server's output buffer
+constexpr int requestCount = 5000;
+// Likewise for the records a query streams
+constexpr int recordCount = 3000;
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+    if (!ok)
+    {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+int connectTo(const std::filesystem::path& path)
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::ranges::copy(path.native(), addr.sun_path);
+    if (fd < 0 ||
+        connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) <
+            0)
+    {
+        std::perror("connect");
+        return -1;
+    }
+    return fd;
+}
+
+size_t countOf(std::string_view text, std::string_view word)
+{
+    size_t count = 0;
+    for (size_t pos = 0; (pos = text.find(word, pos)) != std::string::npos;
+         ++pos)
+    {
+        ++count;
+    }
+    return count;
+}
+
+// Writes the requests all at once, blocking while the server holds off, and
+// reads the replies until the server closes the connection or, unless
+// halfClose, until the reply to a request ending in `end COUNT`
+std::string exchange(sd_event* event, const std::filesystem::path& socketPath,
+                     const std::string& requests, bool halfClose)
+{
+    const int fd = connectTo(socketPath);
+    if (fd < 0)
+    {
+        return {};
+    }
+
+    std::jthread writer([fd, &requests, halfClose] {
+        for (size_t sent = 0; sent < requests.size();)
+        {
+            const ssize_t len = send(fd, requests.data() + sent,
+                                     requests.size() - sent, MSG_NOSIGNAL);
+            if (len <= 0)
+            {
+                return;
+            }
+            sent += static_cast<size_t>(len);
+        }
+        if (halfClose)
+        {
+            shutdown(fd, SHUT_WR);
+        }
+    });
+
+    std::string replies;
+    std::atomic<bool> done = false;
+    std::jthread reader([fd, &done, &replies, halfClose] {
+        std::array<char, 4096> buf;
+        while (halfClose || !replies.contains("\nend "))
+        {
+            const ssize_t len = recv(fd, buf.data(), buf.size(), 0);
+            if (len <= 0)
+            {
+                break;
+            }
+            replies.append(buf.data(), static_cast<size_t>(len));
+        }
+        done = true;
+    });
+
+    while (!done)
+    {
+        sd_event_run(event, 100'000);
+    }
+    writer.join();
+    reader.join();
+    close(fd);
+    return replies;
+}
+
+} // namespace
+
+int main()
+{
+    const std::string suffix = std::to_string(getpid());
+    const std::filesystem::path tempDir =
+        std::filesystem::temp_directory_path();
+    const std::filesystem::path socketPath =
+        tempDir / ("battery-stats-query-test-" + suffix);
+    const std::filesystem::path historyPath =
+        tempDir / ("battery-stats-query-test-history-" + suffix);
+
+    const Time start{std::chrono::sys_days{std::chrono::year{2025} /
+                                           std::chrono::March / 1}};
+    {
+        HistoryWriter writer(historyPath);
+        RelTime relTime{};
+        for (int i = 0; i < recordCount; ++i)
+        {
+            relTime += std::chrono::minutes(1);
+            writer.append(RecordKind::Energy, start + std::chrono::minutes(i),
+                          relTime, 1000 + i);
+        }
+    }
+
+    sd_event* event = nullptr;
+    if (sd_event_new(&event) < 0)
+    {
+        std::fprintf(stderr, "Failed to create event loop\n");
+        return 1;
+    }
+
+    {
+        BatteryMonitor batmon;
+        batmon.setPrinting(false);
+        QueryServer server(event, batmon, historyPath, socketPath);
+
+        std::string requests;
+        for (int i = 0; i < requestCount; ++i)
+        {
+            requests += "stats\n";
+        }
+        requests += "latency\n";
+        const std::string pipelined =
+            exchange(event, socketPath, requests, false);
+        check(countOf(pipelined, "stats ") == requestCount,
+              "every pipelined stats reply arrives");
+
+        const std::string halfClosed = exchange(
+            event, socketPath,
+            std::format("stats\nquery {} {}\n", toEpochMilliseconds(start),
+                        toEpochMilliseconds(start + std::chrono::days(7))),
+            true);
+        check(countOf(halfClosed, "stats ") == 1,
+              "stats reply arrives after the client shuts down writing");
+        check(countOf(halfClosed, "record ") == recordCount &&
+                  halfClosed.ends_with(std::format("end {}\n", recordCount)),
+              "query streams in full after the client shuts down writing");
+    }
+    sd_event_unref(event);
+    std::filesystem::remove(historyPath);
+
+    if (failures != 0)
+    {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    std::printf("Query server tests passed\n");
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Drives the steady-state event path with synthetic battery updates and
+// checks it makes no heap allocations. Built with the counting allocator from
+// alloc_accounting.cpp; see meson.build.
+
+#include "alloc_accounting.hpp"
+#include "battery_monitor.hpp"
+#include "battery_properties.hpp"
+#include "history.hpp"
+#include "network_activity.hpp"
+#include "runtime_pm.hpp"
+#include "system_power.hpp"
+
+#include <systemd/sd-event.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <thread>
+
+namespace
+{
+
+// UPower's Device.State values
+constexpr uint32_t charging = 1;
+constexpr uint32_t discharging = 2;
+constexpr uint32_t fullyCharged = 4;
+
+constexpr int warmupUpdates = 20;
+constexpr int checkedUpdates = 300;
+
+BatteryProperties reading(int i)
+{
+    BatteryProperties properties;
+    properties.energy = 40.0 - 0.01 * i;
+    properties.voltage = 12.0 - 0.001 * (i % 50);
+    properties.energyRate = 8.0 + (i % 7);
+    properties.temperature = 30.0 + 0.1 * (i % 20);
+    properties.count = 6;
+
+    // Now and then, everything else an update can carry
+    switch (i % 60)
+    {
+        case 10:
+            properties.state = charging;
+            break;
+        case 20:
+            properties.state = fullyCharged;
+            properties.chargeEndThreshold = 80;
+            properties.chargeThresholdEnabled = true;
+            break;
+        case 30:
+            properties.state = discharging;
+            properties.energyEmpty = 0.0;
+            properties.energyFull = 50.0 - 0.001 * i;
+            break;
+        case 40:
+            properties.chargeThresholdEnabled = false;
+            break;
+    }
+    return properties;
+}
+
+} // namespace
+
+int main()
+{
+    const std::filesystem::path historyPath =
+        std::filesystem::temp_directory_path() /
+        ("battery-stats-alloc-test-" + std::to_string(getpid()));
+
+    sd_event* event = nullptr;
+    if (sd_event_new(&event) < 0)
+    {
+        std::fprintf(stderr, "Failed to create event loop\n");
+        return 1;
+    }
+
+    int failures = 0;
+    {
+        HistoryWriter history(historyPath);
+        BatteryMonitor batmon(&history);
+
+        // The samplers read the real /sys, whatever it has. Those that can't
+        // be set up here are left out, as in the daemon.
+        SystemPowerMeter powerMeter;
+        std::optional<RuntimePmAudit> runtimePm;
+        std::optional<NetworkActivity> network;
+        try
+        {
+            runtimePm.emplace(event);
+            network.emplace(event);
+        }
+        catch (const std::exception& e)
+        {
+            std::printf("Skipping uevent-based samplers: %s\n", e.what());
+        }
+        const Samplers samplers{
+            .powerMeter = &powerMeter,
+            .runtimePm = runtimePm ? &*runtimePm : nullptr,
+            .network = network ? &*network : nullptr};
+
+        BatteryProperties initial = reading(0);
+        initial.state = discharging;
+        initial.energyEmpty = 0.0;
+        initial.energyFull = 50.0;
+        processBatteryProperties(batmon, initial, samplers);
+
+        for (int i = 1; i <= warmupUpdates + checkedUpdates; ++i)
+        {
+            // Readings need time between them for rates to be measured
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+            const bool checked = i > warmupUpdates;
+            const size_t before = allocationCount();
+            if (i % 100 == 50)
+            {
+                batmon.setPowerState(PowerState::Suspended);
+                batmon.setPowerState(PowerState::Awake);
+            }
+            processBatteryProperties(batmon, reading(i), samplers);
+            const size_t allocations = allocationCount() - before;
+
+            if (checked && allocations != 0)
+            {
+                std::fprintf(stderr, "Update %d made %zu heap allocation(s)\n",
+                             i, allocations);
+                ++failures;
+            }
+        }
+    }
+
+    sd_event_unref(event);
+    std::filesystem::remove(historyPath);
+
+    if (failures != 0)
+    {
+        std::fprintf(stderr, "%d of %d updates allocated\n", failures,
+                     checkedUpdates);
+        return 1;
+    }
+    std::printf("%d updates, no heap allocations\n", checkedUpdates);
+    return 0;
+}
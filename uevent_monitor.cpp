@@ -0,0 +1,120 @@
+#include "uevent_monitor.hpp"
+
+#include <linux/netlink.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <system_error>
+#include <utility>
+
+UeventMonitor::UeventMonitor(sd_event* event,
+                             std::initializer_list<std::string_view> subsystems,
+                             std::function<void()> onChange) :
+    onChange(std::move(onChange))
+{
+    for (const std::string_view subsystem : subsystems)
+    {
+        subsystemFields.push_back("SUBSYSTEM=" + std::string(subsystem));
+    }
+
+    fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+    {
+        throw std::system_error(errno, std::generic_category(),
+                                "Creating uevent socket");
+    }
+
+    // Group 1 carries the kernel's own uevents
+    sockaddr_nl addr{};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = 1;
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        const int err = errno;
+        close(fd);
+        throw std::system_error(err, std::generic_category(),
+                                "Listening for uevents");
+    }
+
+    const int r = sd_event_add_io(event, &source, fd, EPOLLIN, onUevent, this);
+    if (r < 0)
+    {
+        close(fd);
+        throw std::system_error(-r, std::generic_category(),
+                                "Adding uevent socket to event loop");
+    }
+}
+
+UeventMonitor::~UeventMonitor()
+{
+    sd_event_source_unref(source);
+    close(fd);
+}
+
+int UeventMonitor::onUevent(sd_event_source* /* source */, int fd,
+                            uint32_t /* revents */, void* userdata)
+{
+    auto* self = static_cast<UeventMonitor*>(userdata);
+
+    // Drain the socket, then call back once for the lot
+    bool changed = false;
+    std::array<char, 8192> buf;
+    while (true)
+    {
+        const ssize_t len = recv(fd, buf.data(), buf.size(), 0);
+        if (len < 0)
+        {
+            // Some uevents were dropped, any of which may have mattered
+            changed = changed || errno == ENOBUFS;
+            if (errno == ENOBUFS || errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        changed = changed ||
+                  self->isDeviceChange({buf.data(), static_cast<size_t>(len)});
+    }
+
+    if (changed)
+    {
+        self->onChange();
+    }
+    return 0;
+}
+
+// Whether a uevent ("ACTION@DEVPATH\0KEY=VALUE\0...") adds, removes or
+// renames a device of one of our subsystems
+bool UeventMonitor::isDeviceChange(std::string_view message) const
+{
+    const size_t at = message.find('@');
+    if (at == std::string_view::npos)
+    {
+        return false;
+    }
+    const std::string_view action = message.substr(0, at);
+    // A renamed network interface is a "move"
+    if (action != "add" && action != "remove" && action != "move")
+    {
+        return false;
+    }
+    for (size_t pos = message.find('\0'); pos != std::string_view::npos;)
+    {
+        const size_t next = message.find('\0', pos + 1);
+        const std::string_view field =
+            message.substr(pos + 1, next == std::string_view::npos
+                                        ? std::string_view::npos
+                                        : next - pos - 1);
+        if (std::ranges::find(subsystemFields, field) != subsystemFields.end())
+        {
+            return true;
+        }
+        pos = next;
+    }
+    return false;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Listens for the kernel's uevents on the sd-event loop and calls back when a
+// device of one of the given subsystems is added, removed or renamed, so lists
+// of devices can be kept without rescanning sysfs for every sample. A burst of
+// uevents gives one callback.
+class UeventMonitor
+{
+  public:
+    // Throws std::system_error if the uevent socket can't be set up
+    UeventMonitor(sd_event* event,
+                  std::initializer_list<std::string_view> subsystems,
+                  std::function<void()> onChange);
+    UeventMonitor(const UeventMonitor&) = delete;
+    UeventMonitor& operator=(const UeventMonitor&) = delete;
+    ~UeventMonitor();
+
+  private:
+    static int onUevent(sd_event_source* source, int fd, uint32_t revents,
+                        void* userdata);
+
+    bool isDeviceChange(std::string_view message) const;
+
+    // "SUBSYSTEM=..." fields to match
+    std::vector<std::string> subsystemFields;
+    std::function<void()> onChange;
+    int fd = -1;
+    sd_event_source* source = nullptr;
+};
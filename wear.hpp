@@ -0,0 +1,199 @@
+#pragma once
+
+#include "reading.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <optional>
+
+// Battery wear indicators. Cycles are counted by rainflow over the state of
+// charge, so a discharge from 90% to 40% with a brief top-up in the middle
+// counts as one 50% cycle plus a small one, not two medium ones.
+struct WearMetrics
+{
+    static constexpr size_t depthBins = 10;
+
+    // Rainflow half cycles by depth, in 10% bins of state of charge. A full
+    // cycle counts twice.
+    std::array<uint32_t, depthBins> halfCycles{};
+    // Sum of the depths of all half cycles over 200%
+    double equivalentCycles = 0;
+    std::chrono::milliseconds highChargeTime{0};
+    std::chrono::milliseconds highTemperatureTime{0};
+
+    WearMetrics operator-(const WearMetrics& other) const
+    {
+        WearMetrics result;
+        for (size_t i = 0; i < depthBins; ++i)
+        {
+            result.halfCycles[i] = halfCycles[i] - other.halfCycles[i];
+        }
+        result.equivalentCycles = equivalentCycles - other.equivalentCycles;
+        result.highChargeTime = highChargeTime - other.highChargeTime;
+        result.highTemperatureTime =
+            highTemperatureTime - other.highTemperatureTime;
+        return result;
+    }
+
+    // Writes the half cycle counts as "N,N,...,N" to out
+    template <typename Out>
+    Out formatHalfCycles(Out out) const
+    {
+        for (size_t i = 0; i < depthBins; ++i)
+        {
+            out = std::format_to(out, "{}{}", i == 0 ? "" : ",",
+                                 halfCycles[i]);
+        }
+        return out;
+    }
+};
+
+// Keeps WearMetrics up to date as readings arrive. Rainflow counting is done
+// on the fly with the three-point method: reversals are kept on a stack and a
+// cycle is counted as soon as a later range encloses it, so only the residue
+// of not yet closed cycles is stored. Storage is fixed, so nothing allocates.
+class WearTracker
+{
+  public:
+    // Percent state of charge and degrees Celsius above which time counts
+    static constexpr double highCharge = 80;
+    static constexpr double highTemperature = 40;
+    // Reversals smaller than this (percent) are taken as gauge noise
+    static constexpr double hysteresis = 1;
+
+    void stateOfCharge(Time time, double percent)
+    {
+        if (lastCharge && lastCharge->value >= highCharge &&
+            time > lastCharge->time)
+        {
+            totals.highChargeTime +=
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    time - lastCharge->time);
+        }
+        lastCharge = Sample{time, percent};
+        addPoint(percent);
+    }
+
+    void temperature(Time time, double celsius)
+    {
+        if (lastTemperature && lastTemperature->value >= highTemperature &&
+            time > lastTemperature->time)
+        {
+            totals.highTemperatureTime +=
+                std::chrono::duration_cast<std::chrono::milliseconds>(
+                    time - lastTemperature->time);
+        }
+        lastTemperature = Sample{time, celsius};
+    }
+
+    // Counts only closed cycles, not the residue still on the stack
+    const WearMetrics& metrics() const
+    {
+        return totals;
+    }
+
+  private:
+    struct Sample
+    {
+        Time time;
+        double value;
+    };
+
+    static constexpr size_t maxReversals = 128;
+
+    void addPoint(double value)
+    {
+        if (reversalCount == 0)
+        {
+            pushReversal(value);
+            extreme = value;
+            return;
+        }
+        if (direction == 0)
+        {
+            if (std::abs(value - reversals[reversalCount - 1]) >= hysteresis)
+            {
+                direction = value > extreme ? 1 : -1;
+                extreme = value;
+            }
+            return;
+        }
+        if ((value - extreme) * direction >= 0)
+        {
+            extreme = value;
+        }
+        else if (std::abs(value - extreme) >= hysteresis)
+        {
+            pushReversal(extreme);
+            direction = -direction;
+            extreme = value;
+        }
+    }
+
+    void pushReversal(double value)
+    {
+        if (reversalCount == maxReversals)
+        {
+            // Shouldn't happen with the hysteresis, but if it does the oldest
+            // range is counted as a half cycle, as at the start of the stack
+            count(std::abs(reversals[1] - reversals[0]), 1);
+            eraseReversals(0, 1);
+        }
+        reversals[reversalCount++] = value;
+
+        while (reversalCount >= 3)
+        {
+            const double x = std::abs(reversals[reversalCount - 1] -
+                                      reversals[reversalCount - 2]);
+            const double y = std::abs(reversals[reversalCount - 2] -
+                                      reversals[reversalCount - 3]);
+            if (x < y)
+            {
+                break;
+            }
+            if (reversalCount == 3)
+            {
+                // The range includes the starting point, so it's only a half
+                // cycle
+                count(y, 1);
+                eraseReversals(0, 1);
+            }
+            else
+            {
+                count(y, 2);
+                eraseReversals(reversalCount - 3, 2);
+            }
+        }
+    }
+
+    void eraseReversals(size_t first, size_t n)
+    {
+        std::copy(reversals.begin() + static_cast<ptrdiff_t>(first + n),
+                  reversals.begin() + static_cast<ptrdiff_t>(reversalCount),
+                  reversals.begin() + static_cast<ptrdiff_t>(first));
+        reversalCount -= n;
+    }
+
+    void count(double depth, uint32_t halves)
+    {
+        const auto bin = std::min(static_cast<size_t>(depth / 10),
+                                  WearMetrics::depthBins - 1);
+        totals.halfCycles[bin] += halves;
+        totals.equivalentCycles += depth * halves / 200;
+    }
+
+    WearMetrics totals;
+    std::optional<Sample> lastCharge;
+    std::optional<Sample> lastTemperature;
+
+    std::array<double, maxReversals> reversals{};
+    size_t reversalCount = 0;
+    // Direction and furthest point of the current run, not yet a reversal
+    int direction = 0;
+    double extreme = 0;
+};